@@ -0,0 +1,118 @@
+/*   bench.c - libruncmd spawn throughput benchmark
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <runcmd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_COMMAND "true"
+#define DEFAULT_SPAWNS 2000
+#define DEFAULT_MAX_THREADS 8
+
+static const char* command = DEFAULT_COMMAND;
+static int spawns_per_thread;
+static int failures;
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* worker(void* arg)
+{
+	int i, result, bad = 0;
+
+	(void) arg;
+	for (i = 0; i < spawns_per_thread; i++)
+	{
+		if (runcmd(command, &result, NULL) < 0 || !IS_EXECOK(result))
+			bad++;
+	}
+	pthread_mutex_lock(&failures_lock);
+	failures += bad;
+	pthread_mutex_unlock(&failures_lock);
+	return NULL;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char* argv[])
+{
+	int total = DEFAULT_SPAWNS, max_threads = DEFAULT_MAX_THREADS, nthreads, i;
+	pthread_t* tids;
+	double start, elapsed;
+	const char* mode = "fork";
+
+	if (argc > 1 && !strcmp(argv[1], "-z"))
+	{
+		if (runcmd_init(RUNCMD_ZYGOTE) < 0)
+		{
+			printf("Could not start the zygote.\n");
+			return 1;
+		}
+		mode = "zygote";
+		argv++;
+		argc--;
+	}
+
+	if (argc > 4)
+	{
+		printf("Usage:\n\t./bench [-z] [SPAWNS] [MAX THREADS] [COMMAND]\n");
+		return 0;
+	}
+	if (argc > 1)
+		total = atoi(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (argc > 3)
+		command = argv[3];
+
+	if (total <= 0 || max_threads <= 0)
+	{
+		printf("SPAWNS and MAX THREADS must be positive.\n");
+		return 1;
+	}
+
+	tids = (pthread_t*) malloc(sizeof(pthread_t)*max_threads);
+	if (tids == NULL)
+		return 1;
+
+	printf("command: \"%s\", %d spawns per run, %s mode\n", command, total, mode);
+	printf("%8s %12s %12s %9s\n", "threads", "seconds", "spawns/sec", "failures");
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+	{
+		spawns_per_thread = total/nthreads;
+		failures = 0;
+
+		start = now();
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&tids[i], NULL, worker, NULL);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tids[i], NULL);
+		elapsed = now() - start;
+
+		printf("%8d %12.3f %12.0f %9d\n", nthreads, elapsed, spawns_per_thread*nthreads/elapsed, failures);
+	}
+	free(tids);
+	return 0;
+}
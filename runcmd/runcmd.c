@@ -16,139 +16,1324 @@
      You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE
 #include <debug.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <runcmd.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_ARGS 20
 #define CMD_DELIMITERS " "
-#define MAX_PROCESS_PID_VALUE (1 << 15)
 
-/* If you know of a solution to the "persistent non-blocking mode" problem that doesn't involve 
-using global variables, feel free to let me know. I don't. */
-static int nonblock_flag[MAX_PROCESS_PID_VALUE];
+/* Every process spawned by runcmd is registered in this list until it is reaped. The list is only */
+/* touched with child_lock held. The reaper thread is the only one that calls waitpid: it collects */
+/* the exit status and either hands it to the blocked runcmd call (through child_cond) or, for     */
+/* non-blocking children, drops the entry and calls runcmd_onexit.                                 */
 
-void child_term_handler(int sig, siginfo_t* info, void *u);
+typedef struct child
+{
+	pid_t pid;
+	int nonblock;
+	int remote;				/* Spawned by the zygote: its status arrives over zygote_sock. */
+	int spawned;			/* Pid and execok are known. Always true for local children. */
+	int lost;				/* The zygote was gone before it answered (spawn locally instead), or */
+							/* before it reported the exit (the status is unknown). */
+	int execok;
+	int waiting;			/* A runcmd call still references the entry; it frees it when done. */
+	int done;				/* Set by the reaper once the process has been waited for. */
+	int status;				/* Raw status as returned by waitpid. */
+	struct child* next;
+}CHILD;
 
-int runcmd(const char* command, int* result, const int* io)
+static CHILD* child_list = NULL;
+static unsigned long reap_generation = 0;	/* Bumped on every scan of the list by the reaper. */
+static pthread_mutex_t child_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t child_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int requested_flags = 0;			/* Flags given to runcmd_init, if it is called at all. */
+static int init_flags = 0;					/* Flags the library was actually set up with. */
+static int init_failed = 0;
+static int wakeup_pipe[2] = {-1, -1};		/* SIGCHLD handler -> reaper thread. */
+
+/* ------- ZYGOTE ------- */
+
+/* With RUNCMD_ZYGOTE, runcmd_init forks a spawn server while the process is still small. Requests   */
+/* go through a stream socket: a ZYGOTE_REQUEST header, carrying the caller's descriptors in          */
+/* SCM_RIGHTS, followed by a block holding the fd map and the NUL-separated argument, environment and */
+/* working directory strings. The zygote answers with ZYGOTE_REPLY records, read by the reaper        */
+/* thread: ZR_SPAWNED (or ZR_FAILED) once per request, ZR_EXITED per exit.                            */
+
+#define ZR_SPAWNED 1
+#define ZR_FAILED 2
+#define ZR_EXITED 3
+
+#define ZYGOTE_MAX_FDS 64		/* Commands mapping more descriptors than this are forked locally. */
+
+typedef struct zygote_request
 {
-	char* args[MAX_ARGS], *cmd = NULL, *cur = NULL;
-	int nargs = 0, cstatus, execfailpipe[2], noblock = 0;
-	pid_t cpid;
-	struct sigaction act;
+	CHILD* token;			/* Echoed back in ZR_SPAWNED/ZR_FAILED. Never dereferenced by the zygote. */
+	int nonblock;
+	int umask;
+	int nmap;				/* The block starts with nmap ints: an index into SCM_RIGHTS, or -1 to close. */
+	int nargs;
+	int nenv;				/* -1 keeps the zygote's environment. */
+	int hascwd;
+	size_t len;				/* Size of the block that follows the header. */
+}ZYGOTE_REQUEST;
 
-	/* Parsing command */
+typedef struct zygote_reply
+{
+	CHILD* token;
+	int kind;
+	pid_t pid;
+	int value;				/* execok for ZR_SPAWNED, raw wait status for ZR_EXITED. */
+}ZYGOTE_REPLY;
 
-	cmd = (char*) malloc((strlen(command)+1)*sizeof(char));
-	sysfail(cmd == NULL, -1);
+static int zygote_sock = -1;
+static pthread_mutex_t zygote_lock = PTHREAD_MUTEX_INITIALIZER;	/* Serializes requests and guards zygote_sock. */
 
-	strcpy(cmd, command);
-	args[nargs++] = strtok(cmd, CMD_DELIMITERS);
+static void child_term_handler(int sig);
+static void* reaper_thread(void* arg);
+static void runcmd_setup(void);
+static void wake_reaper(void);
+static int zygote_start(void);
+static void zygote_main(int sock);
+static int write_all(int fd, const void* buf, size_t len);
+static int read_all(int fd, void* buf, size_t len);
 
-	while (nargs < MAX_ARGS && (cur = strtok(NULL, CMD_DELIMITERS)) != NULL)
-		args[nargs++] = cur;
+/* Signal handling and the reaper thread are set up once per process, either by runcmd_init */
+/* or by whichever runcmd call comes first. */
 
-	if (nargs == MAX_ARGS && strtok(NULL, CMD_DELIMITERS) != NULL)
+static void runcmd_setup(void)
+{
+	struct sigaction act;
+	pthread_t tid;
+	pthread_attr_t attr;
+	sigset_t all, old;
+
+	init_flags = requested_flags;
+
+	/* The zygote is forked before any thread exists, so it starts as a plain single-threaded copy. */
+	if ((init_flags & RUNCMD_ZYGOTE) && zygote_start() < 0)
 	{
-		fprintf(stderr, "Error: too many arguments. Runcmd can't handle more than %d arguments.\n", MAX_ARGS);
-		return -1;
+		init_failed = 1;
+		return;
 	}
 
-	args[nargs] = NULL;
-	noblock = args[nargs-1][0] == '&';
-	if (noblock)
-		args[--nargs] = NULL;
+	if (pipe2(wakeup_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+	{
+		init_failed = 1;
+		return;
+	}
+	/* The reaper sleeps on the read end, so only the write end stays non-blocking. */
+	fcntl(wakeup_pipe[0], F_SETFL, 0);
 
-	/* Registering SIGCHLD handler */
+	/* The reaper inherits a fully blocked mask, so signals keep going to the caller's threads. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, reaper_thread, NULL) != 0)
+		init_failed = 1;
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (init_failed)
+		return;
 
 	memset(&act, 0, sizeof(struct sigaction));
-	act.sa_flags |= SA_SIGINFO;
-	act.sa_sigaction = child_term_handler;
-	sysfail(sigaction(SIGCHLD, &act, NULL) < 0, -1);
+	act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	act.sa_handler = child_term_handler;
+	if (sigaction(SIGCHLD, &act, NULL) < 0)
+		init_failed = 1;
+}
 
-	/* Creating pipe used to detect exec failure. Forking.*/
+int runcmd_init(int flags)
+{
+	requested_flags = flags;
+	pthread_once(&init_once, runcmd_setup);
+	fail(init_flags != flags, -1, "runcmd_init must be called before any other runcmd function");
+	fail(init_failed, -1, "runcmd could not be initialized");
+	return 0;
+}
 
-	sysfail(pipe(execfailpipe) < 0, -1);
-	fcntl(execfailpipe[0], F_SETFD, FD_CLOEXEC);
-	fcntl(execfailpipe[1], F_SETFD, FD_CLOEXEC);
+/* Registers the child with the reaper. generation is the value of reap_generation sampled before */
+/* forking: if the reaper scanned the list in between, the child's SIGCHLD may already have been   */
+/* consumed, so the reaper has to look again.                                                       */
 
-	cpid = fork();
-	sysfail(cpid < 0, -1);
+static void register_child(CHILD* child, unsigned long generation)
+{
+	pthread_mutex_lock(&child_lock);
+	child->next = child_list;
+	child_list = child;
+	if (!child->remote && reap_generation != generation)
+		wake_reaper();
+	pthread_mutex_unlock(&child_lock);
+}
 
-	/* Child process code block */
-	if (cpid == 0)
+/* Runs in the child between fork and exec, and only returns if something failed. map[i] becomes */
+/* fd i, -1 closes it, and i itself leaves it alone. Sources that are also targets are first moved */
+/* above n, using tmp (n ints, allocated before forking).                                          */
+
+static void exec_child(char* const args[], const struct runcmd_options* options, int* tmp)
+{
+	const int* map = options->fdmap;
+	int i, n = options->nfds;
+
+	if (map != NULL)
 	{
-		if (io != NULL)
+		for (i = 0; i < n; i++)
 		{
-			int i;
-			for (i = 0; i < 3; i++)
-			{
-				if (io[i] != i)
-				{
-					close(i);
-					dup(io[i]);
-					/*close(io[i]);*/
-				}
-			}
+			tmp[i] = map[i];
+			if (map[i] >= 0 && map[i] < n && map[i] != i)
+				tmp[i] = fcntl(map[i], F_DUPFD_CLOEXEC, n);
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (tmp[i] < 0)
+				close(i);
+			else if (tmp[i] != i)
+				dup2(tmp[i], i);
 		}
+	}
+	if (options->umask >= 0)
+		umask(options->umask);
+	if (options->cwd != NULL && chdir(options->cwd) < 0)
+		return;
+	if (options->envp != NULL)
+		execvpe(args[0], args, options->envp);
+	else
 		execvp(args[0], args);
+}
+
+#define STACK_MAP 16
+
+/* Forks and execs locally. With failfd < 0, a private pipe is used to detect exec failure and, for */
+/* blocking children, waited on. Otherwise failfd is the write end of a pipe shared by a whole batch, */
+/* into which the child writes index if exec fails; the caller collects those once all are forked.   */
+
+static pid_t spawn_local(char* const args[], const struct runcmd_options* options, CHILD* child, int failfd, int index)
+{
+	int execfailpipe[2] = {-1, -1}, i, stackmap[STACK_MAP], *tmp = stackmap;
+	unsigned long generation;
+	char failbyte;
+	pid_t cpid;
+
+	if (options->nfds > STACK_MAP)
+	{
+		tmp = (int*) malloc(options->nfds*sizeof(int));
+		sysfail(tmp == NULL, -1);
+	}
+
+	/* Creating pipe used to detect exec failure. It is close-on-exec from the start, so that */
+	/* children forked concurrently by other threads don't inherit it. Forking. */
+
+	if (failfd < 0)
+	{
+		if (pipe2(execfailpipe, O_CLOEXEC) < 0)
+		{
+			if (tmp != stackmap)
+				free(tmp);
+			sysfail(1, -1);
+		}
+		failfd = execfailpipe[1];
+	}
+
+	pthread_mutex_lock(&child_lock);
+	generation = reap_generation;
+	pthread_mutex_unlock(&child_lock);
+
+	cpid = fork();
+
+	/* Child process code block */
+	if (cpid == 0)
+	{
+		exec_child(args, options, tmp);
 
 		/* Only gets here if exec fails*/
-		write(execfailpipe[1], "@", 1);
-		close(execfailpipe[0]);
-		close(execfailpipe[1]);
-		free(cmd);
-		exit(EXECFAILSTATUS);
+		write(failfd, &index, sizeof(int));
+		_exit(EXECFAILSTATUS);
 	}
 	/* Child process code block ends here */
 
+	if (tmp != stackmap)
+		free(tmp);
+	if (cpid < 0)
+	{
+		if (execfailpipe[0] >= 0)
+		{
+			close(execfailpipe[0]);
+			close(execfailpipe[1]);
+		}
+		sysfail(1, -1);
+	}
+
+	child->pid = cpid;
+	child->spawned = 1;
+	child->execok = 1;
+	register_child(child, generation);
+
+	if (execfailpipe[0] < 0)
+		return cpid;
+
 	close(execfailpipe[1]);
-	if (noblock)
+	/* Blocks until exec either succeeds (EOF) or fails (one int). */
+	if (!child->nonblock)
+	{
+		while ((i = read(execfailpipe[0], &failbyte, 1)) < 0 && errno == EINTR);
+		child->execok = (i == 0);
+	}
+	close(execfailpipe[0]);
+	return cpid;
+}
+
+/* Appends n strings, NUL-terminated, at p. Returns the position after the last one. */
+
+static char* pack_strings(char* p, char* const strings[], int n)
+{
+	int i;
+	size_t len;
+
+	for (i = 0; i < n; i++)
+	{
+		len = strlen(strings[i]) + 1;
+		memcpy(p, strings[i], len);
+		p += len;
+	}
+	return p;
+}
+
+static size_t strings_size(char* const strings[], int n)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += strlen(strings[i]) + 1;
+	return len;
+}
+
+static int count_strings(char* const strings[])
+{
+	int n = 0;
+
+	while (strings[n] != NULL)
+		n++;
+	return n;
+}
+
+static pid_t spawn_remote(char* const args[], const struct runcmd_options* options, CHILD* child)
+{
+	ZYGOTE_REQUEST req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(ZYGOTE_MAX_FDS*sizeof(int))];
+	}control;
+	int fds[ZYGOTE_MAX_FDS], nfds = 0, i, fd, sent = -1, *map;
+	char* block, *p;
+
+	req.token = child;
+	req.nonblock = child->nonblock;
+	req.umask = options->umask;
+	req.nmap = options->fdmap != NULL && options->nfds > 3 ? options->nfds : 3;
+	req.nargs = count_strings(args);
+	req.nenv = options->envp != NULL ? count_strings(options->envp) : -1;
+	req.hascwd = options->cwd != NULL;
+	req.len = req.nmap*sizeof(int) + strings_size(args, req.nargs);
+	if (req.nenv > 0)
+		req.len += strings_size(options->envp, req.nenv);
+	if (req.hascwd)
+		req.len += strlen(options->cwd) + 1;
+
+	block = (char*) malloc(req.len);
+	sysfail(block == NULL, -1);
+
+	/* Descriptors are always sent, even unmapped stdio: the zygote's own fds 0-2 date from runcmd_init. */
+	map = (int*) block;
+	for (i = 0; i < req.nmap; i++)
+	{
+		if (options->fdmap == NULL)
+			fd = i;
+		else
+			fd = i < options->nfds ? options->fdmap[i] : i;
+		map[i] = -1;
+		if (fd >= 0 && fcntl(fd, F_GETFD) >= 0)
+		{
+			map[i] = nfds;
+			fds[nfds++] = fd;
+		}
+	}
+	p = pack_strings(block + req.nmap*sizeof(int), args, req.nargs);
+	if (req.nenv > 0)
+		p = pack_strings(p, options->envp, req.nenv);
+	if (req.hascwd)
+		strcpy(p, options->cwd);
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(ZYGOTE_REQUEST);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0)
+	{
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+	}
+
+	child->remote = 1;
+	register_child(child, 0);
+
+	pthread_mutex_lock(&zygote_lock);
+	if (zygote_sock >= 0)
+	{
+		while ((sent = sendmsg(zygote_sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+		if (sent >= 0 && (size_t) sent < sizeof(ZYGOTE_REQUEST))
+			sent = write_all(zygote_sock, (char*) &req + sent, sizeof(ZYGOTE_REQUEST) - sent);
+		if (sent >= 0)
+			sent = write_all(zygote_sock, block, req.len);
+		/* A request cut short leaves the stream unusable. Only the reaper closes the socket, */
+		/* since it polls it; it sees it end and gives up on the zygote. */
+		if (sent < 0)
+			shutdown(zygote_sock, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&zygote_lock);
+	free(block);
+
+	pthread_mutex_lock(&child_lock);
+	if (sent < 0 && !child->spawned)		/* Nothing will ever answer for this entry, unless the reaper */
+	{										/* already gave up on it with the zygote. */
+		CHILD** iter = &child_list;
+		while (*iter != NULL && *iter != child)
+			iter = &(*iter)->next;
+		if (*iter != NULL)
+			*iter = child->next;
+		child->spawned = 1;
+		child->lost = 1;
+		child->pid = -1;
+	}
+	while (!child->spawned)
+		pthread_cond_wait(&child_cond, &child_lock);
+	pthread_mutex_unlock(&child_lock);
+
+	return child->pid;
+}
+
+/* Commands are tokenized in place into a copy held by a SCRATCH, normally on the caller's stack. */
+/* Commands that don't fit get a single heap block instead; there is no limit on their size.       */
+
+#define SCRATCH_TEXT 512
+#define SCRATCH_ARGS 64
+
+typedef struct scratch
+{
+	char* args[SCRATCH_ARGS];
+	char text[SCRATCH_TEXT];
+	void* heap;				/* Block to be freed when the command did not fit, NULL otherwise. */
+}SCRATCH;
+
+/* Splits command into a NULL-terminated argument vector stored in scratch. A trailing '&' */
+/* argument is removed and reported through *nonblock. Returns NULL for empty commands.    */
+
+static char** parse_command(const char* command, SCRATCH* scratch, int* nonblock)
+{
+	char **args, *text, *cur = NULL, *saveptr = NULL;
+	const char* p;
+	size_t len, nargs = 0;
+	int blank = 1;
+
+	for (p = command; *p != '\0'; p++)
+	{
+		if (blank && *p != ' ')
+			nargs++;
+		blank = *p == ' ';
+	}
+	len = p - command;
+
+	scratch->heap = NULL;
+	if (nargs == 0)
+		return NULL;
+
+	if (nargs < SCRATCH_ARGS && len < SCRATCH_TEXT)
+	{
+		args = scratch->args;
+		text = scratch->text;
+	}
+	else
+	{
+		scratch->heap = malloc((nargs+1)*sizeof(char*) + len + 1);
+		sysfail(scratch->heap == NULL, NULL);
+		args = (char**) scratch->heap;
+		text = (char*) (args + nargs + 1);
+	}
+	memcpy(text, command, len + 1);
+
+	nargs = 0;
+	for (cur = strtok_r(text, CMD_DELIMITERS, &saveptr); cur != NULL; cur = strtok_r(NULL, CMD_DELIMITERS, &saveptr))
+		args[nargs++] = cur;
+	args[nargs] = NULL;
+
+	*nonblock = args[nargs-1][0] == '&';
+	if (*nonblock)
+		args[--nargs] = NULL;
+
+	if (nargs == 0)
+	{
+		free(scratch->heap);
+		return NULL;
+	}
+	return args;
+}
+
+/* A request the zygote never answered, because it died or could not be sent to, is done again */
+/* by forking here. */
+
+static pid_t spawn(char* const args[], const struct runcmd_options* options, CHILD* child, int failfd, int index)
+{
+	int remote;
+	pid_t pid;
+
+	pthread_mutex_lock(&zygote_lock);
+	remote = zygote_sock >= 0 && options->nfds <= ZYGOTE_MAX_FDS;
+	pthread_mutex_unlock(&zygote_lock);
+
+	if (remote)
+	{
+		pid = spawn_remote(args, options, child);
+		if (pid >= 0 || !child->lost)
+			return pid;
+		child->remote = child->spawned = child->lost = 0;		/* No longer in the list. */
+	}
+	return spawn_local(args, options, child, failfd, index);
+}
+
+/* The options runcmd's io argument stands for. */
+
+static void io_options(struct runcmd_options* options, const int* io, int nonblock)
+{
+	memset(options, 0, sizeof(struct runcmd_options));
+	options->umask = -1;
+	options->fdmap = io;
+	options->nfds = io != NULL ? 3 : 0;
+	options->nonblock = nonblock;
+}
+
+/* Builds the value stored in *result for a terminated child. Must be called with child_lock held. */
+
+static int child_result(const CHILD* child)
+{
+	int result = 0;
+
+	if (!child->lost && WIFEXITED(child->status))
+	{
+		result |= WEXITSTATUS(child->status);
+		result |= NORMTERM;
+		if (child->execok)
+			result |= EXECOK;
+	}
+	return result;
+}
+
+/* ------- DEADLINES ------- */
+
+static long elapsed_ms(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)*1000 + (now.tv_nsec - start->tv_nsec)/1000000;
+}
+
+#ifdef SYS_pidfd_open
+
+/* Sleeps in poll until the process behind pidfd exits (returns 1) or ms milliseconds pass (0). */
+
+static int pidfd_wait(int pidfd, int ms)
+{
+	struct pollfd pfd;
+	struct timespec start;
+	int n, left = ms;
+
+	pfd.fd = pidfd;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((n = poll(&pfd, 1, left)) < 0 && errno == EINTR)
+	{
+		left = ms - elapsed_ms(&start);
+		if (left < 0)
+			left = 0;
+	}
+	return n != 0;
+}
+
+#endif
+
+/* Fallback for kernels without pidfds: sleeps on child_cond. Must be called with child_lock held. */
+
+static int cond_wait_ms(CHILD* child, int ms)
+{
+	struct timespec abstime;
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += ms/1000;
+	abstime.tv_nsec += (ms%1000)*1000000L;
+	if (abstime.tv_nsec >= 1000000000L)
+	{
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000L;
+	}
+	while (!child->done)
+	{
+		if (pthread_cond_timedwait(&child_cond, &child_lock, &abstime) == ETIMEDOUT)
+			return child->done;
+	}
+	return 1;
+}
+
+/* Enforces deadline on a blocking child: once timeout_ms has passed, deadline->signal (SIGTERM by */
+/* default) is sent, followed by SIGKILL after grace_ms unless grace_ms is negative. The waiting    */
+/* costs no CPU. Returns 1 if the deadline fired. Must be called with child_lock held.             */
+
+static int enforce_deadline(CHILD* child, const struct runcmd_deadline* deadline)
+{
+	int sig = deadline->signal > 0 ? deadline->signal : SIGTERM;
+#ifdef SYS_pidfd_open
+	int pidfd, exited;
+
+	pthread_mutex_unlock(&child_lock);
+	pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+	pthread_mutex_lock(&child_lock);
+
+	/* Once reaped, the pid may already belong to someone else. */
+	if (pidfd >= 0 && child->done)
+		close(pidfd);
+	else if (pidfd >= 0)
+	{
+		pthread_mutex_unlock(&child_lock);
+		exited = pidfd_wait(pidfd, deadline->timeout_ms);
+		if (!exited)
+		{
+			syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+			if (deadline->grace_ms >= 0 && !pidfd_wait(pidfd, deadline->grace_ms))
+				syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+		}
+		close(pidfd);
+		pthread_mutex_lock(&child_lock);
+		return !exited;
+	}
+	if (child->done)
+		return 0;
+#endif
+	/* Without pidfds, child_lock held while !done guarantees that pid has not been reused. */
+	if (cond_wait_ms(child, deadline->timeout_ms))
+		return 0;
+	kill(child->pid, sig);
+	if (deadline->grace_ms >= 0 && !cond_wait_ms(child, deadline->grace_ms))
+		kill(child->pid, SIGKILL);
+	return 1;
+}
+
+/* Runs args as runcmd does. A blocking child is only referenced until this returns, so its entry */
+/* lives on the stack; non-blocking ones outlive the call and are freed by whoever sees them last.  */
+
+static int run_args(char* const args[], const struct runcmd_options* options, int* result)
+{
+	int timedout = 0, nonblock = options->nonblock;
+	const struct runcmd_deadline* deadline = options->deadline;
+	CHILD blocking, *child;
+	pid_t cpid;
+
+	if (nonblock)
+	{
+		child = (CHILD*) calloc(1, sizeof(CHILD));
+		sysfail(child == NULL, -1);
+	}
+	else
+	{
+		child = &blocking;
+		memset(child, 0, sizeof(CHILD));
+	}
+	child->nonblock = nonblock;
+	child->waiting = 1;
+
+	cpid = spawn(args, options, child, -1, 0);
+	if (cpid < 0)		/* The entry is no longer in the list. */
+	{
+		if (nonblock)
+			free(child);
+		return -1;
+	}
+
+	pthread_mutex_lock(&child_lock);
+	if (nonblock)
 	{
 		if (result != NULL)
 			*result = NONBLOCK;
-		nonblock_flag[cpid] = 1;
+		child->waiting = 0;
+		if (child->done)
+			free(child);
 	}
 	else
 	{
-		waitpid(cpid, &cstatus, 0);
+		if (deadline != NULL && deadline->timeout_ms >= 0)
+			timedout = enforce_deadline(child, deadline);
+		while (!child->done)
+			pthread_cond_wait(&child_cond, &child_lock);
 		if (result != NULL)
+			*result = child_result(child) | (timedout ? TIMEDOUT : 0);
+	}
+	pthread_mutex_unlock(&child_lock);
+
+	return cpid;
+}
+
+int runcmd(const char* command, int* result, const int* io)
+{
+	return runcmd_timed(command, result, io, NULL);
+}
+
+int runcmd_timed(const char* command, int* result, const int* io, const struct runcmd_deadline* deadline)
+{
+	struct runcmd_options options;
+	SCRATCH scratch;
+	char** args;
+	int nonblock, ret;
+
+	pthread_once(&init_once, runcmd_setup);
+	fail(init_failed, -1, "runcmd could not be initialized");
+
+	args = parse_command(command, &scratch, &nonblock);
+	if (args == NULL)
+		return -1;
+
+	io_options(&options, io, nonblock);
+	options.deadline = deadline;
+	ret = run_args(args, &options, result);
+	free(scratch.heap);
+	return ret;
+}
+
+int runcmd_argv(char* const argv[], int* result, const int* io, int nonblock)
+{
+	struct runcmd_options options;
+
+	io_options(&options, io, nonblock);
+	return runcmd_ex(argv, result, &options);
+}
+
+int runcmd_ex(char* const argv[], int* result, const struct runcmd_options* options)
+{
+	struct runcmd_options defaults;
+
+	pthread_once(&init_once, runcmd_setup);
+	fail(init_failed, -1, "runcmd could not be initialized");
+	fail(argv == NULL || argv[0] == NULL, -1, "empty argument vector");
+
+	if (options == NULL)
+	{
+		io_options(&defaults, NULL, 0);
+		options = &defaults;
+	}
+	return run_args(argv, options, result);
+}
+
+/* ------- BATCHES ------- */
+
+/* A batch of children spawned and waited for together. Local children of a batch share a single */
+/* exec-failure pipe, drained once after every child has been forked. */
+
+typedef struct batch
+{
+	int n;
+	CHILD** children;		/* children[i] is NULL if command i could not be spawned. */
+	int failpipe[2];
+	int* results;
+}BATCH;
+
+static int batch_start(BATCH* batch, int n, int* results)
+{
+	batch->n = n;
+	batch->results = results;
+	memset(results, 0, n*sizeof(int));
+	batch->children = (CHILD**) calloc(n, sizeof(CHILD*));
+	sysfail(batch->children == NULL, -1);
+	sysfail(pipe2(batch->failpipe, O_CLOEXEC) < 0, (free(batch->children), -1));
+	return 0;
+}
+
+static int batch_spawn(BATCH* batch, int i, const char* command, const int* io)
+{
+	struct runcmd_options options;
+	SCRATCH scratch;
+	char** args;
+	int nonblock;
+	CHILD* child;
+
+	args = parse_command(command, &scratch, &nonblock);
+	if (args == NULL)
+		return -1;
+	io_options(&options, io, 0);
+
+	child = (CHILD*) calloc(1, sizeof(CHILD));
+	if (child == NULL)
+	{
+		free(scratch.heap);
+		sysfail(1, -1);
+	}
+	child->waiting = 1;
+
+	if (spawn(args, &options, child, batch->failpipe[1], i) < 0)
+		free(child);
+	else
+		batch->children[i] = child;
+	free(scratch.heap);
+	return batch->children[i] != NULL ? 0 : -1;
+}
+
+/* Waits until at least one of children[from..to) that is not yet collected terminates, then     */
+/* collects every terminated one into results. Returns how many were collected.                 */
+
+static int batch_collect(BATCH* batch, int from, int to)
+{
+	int i, collected = 0;
+
+	pthread_mutex_lock(&child_lock);
+	while (collected == 0)
+	{
+		for (i = from; i < to; i++)
 		{
-			*result = 0;
-			if (WIFEXITED(cstatus))
+			CHILD* child = batch->children[i];
+			if (child != NULL && child->done && child->waiting)
 			{
-				*result |= WEXITSTATUS(cstatus);
-				*result |= NORMTERM;
-				if (read(execfailpipe[0], NULL, 1) == 0)
-					*result |= EXECOK;
-			}	
+				batch->results[i] = child_result(child);
+				child->waiting = 0;
+				collected++;
+			}
 		}
+		if (collected == 0)
+			pthread_cond_wait(&child_cond, &child_lock);
 	}
-	close(execfailpipe[0]);
-	free(cmd);
-	return cpid;
-}	
+	pthread_mutex_unlock(&child_lock);
+	return collected;
+}
+
+/* Clears EXECOK for every child that reported an exec failure, then releases the batch. */
+
+static void batch_finish(BATCH* batch)
+{
+	int i, index;
+
+	close(batch->failpipe[1]);
+	while (read_all(batch->failpipe[0], &index, sizeof(int)) == 0)
+	{
+		if (index >= 0 && index < batch->n)
+			batch->results[index] &= ~EXECOK;
+	}
+	close(batch->failpipe[0]);
+
+	for (i = 0; i < batch->n; i++)
+		free(batch->children[i]);
+	free(batch->children);
+}
+
+int runcmd_batch(const char** commands, int n, int max_parallel, int* results)
+{
+	BATCH batch;
+	int next = 0, running = 0, oldest = 0, ret = 0;
+
+	pthread_once(&init_once, runcmd_setup);
+	fail(init_failed, -1, "runcmd could not be initialized");
+	fail(n < 0 || commands == NULL || results == NULL, -1, "invalid arguments");
+	if (n == 0)
+		return 0;
+	if (max_parallel <= 0 || max_parallel > n)
+		max_parallel = n;
+
+	sysfail(batch_start(&batch, n, results) < 0, -1);
+
+	while (next < n || running > 0)
+	{
+		while (running < max_parallel && next < n)
+		{
+			if (batch_spawn(&batch, next, commands[next], NULL) < 0)
+				ret = -1;
+			else
+				running++;
+			next++;
+		}
+		if (running > 0)
+			running -= batch_collect(&batch, oldest, next);
+		while (oldest < next && (batch.children[oldest] == NULL || !batch.children[oldest]->waiting))
+			oldest++;
+	}
+
+	batch_finish(&batch);
+	return ret;
+}
+
+int runcmd_pipeline(const char** stages, int n, const int* io, int* results)
+{
+	BATCH batch;
+	int i, stageio[3], in, running = 0, ret = 0, pipefd[2];
+
+	pthread_once(&init_once, runcmd_setup);
+	fail(init_failed, -1, "runcmd could not be initialized");
+	fail(n < 0 || stages == NULL || results == NULL, -1, "invalid arguments");
+	if (n == 0)
+		return 0;
+
+	sysfail(batch_start(&batch, n, results) < 0, -1);
+
+	/* Pipes are close-on-exec: each stage only keeps the two ends dup2'ed onto its stdin and stdout. */
+	in = io != NULL ? io[0] : 0;
+	stageio[2] = io != NULL ? io[2] : 2;
+	for (i = 0; i < n; i++)
+	{
+		stageio[0] = in;
+		if (i == n-1)
+			stageio[1] = io != NULL ? io[1] : 1;
+		else if (pipe2(pipefd, O_CLOEXEC) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		else
+			stageio[1] = pipefd[1];
+
+		if (batch_spawn(&batch, i, stages[i], stageio) < 0)
+			ret = -1;
+		else
+			running++;
+
+		if (i > 0)
+			close(in);
+		if (i < n-1)
+		{
+			close(pipefd[1]);
+			in = pipefd[0];
+		}
+	}
+	if (ret < 0 && i < n && i > 0)		/* Stopped at a failed pipe(): the last read end is still open. */
+		close(in);
+
+	while (running > 0)
+		running -= batch_collect(&batch, 0, n);
+
+	batch_finish(&batch);
+	return ret;
+}
+
+/* The handler only wakes the reaper up: everything else happens outside of signal context. */
+
+static void child_term_handler(int sig)
+{
+	int saved_errno = errno;
+
+	(void) sig;
+	write(wakeup_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+/* A full pipe already guarantees a pending wakeup, so the write may safely fail. */
+
+static void wake_reaper(void)
+{
+	write(wakeup_pipe[1], "", 1);
+}
+
+/* Takes a finished child out of the list. Must be called with child_lock held. Returns 1 if */
+/* runcmd_onexit is due. */
+
+static int child_finished(CHILD** iter, int status)
+{
+	CHILD* finished = *iter;
+
+	*iter = finished->next;
+	finished->status = status;
+	finished->done = 1;
+	if (!finished->waiting)
+		free(finished);
+	else if (!finished->nonblock)
+		return 0;
+	return 1;
+}
+
+/* Handles one record from the zygote. Must be called with child_lock held. */
+
+static int zygote_reply(const ZYGOTE_REPLY* reply)
+{
+	CHILD** iter = &child_list;
+
+	switch (reply->kind)
+	{
+		case ZR_SPAWNED:
+		case ZR_FAILED:
+			while (*iter != NULL && *iter != reply->token)
+				iter = &(*iter)->next;
+			if (*iter == NULL)
+				return 0;
+			(*iter)->spawned = 1;
+			(*iter)->execok = reply->value;
+			if (reply->kind == ZR_FAILED)
+			{
+				(*iter)->pid = -1;
+				*iter = (*iter)->next;
+			}
+			else
+				(*iter)->pid = reply->pid;
+			return 0;
+
+		case ZR_EXITED:
+			while (*iter != NULL && !((*iter)->remote && (*iter)->pid == reply->pid))
+				iter = &(*iter)->next;
+			if (*iter == NULL)
+				return 0;
+			return child_finished(iter, reply->value);
 
-void child_term_handler(int sig, siginfo_t* info, void *u)
+		default:
+			return 0;
+	}
+}
+
+/* The zygote is gone: nothing it started will ever be reported. The children it did start may */
+/* well still run, and they end here with an unknown status, which is not a normal exit. Must  */
+/* be called with child_lock held.                                                              */
+
+static int zygote_lost(void)
+{
+	CHILD** iter = &child_list;
+	int exits = 0;
+
+	while (*iter != NULL)
+	{
+		if (!(*iter)->remote)
+			iter = &(*iter)->next;
+		else if (!(*iter)->spawned)
+		{
+			(*iter)->spawned = 1;
+			(*iter)->lost = 1;
+			(*iter)->pid = -1;
+			*iter = (*iter)->next;
+		}
+		else
+		{
+			(*iter)->lost = 1;
+			(*iter)->execok = 0;
+			exits += child_finished(iter, 0);
+		}
+	}
+	return exits;
+}
+
+static void* reaper_thread(void* arg)
 {
-	int status = 0;
-	pid_t pid = info->si_pid;
+	char buffer[64];
+	CHILD** iter;
+	ZYGOTE_REPLY reply;
+	struct pollfd fds[2];
+	int status, nonblock_exits, nfds;
+
+	(void) arg;
+	fds[0].fd = wakeup_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = zygote_sock;
+	fds[1].events = POLLIN;
+	nfds = zygote_sock >= 0 ? 2 : 1;
 
-	waitpid(pid, &status, 0);
-	if (nonblock_flag[pid])
+	for (;;)
 	{
-		nonblock_flag[pid] = 0;
-		if (runcmd_onexit != NULL)
+		if (poll(fds, nfds, -1) < 0)
+			continue;
+
+		nonblock_exits = 0;
+		if (nfds == 2 && fds[1].revents)
+		{
+			if (read_all(fds[1].fd, &reply, sizeof(ZYGOTE_REPLY)) < 0)
+			{
+				pthread_mutex_lock(&zygote_lock);
+				close(zygote_sock);
+				zygote_sock = -1;
+				pthread_mutex_unlock(&zygote_lock);
+				nfds = 1;
+
+				pthread_mutex_lock(&child_lock);
+				nonblock_exits += zygote_lost();
+			}
+			else
+			{
+				pthread_mutex_lock(&child_lock);
+				nonblock_exits += zygote_reply(&reply);
+			}
+			pthread_cond_broadcast(&child_cond);
+			pthread_mutex_unlock(&child_lock);
+		}
+
+		if (fds[0].revents)
+		{
+			if (read(wakeup_pipe[0], buffer, sizeof(buffer)) < 0 && errno == EINTR)
+				continue;
+
+			pthread_mutex_lock(&child_lock);
+			reap_generation++;
+			iter = &child_list;
+			while (*iter != NULL)
+			{
+				if (!(*iter)->remote && waitpid((*iter)->pid, &status, WNOHANG) > 0)
+					nonblock_exits += child_finished(iter, status);
+				else
+					iter = &(*iter)->next;
+			}
+			pthread_cond_broadcast(&child_cond);
+			pthread_mutex_unlock(&child_lock);
+		}
+
+		while (nonblock_exits-- > 0 && runcmd_onexit != NULL)
 			runcmd_onexit();
 	}
+	return NULL;
+}
+
+/* ------- ZYGOTE ------- */
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+	const char* p = (const char*) buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len)
+{
+	char* p = (char*) buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int zygote_start(void)
+{
+	int sv[2];
+	pid_t pid;
+
+	sysfail(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0, -1);
+
+	pid = fork();
+	if (pid < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		sysfail(1, -1);
+	}
+	if (pid == 0)
+	{
+		close(sv[0]);
+		zygote_main(sv[1]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(sv[1]);
+	zygote_sock = sv[0];
+	return 0;
+}
+
+/* Unpacks n strings stored by pack_strings into a NULL-terminated vector. */
+
+static char** unpack_strings(char** p, int n)
+{
+	char** v = (char**) malloc((n+1)*sizeof(char*));
+	int i;
+
+	if (v == NULL)
+		return NULL;
+	for (i = 0; i < n; i++)
+	{
+		v[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+	v[n] = NULL;
+	return v;
+}
+
+/* Receives and runs one request. Returns -1 once the connection is closed. */
+
+static int zygote_serve(int sock)
+{
+	ZYGOTE_REQUEST req;
+	ZYGOTE_REPLY reply;
+	struct runcmd_options options;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(ZYGOTE_MAX_FDS*sizeof(int))];
+	}control;
+	int fds[ZYGOTE_MAX_FDS], nfds = 0, execfailpipe[2], i, n, *map, *tmp;
+	char** args, **env = NULL, *block, *p, failbyte;
+	ssize_t got;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(ZYGOTE_REQUEST);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	if (got <= 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), nfds*sizeof(int));
+		}
+	}
+	if ((size_t) got < sizeof(ZYGOTE_REQUEST) && read_all(sock, (char*) &req + got, sizeof(ZYGOTE_REQUEST) - got) < 0)
+		return -1;
+
+	block = (char*) malloc(req.len);
+	tmp = (int*) malloc(req.nmap*sizeof(int));
+	if (block == NULL || tmp == NULL || read_all(sock, block, req.len) < 0)
+		return -1;
+
+	/* Turn indexes into SCM_RIGHTS into the descriptors received here. */
+	map = (int*) block;
+	for (i = 0; i < req.nmap; i++)
+		map[i] = map[i] >= 0 && map[i] < nfds ? fds[map[i]] : -1;
+	p = block + req.nmap*sizeof(int);
+	args = unpack_strings(&p, req.nargs);
+	if (req.nenv >= 0)
+		env = unpack_strings(&p, req.nenv);
+	if (args == NULL || (req.nenv >= 0 && env == NULL))
+		return -1;
+
+	memset(&options, 0, sizeof(struct runcmd_options));
+	options.envp = env;
+	options.cwd = req.hascwd ? p : NULL;
+	options.umask = req.umask;
+	options.fdmap = map;
+	options.nfds = req.nmap;
+
+	memset(&reply, 0, sizeof(ZYGOTE_REPLY));
+	reply.token = req.token;
+	reply.kind = ZR_FAILED;
+
+	if (req.nargs > 0 && pipe2(execfailpipe, O_CLOEXEC) == 0)
+	{
+		reply.pid = fork();
+		if (reply.pid == 0)
+		{
+			exec_child(args, &options, tmp);
+			write(execfailpipe[1], "@", 1);
+			_exit(EXECFAILSTATUS);
+		}
+		close(execfailpipe[1]);
+		if (reply.pid > 0)
+		{
+			reply.kind = ZR_SPAWNED;
+			if (req.nonblock)
+				reply.value = 1;
+			else
+			{
+				while ((n = read(execfailpipe[0], &failbyte, 1)) < 0 && errno == EINTR);
+				reply.value = (n == 0);
+			}
+		}
+		close(execfailpipe[0]);
+	}
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	free(env);
+	free(args);
+	free(tmp);
+	free(block);
+	return write_all(sock, &reply, sizeof(ZYGOTE_REPLY));
+}
+
+static void zygote_main(int sock)
+{
+	struct sigaction act;
+	struct pollfd fds[2];
+	ZYGOTE_REPLY reply;
+	char buffer[64];
+	int status;
+
+	fatal(pipe2(wakeup_pipe, O_CLOEXEC | O_NONBLOCK) < 0, "zygote: pipe");
+	memset(&act, 0, sizeof(struct sigaction));
+	act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	act.sa_handler = child_term_handler;
+	fatal(sigaction(SIGCHLD, &act, NULL) < 0, "zygote: sigaction");
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = wakeup_pipe[0];
+	fds[1].events = POLLIN;
+
+	memset(&reply, 0, sizeof(ZYGOTE_REPLY));
+	reply.kind = ZR_EXITED;
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+			continue;
+		if (fds[1].revents)
+		{
+			while (read(wakeup_pipe[0], buffer, sizeof(buffer)) > 0);
+			while ((reply.pid = waitpid(-1, &status, WNOHANG)) > 0)
+			{
+				reply.value = status;
+				if (write_all(sock, &reply, sizeof(ZYGOTE_REPLY)) < 0)
+					return;
+			}
+		}
+		if (fds[0].revents && zygote_serve(sock) < 0)
+			return;
+	}
 }
 
 void (*runcmd_onexit)(void) = NULL;
@@ -25,13 +25,77 @@
 #define NORMTERM (1 << 8)
 #define EXECOK (1 << 9)
 #define NONBLOCK (1 << 10)
+#define TIMEDOUT (1 << 11)
 
 #define EXITSTATUS(ret) ((ret & EXITSTATUSBYTE))
 #define IS_NORMTERM(ret) ((ret & NORMTERM) && 1)
 #define IS_EXECOK(ret) ((ret & EXECOK) && 1)
 #define IS_NONBLOCK(ret) ((ret & NONBLOCK) && 1)
+#define IS_TIMEDOUT(ret) ((ret & TIMEDOUT) && 1)
+
+/* Flags for runcmd_init */
+#define RUNCMD_ZYGOTE (1 << 0)		/* Spawn through a small helper process forked at init time. */
+
+/* runcmd may be called concurrently from several threads. Children are reaped by an internal */
+/* thread started on the first call, and runcmd_onexit is called from that thread whenever a    */
+/* non-blocking child terminates.                                                                */
+/*                                                                                               */
+/* runcmd_init is optional, but if it is used it must come before any other call. With          */
+/* RUNCMD_ZYGOTE, fork and exec are done by a helper process forked by runcmd_init, so spawn     */
+/* cost does not grow with the caller's memory. The caller's stdio is sent along with each       */
+/* request; the working directory and environment are the ones the process had at init time.    */
+/* If the helper dies, runcmd falls back to forking the caller, also for the requests it had    */
+/* not answered yet. Commands it had already started can no longer be waited for: they are      */
+/* reported as ended, without NORMTERM or EXECOK, even though they may still be running.        */
+
+int runcmd_init(int flags);
 
 int runcmd(const char *command, int *result, const int* io);
+
+/* Like runcmd, but argv is used as is: no parsing and no copying. nonblock replaces the */
+/* trailing '&' of runcmd's command string.                                              */
+
+int runcmd_argv(char *const argv[], int *result, const int *io, int nonblock);
+
+/* Like runcmd, but a blocking command still running timeout_ms milliseconds after it started is */
+/* sent signal (SIGTERM if zero), then SIGKILL grace_ms milliseconds later unless grace_ms is    */
+/* negative. TIMEDOUT is set in *result if that happened. Non-blocking commands are not timed.  */
+
+struct runcmd_deadline
+{
+	int timeout_ms;
+	int signal;
+	int grace_ms;
+};
+
+int runcmd_timed(const char *command, int *result, const int *io, const struct runcmd_deadline *deadline);
+
+/* Per-command settings applied in the child right before exec, so they cost no extra process.  */
+/* fdmap[i] becomes the command's fd i, or fd i is closed if fdmap[i] is -1; descriptors not     */
+/* mapped are inherited as usual. A NULL options pointer means all defaults.                     */
+
+struct runcmd_options
+{
+	char *const *envp;							/* Environment; NULL keeps the caller's. */
+	const char *cwd;							/* Working directory; NULL keeps the caller's. */
+	int umask;									/* File mode creation mask; -1 keeps the caller's. */
+	const int *fdmap;							/* NULL leaves every descriptor alone. */
+	int nfds;									/* Number of entries in fdmap. */
+	int nonblock;
+	const struct runcmd_deadline *deadline;		/* NULL: no deadline. */
+};
+
+int runcmd_ex(char *const argv[], int *result, const struct runcmd_options *options);
+
+/* Batches. runcmd_batch runs n independent commands, at most max_parallel at a time (all of them */
+/* if max_parallel <= 0). runcmd_pipeline runs n commands connected by pipes; io, if not NULL,     */
+/* gives the pipeline's stdin, stdout and stderr. Both block until every command has terminated   */
+/* and store in results[i] what runcmd would have stored in *result for the i-th command (zero if  */
+/* it could not be started). Signal handling and exec failure detection are set up once per batch. */
+/* They return 0, or -1 if some command could not be started. A trailing '&' is ignored.          */
+
+int runcmd_batch(const char **commands, int n, int max_parallel, int *results);
+int runcmd_pipeline(const char **stages, int n, const int *io, int *results);
 extern void (*runcmd_onexit)(void);
 
 #endif
@@ -0,0 +1,57 @@
+#!/bin/bash
+#   bench_fanout.sh - fan-out throughput benchmark
+#   Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+#
+#   This file is part of SoloSH.
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Usage: bench_fanout.sh [SOLOSH] [MEGABYTES] [BRANCHES]
+#
+# Sends MEGABYTES of zeros to BRANCHES consumers, once with solosh's '|+' and once
+# with bash's '| tee >(...)', and prints the time each one took.
+
+SOLOSH=${1:-./solosh}
+MB=${2:-2048}
+BRANCHES=${3:-2}
+
+solosh_cmd="head -c ${MB}M /dev/zero"
+bash_cmd="head -c ${MB}M /dev/zero | tee"
+for i in $(seq 2 "$BRANCHES"); do
+	solosh_cmd="$solosh_cmd |+ cat > /dev/null"
+	bash_cmd="$bash_cmd >(cat > /dev/null)"
+done
+solosh_cmd="$solosh_cmd |+ wc -c"
+bash_cmd="$bash_cmd | wc -c"
+
+elapsed()
+{
+	local start end
+	start=$(date +%s.%N)
+	"$@" > /dev/null
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+report()
+{
+	awk -v name="$1" -v t="$2" -v mb="$MB" 'BEGIN { printf "  %-14s %8.3f s  %8.1f MB/s\n", name, t, mb / t }'
+}
+
+t_solosh=$(elapsed "$SOLOSH" -c "$solosh_cmd")
+t_bash=$(elapsed bash -c "$bash_cmd")
+
+printf "%d MB to %d consumers\n" "$MB" "$BRANCHES"
+report "solosh |+" "$t_solosh"
+report "| tee >(...)" "$t_bash"
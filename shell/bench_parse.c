@@ -0,0 +1,119 @@
+/*   bench_parse.c - libsolosh-parse throughput benchmark
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <solosh_parse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_PARSES 400000
+#define DEFAULT_MAX_THREADS 8
+
+static const char* lines[] =
+{
+	"ls -l /tmp",
+	"cat < input.txt | sort -n | uniq -c > counts.txt",
+	"make -j8 2>&1 | tee build.log && echo done || echo failed",
+	"producer --fast |+ gzip > a.gz |+ wc -l",
+	"grep -v '#' config 2> /dev/null | head -n 20 & sleep 1; jobs",
+	"sort <<< word 3>&1 1>&2 2>&3 3>&-"
+};
+
+static int parses_per_thread;
+static int failures;
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* worker(void* arg)
+{
+	SLSH_PARSER* parser;
+	SLSH_LINE* line;
+	int i, bad = 0, n = sizeof(lines)/sizeof(lines[0]);
+
+	(void) arg;
+	parser = slsh_parser_create();
+	if (parser == NULL)
+		bad = parses_per_thread;
+	for (i = 0; parser != NULL && i < parses_per_thread; i++)
+	{
+		line = slsh_parse(parser, lines[i % n]);
+		if (line == NULL)
+			bad++;
+		slsh_line_destroy(&line);
+	}
+	slsh_parser_destroy(&parser);
+	pthread_mutex_lock(&failures_lock);
+	failures += bad;
+	pthread_mutex_unlock(&failures_lock);
+	return NULL;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char* argv[])
+{
+	int total = DEFAULT_PARSES, max_threads = DEFAULT_MAX_THREADS, nthreads, i;
+	pthread_t* tids;
+	double start, elapsed;
+
+	if (argc > 3)
+	{
+		printf("Usage:\n\t./bench_parse [PARSES] [MAX THREADS]\n");
+		return 0;
+	}
+	if (argc > 1)
+		total = atoi(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+
+	if (total <= 0 || max_threads <= 0)
+	{
+		printf("PARSES and MAX THREADS must be positive.\n");
+		return 1;
+	}
+
+	tids = (pthread_t*) malloc(sizeof(pthread_t)*max_threads);
+	if (tids == NULL)
+		return 1;
+
+	printf("%d lines parsed per run, each thread with its own parser\n", total);
+	printf("%8s %12s %12s %9s\n", "threads", "seconds", "lines/sec", "failures");
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+	{
+		parses_per_thread = total/nthreads;
+		failures = 0;
+
+		start = now();
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&tids[i], NULL, worker, NULL);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tids[i], NULL);
+		elapsed = now() - start;
+
+		printf("%8d %12.3f %12.0f %9d\n", nthreads, elapsed, parses_per_thread*nthreads/elapsed, failures);
+	}
+	free(tids);
+	return 0;
+}
@@ -17,8 +17,20 @@
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <solosh_capture.h>
+#include <solosh_cgroup.h>
+#include <solosh_compile.h>
+#include <solosh_complete.h>
+#include <solosh_edit.h>
 #include <solosh_errors.h>
+#include <solosh_fanout.h>
+#include <solosh_glob.h>
+#include <solosh_history.h>
+#include <solosh_parallel.h>
 #include <solosh_parser.h>
+#include <solosh_subst.h>
+#include <solosh_vars.h>
+#include <solosh_wait.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
@@ -31,26 +43,86 @@
 #include <unistd.h>
 
 #define SLSH_MAX_PATH 2048
+#define INITIAL_SCRIPT_CAP 1024
+
+extern char** environ;
 
 /* ------- JOBS -------*/
 
+#define SLSH_FIRST_JOB_FD (SLSH_MAX_FD+1)	/* Children move the job's files here before redirecting. */
+
+typedef struct job_redir
+{
+	int cmd;				/* Index of the command it applies to. */
+	REDIR r;
+	int file;				/* What the job opened for it, or -1. */
+}JOB_REDIR;
+
 typedef struct job
 {
 	char* name;				/* The job's name as it will be showed by the 'jobs' built-in command. */
 	char*** cmd;			/* The commands that make up the job. cmd[i][j] is the j+1-th argument of the i+1-th command and */
 	int ncmd;				/* the 1st argument is the commands name. */
-	int inputfd, outputfd;	/* Input and output file descriptors. */
+	JOB_REDIR* redir;		/* Sorted by command, and in the order they are applied. */
+	int nredir;
+	int nfan;				/* Branches after '|+', 0 for plain pipelines. Branch b is cmd[fanstart[b]] up to the */
+	int* fanstart;			/* next branch, the producer is everything before fanstart[0]. */
+	pid_t fanpid;			/* The process copying the producer's output to the branches. */
+	CAPTURE* capture;		/* Where a non-blocking job's output goes, if $BG_CAPTURE says so. */
+	CGROUP* cgroup;			/* A non-blocking job's own cgroup, if $JOB_CGROUP says where. */
+	int done;				/* A captured job stays listed after it ends, until its output is read, and */
+							/* one with a cgroup until 'jobs' shows it. */
 	int blocking;			/* Whether the job is blocking (name not ended by '&') or not. */
 	pid_t* pid;				/* Will hold the process IDs related to the job. */
 	pid_t pgid;				/* Will hold the process group ID of the processes related to the job */
 	int run_count;			/* Holds the number of running processes originated from the job */
+	int status;				/* Exit status of the last command, once the job has terminated */
 	time_t lastmodified;		/* Used by bg and fg when executed with no argument */
 }JOB;
 
-JOB* create_job(const char* command);
+JOB* create_job(const char* command, const SUBSTS* s);		/* With s, the words are expanded after the */
+															/* command is parsed. */
 void destroy_job(JOB** job);
 
 
+/* ------- JOB TEMPLATES ------- */
+
+#define SLSH_JOB_CACHE_SIZE 256
+#define SLSH_JOB_CACHE_BUCKETS 512
+
+/* What create_job gets out of parsing a command. Templates are kept in an LRU cache keyed by */
+/* the command text and are never modified, each JOB is a copy with its own redirection files */
+/* and glob expansions. */
+
+typedef struct job_template
+{
+	char* text;				/* The command, which is also the job's name. */
+	unsigned long hash;
+	char*** cmd;			/* As in JOB, before glob expansion. */
+	int ncmd;
+	JOB_REDIR* redir;		/* Owns the file names. Only here-documents are open. */
+	int nredir;
+	int nfan, *fanstart;
+	int blocking;
+	struct job_template* prev, *next;		/* LRU order, most recent first. */
+	struct job_template* chain;				/* Next in the same bucket. */
+}JOB_TEMPLATE;
+
+typedef struct job_cache
+{
+	JOB_TEMPLATE* bucket[SLSH_JOB_CACHE_BUCKETS];
+	JOB_TEMPLATE* first, *last;
+	int count;
+	unsigned long hits, misses;
+}JOB_CACHE;
+
+JOB_CACHE job_cache;
+
+JOB_TEMPLATE* job_cache_get(const char* command);		/* Parses command only if it is not cached. */
+void job_cache_destroy();
+JOB* job_from_template(const JOB_TEMPLATE* t, const SUBSTS* s);
+
+
 /* ------- PIPES ------- */
 
 int** create_pipes(int n);
@@ -70,64 +142,266 @@ void destroy_pipes(int*** pipes, int n);
 typedef struct job_list
 {
 	JOB** v;
-	int jobcount, capacity, last;
+	int* ended;				/* Exit status of the background job that last left each slot, until 'wait' */
+	int jobcount, capacity, last;		/* reports it, or -1. */
 }JOB_LIST;
 
 JOB_LIST* job_list(int action);					/* The list is a singleton. This method is used for its creation, retrieval and destruction. */
-int job_list_push(JOB* job);
+int job_list_push(JOB* job);					/* Must be called with SIGCHLD blocked. */
 void job_list_erase(const JOB* job);
 JOB* job_list_find_by_pid(pid_t pid);
 int job_list_find_lastmodified_id();
 /* ------- RUN THINGS ------- */
 
 int exit_flag = 0;								/* Tells the main loop when to stop looping. Set by run_builtin_cmd. */
+char cwd[SLSH_MAX_PATH] = "";					/* The working directory, and the prompt made from it. Only */
+char prompt[SLSH_MAX_PATH+8] = "";				/* update_cwd changes them: at start and after 'cd'.       */
+int update_cwd();
 int run_builtin_cmd(char* cmd[]);
-pid_t run_cmd(char* cmd[], int input_file, int output_file, int** pipes, int npipes, pid_t session); 	/* The pipes are needed because they must */
-int run_job(JOB* job);																					/* be destroyed in the child. */
+pid_t run_cmd(char* cmd[], int input_file, int output_file, int error_file, JOB_REDIR* redir, int nredir, 	/* The pipes are needed */
+			  int** pipes, int npipes, pid_t session, const CGROUP* cgroup);				/* because they must be destroyed in the child. */
+int show_output(int jobid, int follow);		/* 'jobs -o [-f] ID' */
+void show_usage(const JOB* job);			/* What 'jobs -l' adds after a job's name. */
+int run_exec(char* cmd[], JOB_REDIR* redir, int nredir);		/* Redirections that stay in the shell. */
+int is_coproc(const char* text);
+int run_coproc(const char* text, const SUBSTS* s);		/* 'coproc NAME COMMAND' */
+int run_job(JOB* job);
+int run_assignments(const char* item, const SUBSTS* s);
+int last_status = 0;							/* Exit status of the last job, used by '&&' and '||'. */
+
+
+/* ------- PROGRAMS ------- */
+
+#define SLSH_MAX_POSITIONAL 9					/* $1 to $9 inside functions. */
+
+typedef struct loop								/* State of a running 'for' loop. */
+{
+	char** words;
+	int next;
+	struct loop* outer;
+}LOOP;
+
+PROGRAM* compile_text(const char* text, int* status);
+char* read_script(int* len, int blank);			/* All of stdin, for scripts. */
+int open_history();								/* $HISTFILE, or SLSH_HISTFILE_DEFAULT in $HOME. */
+int run_node(const char* command);				/* Runs command in a process of its own, see main. */
+char* expand_text(const char* text);			/* Variables and '$(...)'. */
+int run_program(PROGRAM* prog, int pc);			/* Runs from pc to the end, or to the end of the function. */
+int run_item(INSTR* in);						/* Runs an I_RUN instruction and returns its status. */
+int call_function(PROGRAM* prog, int pc, char** argv);
 
 /* ------- MANAGE RUNNING THINGS ------- */
-void fg_wait(JOB* job);										/* This function does the waiting when there's a job on foreground */
+int fg_wait(JOB* job);										/* This function does the waiting when there's a job on foreground */
 void sigchld_handler(int sig, siginfo_t* info, void* u);	/* Handles SIGCHLD for non-blocking jobs */
+int wait_jobs(char* cmd[]);									/* 'wait [-n] [ID...]' */
 
 
 /* ------- JOBS ------- */
 
-JOB* create_job(const char* command)
+static char** copy_words(char** words)
 {
-	JOB* job = NULL;
-	char* cleancmd, ***iter;
+	char** ret, *block;
+	int n, i;
+	size_t size;
+
+	for (n = 0; words[n] != NULL; n++)
+		;
+
+	ret = (char**) malloc(sizeof(char*)*(n+1));
+	error(ret == NULL, NULL);
+	ret[n] = NULL;
+	if (n == 0)
+		return ret;
+
+	size = words[n-1] - words[0] + strlen(words[n-1]) + 1;	/* The words share the block words[0] points to. */
+	block = (char*) malloc(size);
+	error(block == NULL, (free(ret), NULL));
+	memcpy(block, words[0], size);
+
+	for (i = 0; i < n; i++)
+		ret[i] = block + (words[i] - words[0]);
+	return ret;
+}
+
+/* Expands each word and splits what comes out at blanks, but nothing in a value or in the */
+/* output of a '$(...)' is ever taken for an operator. A word that expands to nothing is gone. */
+/* The old array is freed. */
+
+static char** expand_words(char** words, const SUBSTS* s)
+{
+	static const char expandable[] = {SLSH_VAR_SIGN, SLSH_SUBST_MARK, '\0'};
+	char** values, *text = NULL, **ret = NULL;
+	int i, n, k, len = 0;
+
+	for (n = 0; words[n] != NULL; n++)
+		;
+	values = (char**) calloc(n+1, sizeof(char*));
+	error(values == NULL, (free(words[0]), free(words), NULL));
+	for (i = 0; i < n; i++)
+	{
+		values[i] = strpbrk(words[i], expandable) != NULL ? expand_word(words[i], s) : words[i];
+		if (values[i] == NULL)
+			break;
+		len += strlen(values[i]) + 1;
+	}
+
+	if (i == n)
+		text = (char*) malloc(sizeof(char)*(len+1));
+	if (text != NULL)
+	{
+		for (i = len = 0; i < n; i++)
+		{
+			k = strlen(values[i]);
+			memcpy(text+len, values[i], k);
+			len += k;
+			text[len++] = ' ';
+		}
+		text[len] = '\0';
+		ret = split_words(text);
+		free(text);
+	}
+
+	for (i = 0; i < n && values[i] != NULL; i++)
+		if (values[i] != words[i])
+			free(values[i]);
+	free(values);
+	free(words[0]);
+	free(words);
+	return ret;
+}
+
+/* The first line of text, which names the job, with its '$(...)' shown as written. */
+
+static char* job_name(const char* text, const SUBSTS* s)
+{
+	int len = strcspn(text, "\n");			/* Not the here-document lines. */
+	char* line, *ret;
+
+	line = (char*) malloc(sizeof(char)*(len+1));
+	error(line == NULL, NULL);
+	memcpy(line, text, len);
+	line[len] = '\0';
+	if (s == NULL)
+		return line;
+	ret = show_substs(line, s);
+	free(line);
+	return ret;
+}
+
+JOB* create_job(const char* command, const SUBSTS* s)
+{
+	JOB_TEMPLATE* t;
 
 	if (command == NULL)
 		return NULL;
 
-	job = (JOB*) malloc(sizeof(JOB));
+	t = job_cache_get(command);
+	if (t == NULL)
+		return NULL;
+	return job_from_template(t, s);
+}
+
+/* Opens what the template's redirection r needs, with its file name or here-string expanded */
+/* first with s. Returns the descriptor, -1 on error, or -2 if it needs none. */
+
+static int open_job_redir(const JOB_REDIR* r, const SUBSTS* s)
+{
+	REDIR copy = r->r;
+	int fd, here;
+
+	if (copy.op != REDIR_HERE && copy.filename == NULL)
+		return -2;
+	if (s != NULL && copy.op == REDIR_HERE && copy.body != NULL)		/* A here-string to expand. */
+	{
+		copy.body = expand_word(copy.body, s);
+		if (copy.body == NULL)
+			return -1;
+		here = make_here_file(copy.body);
+		free(copy.body);
+		fd = here >= 0 ? open_here_file(here) : -1;
+		if (here >= 0)
+			close(here);
+	}
+	else if (copy.op == REDIR_HERE)
+		fd = open_here_file(r->file);
+	else
+	{
+		if (s != NULL)
+			copy.filename = expand_word(copy.filename, s);
+		if (copy.filename == NULL)
+			return -1;
+		fd = open_redir_file(&copy);
+	}
+
+	if (fd < 0)
+		printf("%s: %s\n", copy.op == REDIR_HERE ? SLSH_HERE_DOC : copy.filename, strerror(errno));
+	if (copy.filename != r->r.filename)
+		free(copy.filename);
+	return fd;
+}
+
+JOB* job_from_template(const JOB_TEMPLATE* t, const SUBSTS* s)
+{
+	JOB* job = NULL;
+	int i;
+
+	job = (JOB*) calloc(1, sizeof(JOB));
 	error(job == NULL, NULL);
 
-	job->name = (char*) malloc(sizeof(char)*(strlen(command)+1));
-	error(job->name == NULL, (free(job), NULL));
-	strcpy(job->name, command);
+	job->name = job_name(t->text, s);
+	if (job->name == NULL)
+		return (destroy_job(&job), NULL);
 
-	job->inputfd = get_io_redir_file(command, SLSH_INPUT);
-	job->outputfd = get_io_redir_file(command, SLSH_OUTPUT);
+	if (t->nredir > 0)
+	{
+		job->redir = (JOB_REDIR*) malloc(sizeof(JOB_REDIR)*t->nredir);
+		error(job->redir == NULL, (destroy_job(&job), NULL));
+		for (i = 0; i < t->nredir; i++)
+		{
+			job->redir[i] = t->redir[i];
+			job->redir[i].r.filename = NULL;		/* The template may be evicted before the job ends. */
+			job->redir[i].r.body = NULL;
+			job->redir[i].file = -1;
+		}
+		job->nredir = t->nredir;
+		for (i = 0; i < t->nredir; i++)
+		{
+			job->redir[i].file = open_job_redir(&t->redir[i], s);
+			if (job->redir[i].file == -2)
+				job->redir[i].file = -1;
+			else if (job->redir[i].file < 0)
+			{
+				destroy_job(&job);
+				return NULL;
+			}
+		}
+	}
 
-	job->blocking = is_blocking(command);
+	if (t->nfan > 0)
+	{
+		job->fanstart = (int*) malloc(sizeof(int)*t->nfan);
+		error(job->fanstart == NULL, (destroy_job(&job), NULL));
+		memcpy(job->fanstart, t->fanstart, sizeof(int)*t->nfan);
+		job->nfan = t->nfan;
+	}
 
-	cleancmd = clean_command(command);
-	error(cleancmd == NULL, (destroy_job(&job), NULL));
+	job->blocking = t->blocking;
 
-	job->cmd = make_cmd_array(cleancmd);
-	free(cleancmd);
+	job->cmd = (char***) calloc(t->ncmd+1, sizeof(char**));
 	error(job->cmd == NULL, (destroy_job(&job), NULL));
-
-	job->ncmd = 0;
-	iter = job->cmd;
-	while (*iter != NULL)
+	for (i = 0; i < t->ncmd; i++)
 	{
-		job->ncmd++;
-		iter++;
+		job->cmd[i] = copy_words(t->cmd[i]);
+		if (job->cmd[i] != NULL && s != NULL)
+			job->cmd[i] = expand_words(job->cmd[i], s);
+		if (job->cmd[i] != NULL)
+			job->cmd[i] = glob_words(job->cmd[i]);
+		error(job->cmd[i] == NULL, (destroy_job(&job), NULL));
 	}
+	job->ncmd = t->ncmd;
 
 	job->run_count = 0;
+	job->status = 0;
 	
 	job->pgid = 0;
 
@@ -141,15 +415,18 @@ JOB* create_job(const char* command)
 void destroy_job(JOB** job)
 {
 	char*** iter;
+	int i;
 
 	if (job == NULL || *job == NULL)
 		return;
 
-	if ((*job)->inputfd >= 0)
-		close((*job)->inputfd);
-	
-	if ((*job)->outputfd >= 0)
-		close((*job)->outputfd);
+	for (i = 0; i < (*job)->nredir; i++)
+		if ((*job)->redir[i].file >= 0)
+			close((*job)->redir[i].file);
+	free((*job)->redir);
+	free((*job)->fanstart);
+	capture_destroy(&(*job)->capture);
+	cgroup_destroy(&(*job)->cgroup);
 	
 	iter = (*job)->cmd;
 	if (iter != NULL)
@@ -169,6 +446,280 @@ void destroy_job(JOB** job)
 }
 
 
+/* ------- JOB TEMPLATES ------- */
+
+static unsigned long hash_command(const char* command)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*command != '\0')
+	{
+		h ^= (unsigned char) *command++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static void destroy_template(JOB_TEMPLATE* t)
+{
+	char*** iter;
+	int i;
+
+	if (t->cmd != NULL)
+	{
+		for (iter = t->cmd; *iter != NULL; iter++)
+		{
+			free(**iter);
+			free(*iter);
+		}
+	}
+	free(t->cmd);
+	free(t->text);
+	for (i = 0; i < t->nredir; i++)
+	{
+		free(t->redir[i].r.filename);
+		free(t->redir[i].r.body);
+		if (t->redir[i].file >= 0)
+			close(t->redir[i].file);
+	}
+	free(t->redir);
+	free(t->fanstart);
+	free(t);
+}
+
+/* Appends one command of a pipeline, with its redirections, to t. Blank commands are skipped. */
+
+static int add_command(JOB_TEMPLATE* t, const char* text)
+{
+	char* cleancmd, **words, ***newcmd;
+	REDIR* r;
+	JOB_REDIR* newredir;
+	int n, i;
+
+	cleancmd = clean_command(text);
+	error(cleancmd == NULL, -1);
+	if (cleancmd[strspn(cleancmd, SLSH_BLANK_CHARS)] == '\0')
+	{
+		free(cleancmd);
+		return 0;
+	}
+	words = split_words(cleancmd);
+	free(cleancmd);
+	error(words == NULL, -1);
+
+	newcmd = (char***) realloc(t->cmd, sizeof(char**)*(t->ncmd+2));
+	error(newcmd == NULL, (free(words[0]), free(words), -1));
+	t->cmd = newcmd;
+	t->cmd[t->ncmd++] = words;
+	t->cmd[t->ncmd] = NULL;
+
+	n = get_redirs(text, &r);
+	if (n <= 0)
+		return n < 0 ? -1 : 1;
+	newredir = (JOB_REDIR*) realloc(t->redir, sizeof(JOB_REDIR)*(t->nredir+n));
+	error(newredir == NULL, (destroy_redirs(r, n), -1));
+	t->redir = newredir;
+	for (i = 0; i < n; i++)
+	{
+		t->redir[t->nredir].cmd = t->ncmd-1;
+		t->redir[t->nredir].r = r[i];
+		t->redir[t->nredir++].file = -1;
+	}
+	free(r);			/* The file names now belong to t. */
+	return 1;
+}
+
+/* Appends the commands of one '|+' segment of a job to t. Returns how many there were. */
+
+static int add_segment(JOB_TEMPLATE* t, const char* segment)
+{
+	char* text;
+	int len, n = 0, ret;
+
+	for (;;)
+	{
+		len = strcspn(segment, SLSH_PIPE);
+		text = (char*) malloc(sizeof(char)*(len+1));
+		error(text == NULL, -1);
+		memcpy(text, segment, len);
+		text[len] = '\0';
+		ret = add_command(t, text);
+		free(text);
+		if (ret < 0)
+			return -1;
+		n += ret;
+		if (segment[len] == '\0')
+			return n;
+		segment += len+1;
+	}
+}
+
+/* Reads the bodies of t's here-documents, in order, from the lines after the command, and puts */
+/* each body in a sealed memfd that all of t's jobs read. */
+
+static int add_here_files(JOB_TEMPLATE* t, const char* lines)
+{
+	REDIR* r;
+	int i, string;
+
+	for (i = 0; i < t->nredir; i++)
+	{
+		r = &t->redir[i].r;
+		if (r->op != REDIR_HERE)
+			continue;
+		string = r->body != NULL;
+		if (r->body == NULL && (r->body = get_here_body(&lines, r->filename, strlen(r->filename))) == NULL)
+		{
+			printf("Syntax error: here-document without '%s'.\n", r->filename);
+			return -1;
+		}
+		t->redir[i].file = make_here_file(r->body);
+		if (t->redir[i].file < 0)
+			return -1;
+		if (string && (strchr(r->body, SLSH_VAR_SIGN) != NULL || strchr(r->body, SLSH_SUBST_MARK) != NULL))
+			continue;				/* Kept for job_from_template to expand. */
+		free(r->body);
+		r->body = NULL;
+	}
+	return 0;
+}
+
+static JOB_TEMPLATE* make_template(const char* command)
+{
+	JOB_TEMPLATE* t;
+	char* head, *segment, *next;
+	int n, len, *newstart;
+
+	t = (JOB_TEMPLATE*) calloc(1, sizeof(JOB_TEMPLATE));
+	error(t == NULL, NULL);
+
+	t->text = (char*) malloc(sizeof(char)*(strlen(command)+1));
+	error(t->text == NULL, (destroy_template(t), NULL));
+	strcpy(t->text, command);
+
+	len = strcspn(command, "\n");			/* Here-document lines follow the first one. */
+	head = (char*) malloc(sizeof(char)*(len+1));
+	error(head == NULL, (destroy_template(t), NULL));
+	memcpy(head, command, len);
+	head[len] = '\0';
+
+	t->blocking = is_blocking(head);
+	t->cmd = (char***) calloc(1, sizeof(char**));
+	error(t->cmd == NULL, (free(head), destroy_template(t), NULL));
+
+	/* 'producer |+ branch |+ branch', each one with its own redirections. */
+	for (segment = head; segment != NULL; segment = next)
+	{
+		next = strstr(segment, SLSH_FANOUT);
+		if (next != NULL)
+		{
+			*next = '\0';
+			next += strlen(SLSH_FANOUT);
+		}
+
+		if (segment != head)
+		{
+			newstart = (int*) realloc(t->fanstart, sizeof(int)*(t->nfan+1));
+			error(newstart == NULL, (free(head), destroy_template(t), NULL));
+			t->fanstart = newstart;
+			t->fanstart[t->nfan++] = t->ncmd;
+		}
+
+		n = add_segment(t, segment);		/* Errors are already reported. */
+		if (n < 0 || (n == 0 && (next != NULL || segment != head)))
+		{
+			if (n == 0)
+				printf("Syntax error: empty command around '%s'.\n", SLSH_FANOUT);
+			free(head);
+			destroy_template(t);
+			return NULL;
+		}
+	}
+	free(head);
+
+	if (add_here_files(t, command[len] != '\0' ? command+len+1 : command+len) < 0)
+	{
+		destroy_template(t);
+		return NULL;
+	}
+	return t;
+}
+
+static void lru_unlink(JOB_TEMPLATE* t)
+{
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		job_cache.first = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	else
+		job_cache.last = t->prev;
+	t->prev = t->next = NULL;
+}
+
+static void lru_push_front(JOB_TEMPLATE* t)
+{
+	t->next = job_cache.first;
+	t->prev = NULL;
+	if (job_cache.first != NULL)
+		job_cache.first->prev = t;
+	job_cache.first = t;
+	if (job_cache.last == NULL)
+		job_cache.last = t;
+}
+
+static void job_cache_evict(JOB_TEMPLATE* t)
+{
+	JOB_TEMPLATE** iter = &job_cache.bucket[t->hash % SLSH_JOB_CACHE_BUCKETS];
+
+	while (*iter != t)
+		iter = &(*iter)->chain;
+	*iter = t->chain;
+	lru_unlink(t);
+	destroy_template(t);
+	job_cache.count--;
+}
+
+JOB_TEMPLATE* job_cache_get(const char* command)
+{
+	unsigned long hash = hash_command(command);
+	JOB_TEMPLATE* t;
+
+	for (t = job_cache.bucket[hash % SLSH_JOB_CACHE_BUCKETS]; t != NULL; t = t->chain)
+	{
+		if (t->hash == hash && !strcmp(t->text, command))
+		{
+			job_cache.hits++;
+			lru_unlink(t);
+			lru_push_front(t);
+			return t;
+		}
+	}
+
+	job_cache.misses++;
+	t = make_template(command);
+	if (t == NULL)
+		return NULL;
+	t->hash = hash;
+
+	if (job_cache.count == SLSH_JOB_CACHE_SIZE)
+		job_cache_evict(job_cache.last);
+
+	t->chain = job_cache.bucket[hash % SLSH_JOB_CACHE_BUCKETS];
+	job_cache.bucket[hash % SLSH_JOB_CACHE_BUCKETS] = t;
+	lru_push_front(t);
+	job_cache.count++;
+	return t;
+}
+
+void job_cache_destroy()
+{
+	while (job_cache.last != NULL)
+		job_cache_evict(job_cache.last);
+}
+
+
 /* ------- PIPES ------- */
 
 int** create_pipes(int n)
@@ -232,6 +783,13 @@ JOB_LIST* job_list(int cmd)
 			list->last = -1;
 			list->v = (JOB**) malloc(sizeof(JOB*)*(list->capacity));
 			error(list->v == NULL, (free(list), NULL));
+			list->ended = (int*) malloc(sizeof(int)*(list->capacity));
+			error(list->ended == NULL, (free(list->v), free(list), NULL));
+			for (i = 0; i < list->capacity; i++)
+			{
+				list->v[i] = NULL;
+				list->ended[i] = -1;
+			}
 			break;
 
 		case JL_DESTROY:
@@ -239,7 +797,9 @@ JOB_LIST* job_list(int cmd)
 				return NULL;
 			for (i = 0; i <= list->last; i++)
 					destroy_job(&(list->v[i]));
+			cgroup_sweep();			/* Last try for groups that were still busy. */
 			free(list->v);
+			free(list->ended);
 			free(list);
 			list = NULL;
 			break;
@@ -249,27 +809,37 @@ JOB_LIST* job_list(int cmd)
 
 int job_list_push(JOB* item)
 {
-	int pos;
+	int pos, i;
 	JOB_LIST* list = job_list(JL_GET);
 	
 	if (list == NULL || item == NULL)
 		return -1;
 
 	pos = list->last;	
-	if (list->v[pos] != NULL)
+	if (pos < 0 || list->v[pos] != NULL)
 		pos++;
 	
 	if (pos >= list->capacity)
 	{
 		JOB** newv;
+		int* newended;
 		
 		newv = (JOB**) realloc(list->v, sizeof(JOB*)*(2*list->capacity));
 		error(newv == NULL, -1);
 		list->v = newv;
+		newended = (int*) realloc(list->ended, sizeof(int)*(2*list->capacity));
+		error(newended == NULL, -1);
+		list->ended = newended;
+		for (i = list->capacity; i < 2*list->capacity; i++)
+		{
+			list->v[i] = NULL;
+			list->ended[i] = -1;
+		}
 		list->capacity *= 2;
 	}
 
 	list->v[pos] = item;
+	list->ended[pos] = -1;
 	list->last = pos;
 	list->jobcount++;
 	return 0;
@@ -306,13 +876,17 @@ JOB* job_list_find_by_pid(pid_t pid)
 	for (idx = 0; idx <= list->last; idx++)
 	{
 		JOB* job = list->v[idx];
-		if (job != NULL)
+		if (job != NULL && !job->done)		/* Its pids may belong to someone else by now. */
 		{
 			for (i = 0; i < job->ncmd; i++)
 			{
 				if (job->pid[i] == pid)
 					return job;
 			}
+			if (job->fanpid > 0 && job->fanpid == pid)
+				return job;
+			if (job->capture != NULL && job->capture->pid == pid)
+				return job;
 		}
 	}
 	return NULL;
@@ -341,12 +915,18 @@ int job_list_find_lastmodified_id()
 
 /* ------- RUN THINGS -------  */
 
+int update_cwd()
+{
+	error(getcwd(cwd, SLSH_MAX_PATH) == NULL, (cwd[0] = '\0', -1));
+	sprintf(prompt, "@ %s: ", cwd);
+	return 0;
+}
+
 int run_builtin_cmd(char* cmd[])	/* TODO: make these work correctly inside pipes (io redirection?) */
 {
 	int id, i, jobid;
 	JOB_LIST* list;
-	char path[SLSH_MAX_PATH];
-    char *raux;
+	JOB* job;
 
 	if (cmd == NULL)
 		return -1;
@@ -374,17 +954,36 @@ int run_builtin_cmd(char* cmd[])	/* TODO: make these work correctly inside pipes
 
 		case CMD_CD:
 			error(chdir(cmd[1]) < 0, -1);
-			raux = getcwd(path, SLSH_MAX_PATH*sizeof(char)); 
-            error(raux == NULL, -1);
-			error(path == NULL, -1);
-			error(setenv("PWD", path, 1) < 0, -1);
+			error(update_cwd() < 0, -1);
+			error(var_set("PWD", cwd) < 0, -1);
+			error(var_export("PWD") < 0, -1);
 			break;
 
+		case CMD_COPROC:
+			printf("coproc: must begin the command.\n");		/* run_item takes the others. */
+			return -1;
+
+		case CMD_EXEC:
+			return run_exec(cmd, NULL, 0);
+
 		case CMD_EXIT:
 		case CMD_QUIT:
 			exit_flag = 1;
 			break;
 
+		case CMD_EXPORT:
+			if (cmd[1] == NULL)
+				for (i = 0; environ[i] != NULL; i++)
+					printf("export %s\n", environ[i]);
+			for (i = 1; cmd[i] != NULL; i++)
+			{
+				if (is_assignment(cmd[i]))
+					error(var_assign(cmd[i], 1) < 0, -1);
+				else
+					error(var_export(cmd[i]) < 0, -1);
+			}
+			break;
+
 		case CMD_FG:
 			list = job_list(JL_GET);
 			
@@ -405,149 +1004,919 @@ int run_builtin_cmd(char* cmd[])	/* TODO: make these work correctly inside pipes
 			break;
 		
 		case CMD_JOBS:
+			if (cmd[1] != NULL && !strcmp(cmd[1], "-c"))
+			{
+				printf("job cache: %d/%d templates, %lu hits, %lu misses\n", job_cache.count,
+					   SLSH_JOB_CACHE_SIZE, job_cache.hits, job_cache.misses);
+				break;
+			}
+			if (cmd[1] != NULL && !strcmp(cmd[1], "-o"))
+			{
+				i = cmd[2] != NULL && !strcmp(cmd[2], "-f");
+				if (cmd[2+i] == NULL)
+				{
+					printf("Usage: jobs -o [-f] ID\n");
+					return -1;
+				}
+				return show_output(atoi(cmd[2+i]), i);
+			}
 			list = job_list(JL_GET);
 			for (i = 0; i <= list->last; i++)
-				if (list->v[i] != NULL)
-					printf("[%d] %s\n", i, list->v[i]->name);
+			{
+				if (list->v[i] == NULL)
+					continue;
+				printf("[%d] %s%s", i, list->v[i]->name, list->v[i]->done ? " (done)" : "");
+				if (cmd[1] != NULL && !strcmp(cmd[1], "-l"))
+					show_usage(list->v[i]);
+				printf("\n");
+				if (list->v[i]->done && list->v[i]->capture == NULL)		/* Only kept for its cgroup's */
+				{															/* counters, now shown. */
+					job = list->v[i];
+					job_list_erase(job);
+					destroy_job(&job);
+				}
+			}
+			break;
+
+		case CMD_PWD:
+			error(cwd[0] == '\0' && update_cwd() < 0, -1);
+			printf("%s\n", cwd);
 			break;
 
+		case CMD_UNSET:
+			for (i = 1; cmd[i] != NULL; i++)
+				var_unset(cmd[i]);
+			break;
+
+		case CMD_WAIT:
+			return wait_jobs(cmd) == 0 ? 0 : -1;		/* run_item keeps the whole status. */
+
 		default:
 			return -1;
 	}
 	return 0;
 }
 
-pid_t run_cmd(char* cmd[], int input_file, int output_file, int** pipes, int npipes, pid_t pgid)
-{
-	pid_t cpid;
-
-	if (cmd == NULL)
-		return -1;
-
-	if (get_builtin_cmd(cmd[0]))
-		return run_builtin_cmd(cmd);
+/* Applies redirections in the current process. The files the job opened are first moved above */
+/* the descriptors a redirection can name, so no redirection overwrites one of them. */
 
-	cpid = fork();
+static int apply_redirs(JOB_REDIR* redir, int nredir)
+{
+	int i, fd;
 
-	error(cpid < 0, -1);
-	
-	if (cpid == 0)
+	for (i = 0; i < nredir; i++)
 	{
-        fatal_error(setpgid(0, pgid) < 0, -1);	/* pgid == 0 -> new group with id equal to the current pid */
-
-         signal (SIGINT, SIG_DFL);
-         signal (SIGQUIT, SIG_DFL);
-         signal (SIGTSTP, SIG_DFL);
-         signal (SIGTTIN, SIG_DFL);
-         signal (SIGTTOU, SIG_DFL);
-         signal (SIGCHLD, SIG_DFL);
+		if (redir[i].file >= 0 && redir[i].file < SLSH_FIRST_JOB_FD)
+		{
+			fd = fcntl(redir[i].file, F_DUPFD_CLOEXEC, SLSH_FIRST_JOB_FD);
+			error(fd < 0, -1);
+			close(redir[i].file);
+			redir[i].file = fd;
+		}
+	}
 
-		if (input_file != 0)
+	for (i = 0; i < nredir; i++)
+	{
+		switch (redir[i].r.op)
 		{
-			close(0);
-			fatal_error(dup(input_file) < 0, -1);
-			close(input_file);
+			case REDIR_DUP:
+				fd = dup2(redir[i].r.target, redir[i].r.fd);
+				break;
+			case REDIR_CLOSE:
+				close(redir[i].r.fd);
+				fd = 0;
+				break;
+			default:
+				fd = dup2(redir[i].file, redir[i].r.fd);
+				break;
 		}
-		if (output_file != 1)
+		if (fd < 0)
 		{
-			close(1);
-			fatal_error(dup(output_file) < 0, -1);
-			close(output_file);
+			printf("%d: %s\n", redir[i].r.op == REDIR_DUP ? redir[i].r.target : redir[i].r.fd, strerror(errno));
+			return -1;
 		}
-		destroy_pipes(&pipes, npipes);
-		execvp(cmd[0], cmd);
-		printf("%s\n", strerror(errno));
-		exit(EXIT_FAILURE);
 	}
-	return cpid;
+	return 0;
+}
+
+/* Prints what a captured job has written since the last time. Following it goes on until the */
+/* job ends. A job that has ended is forgotten once its output is read. */
+
+int show_output(int jobid, int follow)
+{
+	JOB_LIST* list = job_list(JL_GET);
+	JOB* job;
+	int n;
+
+	if (jobid < 0 || jobid > list->last || list->v[jobid] == NULL)
+	{
+		printf("No such job.\n");
+		return -1;
+	}
+	job = list->v[jobid];
+	if (job->capture == NULL)
+	{
+		printf("Job %d's output is not captured.\n", jobid);
+		return -1;
+	}
+
+	while ((n = capture_dump(job->capture, stdout)) >= 0 && follow && !job->done)
+		if (n == 0)
+			capture_wait(job->capture, 20000000);		/* Also wakes up to notice the job ending. */
+
+	if (job->done)
+	{
+		capture_dump(job->capture, stdout);
+		job_list_erase(job);
+		destroy_job(&job);
+	}
+	return 0;
+}
+
+/* What the job's cgroup counted, for everything the job started. */
+
+void show_usage(const JOB* job)
+{
+	CGROUP_USAGE u;
+
+	if (cgroup_usage(job->cgroup, &u) < 0)
+		return;
+	if (u.usec >= 0)
+		printf("  cpu %ld.%02lds", u.usec / 1000000, u.usec / 10000 % 100);
+	if (u.user_usec >= 0 && u.system_usec >= 0)
+		printf(" (user %ld.%02lds, sys %ld.%02lds)", u.user_usec / 1000000, u.user_usec / 10000 % 100,
+			   u.system_usec / 1000000, u.system_usec / 10000 % 100);
+	if (u.peak >= 0)
+		printf("  memory peak %ldK", u.peak / 1024);
 }
 
+int run_exec(char* cmd[], JOB_REDIR* redir, int nredir)
+{
+	fflush(stdout);
+	if (apply_redirs(redir, nredir) < 0)
+		return -1;
+	if (cmd[1] == NULL)
+		return 0;
+
+	execvp(cmd[1], cmd+1);
+	printf("%s: %s\n", cmd[1], strerror(errno));
+	return -1;
+}
+
+#define SLSH_COPROC "coproc"
+#define SLSH_COPROC_FIRST_FD 3
+
+int is_coproc(const char* text)
+{
+	text += strspn(text, SLSH_BLANK_CHARS);
+	return !strncmp(text, SLSH_COPROC, strlen(SLSH_COPROC)) &&
+		   (text[strlen(SLSH_COPROC)] == '\0' || strchr(SLSH_BLANK_CHARS, text[strlen(SLSH_COPROC)]) != NULL);
+}
+
+/* Moves *fd to the lowest free descriptor from first on, closed on exec. */
+
+static int move_fd(int* fd, int first)
+{
+	int newfd = fcntl(*fd, F_DUPFD_CLOEXEC, first);
+
+	error(newfd < 0, -1);
+	close(*fd);
+	*fd = newfd;
+	return 0;
+}
+
+/* Sets NAME_suffix to fd, or with fd < 0 only tells whether that is a valid name. */
+
+static int set_fd_var(const char* name, int len, const char* suffix, int fd)
+{
+	char* word;
+	int ret;
+
+	word = (char*) malloc(sizeof(char)*(len + strlen(suffix) + 16));
+	error(word == NULL, -1);
+	sprintf(word, "%.*s%s=%d", len, name, suffix, fd);
+	ret = fd < 0 ? (is_assignment(word) ? 0 : -1) : var_assign(word, 0);
+	free(word);
+	return ret;
+}
+
+/* COMMAND runs as a background job with its stdin and stdout on pipes the shell keeps open */
+/* as $NAME_W and $NAME_R, so later commands can talk to it with '>&$NAME_W' and '<&$NAME_R'. */
+/* Those descriptors are between 3 and 9, like the ones exec opens, and no other job gets */
+/* them unless asked to. 'exec $NAME_W>&-' lets the coprocess see the end of its input. */
+
+int run_coproc(const char* text, const SUBSTS* s)
+{
+	JOB* job;
+	JOB_REDIR* redir;
+	const char* name, *command;
+	int len, i, k, to[2], from[2];
+
+	name = text + strspn(text, SLSH_BLANK_CHARS) + strlen(SLSH_COPROC);
+	name += strspn(name, SLSH_BLANK_CHARS);
+	len = strcspn(name, SLSH_BLANK_CHARS);
+	command = name + len + strspn(name+len, SLSH_BLANK_CHARS);
+	if (len == 0 || *command == '\0')
+	{
+		printf("Usage: coproc NAME COMMAND\n");
+		return 1;
+	}
+	if (set_fd_var(name, len, "_R", -1) < 0)
+	{
+		printf("coproc: bad name '%.*s'.\n", len, name);
+		return 1;
+	}
+
+	job = create_job(command, s);
+	if (job == NULL)
+		return 1;
+	job->blocking = 0;
+	free(job->name);
+	job->name = job_name(text, s);
+	if (job->name == NULL)
+		return (destroy_job(&job), 1);
+
+	redir = (JOB_REDIR*) calloc(job->nredir+2, sizeof(JOB_REDIR));		/* The pipes go before the command's own */
+	error(redir == NULL, (destroy_job(&job), 1));						/* redirections. */
+	if (pipe(to) < 0)
+	{
+		free(redir);
+		destroy_job(&job);
+		error(1, 1);
+	}
+	if (pipe(from) < 0)
+	{
+		close(to[0]);
+		close(to[1]);
+		free(redir);
+		destroy_job(&job);
+		error(1, 1);
+	}
+	if (move_fd(&to[0], SLSH_FIRST_JOB_FD) < 0 || move_fd(&from[1], SLSH_FIRST_JOB_FD) < 0 ||
+		move_fd(&to[1], SLSH_COPROC_FIRST_FD) < 0 || move_fd(&from[0], SLSH_COPROC_FIRST_FD) < 0 ||
+		to[1] > SLSH_MAX_FD || from[0] > SLSH_MAX_FD)
+	{
+		if (to[1] > SLSH_MAX_FD || from[0] > SLSH_MAX_FD)
+			printf("coproc: no descriptors left below %d.\n", SLSH_MAX_FD+1);
+		close(to[0]);
+		close(to[1]);
+		close(from[0]);
+		close(from[1]);
+		free(redir);
+		destroy_job(&job);
+		return 1;
+	}
+
+	k = 0;
+	redir[k].cmd = 0;
+	redir[k].r.fd = 0;
+	redir[k].r.op = REDIR_DUP;
+	redir[k].r.target = to[0];
+	redir[k++].file = -1;
+	for (i = 0; i < job->nredir && job->redir[i].cmd < job->ncmd-1; i++)
+		redir[k++] = job->redir[i];
+	redir[k].cmd = job->ncmd-1;
+	redir[k].r.fd = 1;
+	redir[k].r.op = REDIR_DUP;
+	redir[k].r.target = from[1];
+	redir[k++].file = -1;
+	for (; i < job->nredir; i++)
+		redir[k++] = job->redir[i];
+	free(job->redir);
+	job->redir = redir;
+	job->nredir = k;
+
+	i = run_job(job);
+	close(to[0]);					/* Only the coprocess reads and writes these ends. */
+	close(from[1]);
+	if (i < 0)
+	{
+		close(to[1]);
+		close(from[0]);
+		destroy_job(&job);
+		return 1;
+	}
+	if (set_fd_var(name, len, "_R", from[0]) < 0 || set_fd_var(name, len, "_W", to[1]) < 0)
+	{
+		close(to[1]);				/* The coprocess sees its input end and goes away. */
+		close(from[0]);
+		return 1;
+	}
+	return 0;
+}
+
+pid_t run_cmd(char* cmd[], int input_file, int output_file, int error_file, JOB_REDIR* redir, int nredir, int** pipes, int npipes, pid_t pgid, const CGROUP* cgroup)
+{
+	pid_t cpid;
+
+	if (cmd == NULL)
+		return -1;
+	if (cmd[0] == NULL)
+		return 0;				/* All of its words expanded to nothing. */
+
+	if (get_builtin_cmd(cmd[0]) == CMD_EXEC)
+		return run_exec(cmd, redir, nredir);
+	if (get_builtin_cmd(cmd[0]))
+		return run_builtin_cmd(cmd);
+
+	fflush(stdout);			/* Or a child that fails to exec would write it again. */
+	cpid = fork();
+
+	error(cpid < 0, -1);
+	
+	if (cpid == 0)
+	{
+        fatal_error(setpgid(0, pgid) < 0, -1);	/* pgid == 0 -> new group with id equal to the current pid */
+		cgroup_enter(cgroup);					/* Before exec, so what it starts is counted too. */
+
+         signal (SIGINT, SIG_DFL);
+         signal (SIGQUIT, SIG_DFL);
+         signal (SIGTSTP, SIG_DFL);
+         signal (SIGTTIN, SIG_DFL);
+         signal (SIGTTOU, SIG_DFL);
+         signal (SIGCHLD, SIG_DFL);
+
+		if (input_file != 0)
+		{
+			close(0);
+			fatal_error(dup(input_file) < 0, -1);
+			close(input_file);
+		}
+		if (output_file != 1)
+		{
+			close(1);
+			fatal_error(dup(output_file) < 0, -1);
+			if (output_file != error_file)
+				close(output_file);
+		}
+		if (error_file != 2)
+			fatal_error(dup2(error_file, 2) < 0, -1);
+		destroy_pipes(&pipes, npipes);
+		if (apply_redirs(redir, nredir) < 0)
+			exit(EXIT_FAILURE);
+		execvp(cmd[0], cmd);
+		printf("%s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	setpgid(cpid, pgid == 0 ? cpid : pgid);	/* Also done here so that the group exists before the next command of */
+	return cpid;							/* the job is forked, whichever process runs first. */
+}
+
+/* Forks the process that copies the producer's output, pipes[ncmd-1], to every branch of a */
+/* fan-out job, pipes[ncmd+b]. */
+
+static pid_t run_fanout(JOB* job, int** pipes, int npipes)
+{
+	pid_t cpid;
+	int i, *out;
+
+	cpid = fork();
+	error(cpid < 0, -1);
+
+	if (cpid == 0)
+	{
+		fatal_error(setpgid(0, job->pgid) < 0, -1);
+		cgroup_enter(job->cgroup);
+
+		signal (SIGINT, SIG_DFL);
+		signal (SIGQUIT, SIG_DFL);
+		signal (SIGTSTP, SIG_DFL);
+		signal (SIGCHLD, SIG_DFL);
+
+		out = (int*) malloc(sizeof(int)*job->nfan);
+		fatal_error(out == NULL, -1);
+		for (i = 0; i < npipes; i++)		/* Only the ends it uses stay open, or the branches would never see EOF. */
+		{
+			if (i != job->ncmd-1)
+				close(pipes[i][0]);
+			if (i < job->ncmd)
+				close(pipes[i][1]);
+			else
+				out[i - job->ncmd] = pipes[i][1];
+		}
+		_exit(fanout(pipes[job->ncmd-1][0], out, job->nfan) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);	/* Not exit(): the shell's stdio buffers are not ours to flush. */
+	}
+	setpgid(cpid, job->pgid);
+	return cpid;
+}
+
+/* Which branch of a fan-out job cmd[i] belongs to, -1 for the producer (and for plain pipelines). */
+
+static int job_branch(const JOB* job, int i)
+{
+	int b = job->nfan-1;
+
+	while (b >= 0 && i < job->fanstart[b])
+		b--;
+	return b;
+}
+
+/* Returns the job's exit status, which is 0 for non-blocking jobs, or -1 if it could not be started. */
+
 int run_job(JOB* job)
 {
-	int i, **pipes = NULL;
+	int i, b, k = 0, nredir, npipes, policy, errorfd, **pipes = NULL;
+	unsigned long size;
+	sigset_t chld, saved;
 
 	if (job == NULL || job->cmd == NULL)
 		return -1;
 
-	if (job->ncmd > 1)
+	if (!job->blocking && (policy = capture_policy(var_get(SLSH_CAPTURE_VAR))) != CAPTURE_OFF)
+	{
+		size = var_get(SLSH_CAPTURE_SIZE_VAR) != NULL ? strtoul(var_get(SLSH_CAPTURE_SIZE_VAR), NULL, 10) : 0;
+		job->capture = capture_start(policy, size > 0 ? size : SLSH_CAPTURE_DEFAULT_SIZE);
+	}
+	errorfd = job->capture != NULL ? job->capture->writefd : 2;
+	cgroup_sweep();					/* Scripts never get back to the prompt. */
+	if (!job->blocking && var_get(SLSH_CGROUP_VAR) != NULL && var_get(SLSH_CGROUP_VAR)[0] != '\0')
+		job->cgroup = cgroup_create(var_get(SLSH_CGROUP_VAR), var_get(SLSH_CPU_MAX_VAR), var_get(SLSH_MEMORY_HIGH_VAR));
+
+	npipes = job->nfan > 0 ? job->ncmd + job->nfan : job->ncmd-1;	/* A fan-out job also has a pipe into and one out */
+	if (npipes > 0)													/* of run_fanout for each branch. */
 	{
-		pipes = create_pipes(job->ncmd-1);
+		pipes = create_pipes(npipes);
 		if (pipes == NULL)
 			return -1;
 	}
 
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &saved);		/* Until run_count counts every process. */
+
 	job->run_count = job->ncmd;
 	job_list_push(job);
 	job->pgid = 0;
 
 	for (i = 0; i < job->ncmd; i++)
 	{
-		int input, output;
+		int input, output, last;
 		
+		b = job_branch(job, i);
 		if (i == 0)
-		{
-			if (job->inputfd != -1)
-				input = job->inputfd;
-			else
-				input = 0;
-		}
+			input = 0;
+		else if (b >= 0 && i == job->fanstart[b])
+			input = pipes[job->ncmd + b][0];
 		else
 			input = pipes[i-1][0];
 
-		if (i == job->ncmd-1)
-		{
-			if (job->outputfd != -1)
-				output = job->outputfd;
-			else
-				output = 1;
-		}
+		last = i == job->ncmd-1 || (b+1 < job->nfan && i+1 == job->fanstart[b+1]);
+		if (last && b < 0 && job->nfan > 0)
+			output = pipes[job->ncmd-1][1];
+		else if (last)
+			output = errorfd == 2 ? 1 : errorfd;
 		else
 			output = pipes[i][1];
-		
-		job->pid[i] = run_cmd(job->cmd[i], input, output, pipes, job->ncmd-1, job->pgid);
+
+		for (nredir = 0; k+nredir < job->nredir && job->redir[k+nredir].cmd == i; nredir++)
+			;
+		job->pid[i] = run_cmd(job->cmd[i], input, output, errorfd, job->redir+k, nredir, pipes, npipes, job->pgid, job->cgroup);
+		k += nredir;
 		if (job->pid[i] <= 0)
+		{
 			job->run_count--;		/* Built-in commands and failed executions are not running processes */
+			job->status = job->pid[i] < 0;
+		}
 		else if (job->pgid == 0)
 		{
 			job->pgid = job->pid[i];		
 			job->lastmodified = time(NULL); /* A new job is a 'recently modified job' to fg/bg default */
 		}
 	}
+
+	if (job->nfan > 0 && job->pgid > 0)
+	{
+		job->fanpid = run_fanout(job, pipes, npipes);
+		if (job->fanpid > 0)
+			job->run_count++;
+	}
 	
-	destroy_pipes(&pipes, job->ncmd-1);
+	destroy_pipes(&pipes, npipes);
+	if (job->capture != NULL)
+	{
+		job->run_count++;
+		capture_close_writer(job->capture);		/* So the drainer sees the end when the job ends. */
+	}
+	sigprocmask(SIG_SETMASK, &saved, NULL);
 
 	if (job->blocking)
-		fg_wait(job);
+		return fg_wait(job);
 	
 	return 0;
 }
 
+/* An item made only of NAME=VALUE words sets shell variables instead of running anything. */
+/* Returns 1 if item was such an assignment, 0 if it is a job and -1 on error. With s the */
+/* values are expanded, and nothing they hold splits them. */
+
+int run_assignments(const char* item, const SUBSTS* s)
+{
+	char** words, *word;
+	int i, all = 1, ret;
+
+	words = split_words(item);
+	error(words == NULL, -1);
+
+	for (i = 0; words[i] != NULL && all; i++)
+		all = is_assignment(words[i]);
+	all = all && words[0] != NULL;
+
+	for (i = 0; all && words[i] != NULL; i++)
+	{
+		word = s != NULL ? expand_word(words[i], s) : words[i];
+		ret = word != NULL ? var_assign(word, 0) : -1;
+		if (word != words[i])
+			free(word);
+		error(ret < 0, (free(words[0]), (free(words), -1)));
+	}
+
+	free(words[0]);
+	free(words);
+	return all;
+}
+
+/* Runs a job and returns its status. */
+
+static int run_new_job(JOB* job)
+{
+	int status = run_job(job);
+
+	if (status < 0)
+	{
+		destroy_job(&job);
+		status = 1;
+	}
+	return status;
+}
+
+
+/* The output of a '$(...)' whose command is a built-in that writes nothing else, made without */
+/* a fork. NULL for everything else. */
+
+static char* builtin_output(const char* command)
+{
+	char** words, *ret = NULL;
+	PROGRAM* fprog;
+	int fpc;
+
+	if (strpbrk(command, SLSH_PIPE "<>&;" SLSH_GLOB_CHARS) != NULL || strchr(command, SLSH_VAR_SIGN) != NULL)
+		return NULL;
+	words = split_words(command);
+	if (words == NULL)
+		return NULL;
+	if (words[0] != NULL && words[1] == NULL && get_builtin_cmd(words[0]) == CMD_PWD &&
+		!find_function(words[0], &fprog, &fpc) && (cwd[0] != '\0' || update_cwd() == 0))
+	{
+		ret = (char*) malloc(sizeof(char)*(strlen(cwd)+1));
+		if (ret != NULL)
+			strcpy(ret, cwd);
+	}
+	free(words[0]);
+	free(words);
+	return ret;
+}
+
+char* expand_text(const char* text)
+{
+	return expand_subst(text, run_node, builtin_output);
+}
+
+/* An item with variables, ready to be parsed: its '$(...)' run and hidden in s, and the */
+/* descriptors of its redirections replaced by their numbers. The rest is left for each word. */
+/* The lines of its here-documents aren't parsed, so those are expanded as they are.         */
+
+static char* prepare_item(const char* text, SUBSTS* s)
+{
+	int len = strcspn(text, "\n");
+	char* head, *fds, *ret, *rest, *joined;
+
+	memset(s, 0, sizeof(SUBSTS));
+	head = (char*) malloc(sizeof(char)*(len+1));
+	error(head == NULL, NULL);
+	memcpy(head, text, len);
+	head[len] = '\0';
+	fds = expand_fd_vars(head);
+	free(head);
+	ret = fds != NULL ? hide_substs(fds, s, run_node, builtin_output) : NULL;
+	free(fds);
+	if (ret == NULL || text[len] == '\0')
+		return ret;
+
+	rest = expand_text(text+len);
+	joined = rest != NULL ? (char*) malloc(sizeof(char)*(strlen(ret)+strlen(rest)+1)) : NULL;
+	if (joined != NULL)
+	{
+		strcpy(joined, ret);
+		strcat(joined, rest);
+	}
+	else
+		free_substs(s);
+	free(ret);
+	free(rest);
+	return joined;
+}
+
+
+
+/* ------- PROGRAMS ------- */
+
+static void destroy_job_template(void* t)
+{
+	destroy_template((JOB_TEMPLATE*) t);
+}
+
+PROGRAM* compile_text(const char* text, int* status)
+{
+	PROGRAM* prog = compile(text, status);
+
+	if (prog != NULL)
+		prog->destroy_data = destroy_job_template;
+	return prog;
+}
+
+/* The instruction already knows whether it needs expanding or parsing; only RUN_TEXT items */
+/* are looked at again each time they run. */
+
+int run_item(INSTR* in)
+{
+	PROGRAM* fprog;
+	SUBSTS s;
+	char* text, **words = NULL;
+	int fpc, ret;
+
+	switch (in->kind)
+	{
+		case RUN_ASSIGN:
+			return run_assignments(in->text, NULL) < 0;
+
+		case RUN_BUILTIN:
+		case RUN_JOB:
+			if (in->argv != NULL && find_function(in->argv[0], &fprog, &fpc))
+				return call_function(fprog, fpc, in->argv);
+			if (is_coproc(in->text))
+				return run_coproc(in->text, NULL);
+			if (in->kind == RUN_BUILTIN && in->builtin == CMD_WAIT)
+				return wait_jobs(in->argv);
+			if (in->kind == RUN_BUILTIN)
+				return run_builtin_cmd(in->argv) < 0;
+			if (in->data == NULL)
+				in->data = make_template(in->text);		/* Owned by the program, not by the job cache. */
+			if (in->data == NULL)
+				return 1;
+			return run_new_job(job_from_template((JOB_TEMPLATE*) in->data, NULL));
+
+		default:
+			text = prepare_item(in->text, &s);
+			if (text == NULL)
+				return 1;
+			ret = run_assignments(text, &s);
+			if (ret != 0)
+				ret = ret < 0;
+			else if (is_coproc(text))
+				ret = run_coproc(text, &s);
+			else if (strpbrk(text, SLSH_PIPE "<>&") == NULL && (words = split_words(text)) != NULL &&
+					 (words = expand_words(words, &s)) != NULL && (words = glob_words(words)) != NULL &&
+					 words[0] != NULL && find_function(words[0], &fprog, &fpc))
+				ret = call_function(fprog, fpc, words);
+			else
+				ret = run_new_job(create_job(text, &s));
+			if (words != NULL)
+			{
+				free(words[0]);
+				free(words);
+			}
+			free_substs(&s);
+			free(text);
+			return ret;
+	}
+}
+
+/* Runs a function body with argv[1]... as $1... and the argument count as $#. */
+
+int call_function(PROGRAM* prog, int pc, char** argv)
+{
+	char* saved[SLSH_MAX_POSITIONAL+1], name[2], count[16];
+	const char* value;
+	int i, argc;
+
+	for (argc = 0; argv[argc+1] != NULL; argc++)
+		;
+
+	name[1] = '\0';
+	for (i = 0; i <= SLSH_MAX_POSITIONAL; i++)
+	{
+		name[0] = i == 0 ? '#' : '0' + i;
+		value = var_get(name);
+		saved[i] = NULL;
+		if (value != NULL)
+		{
+			saved[i] = (char*) malloc(sizeof(char)*(strlen(value)+1));
+			if (saved[i] != NULL)
+				strcpy(saved[i], value);
+		}
+		if (i == 0)
+		{
+			sprintf(count, "%d", argc);
+			var_set(name, count);
+		}
+		else if (i <= argc)
+			var_set(name, argv[i]);
+		else
+			var_unset(name);
+	}
+
+	prog->refs++;				/* The function may be redefined while it runs. */
+	run_program(prog, pc);
+	destroy_program(&prog);
+
+	for (i = 0; i <= SLSH_MAX_POSITIONAL; i++)
+	{
+		name[0] = i == 0 ? '#' : '0' + i;
+		if (saved[i] != NULL)
+			var_set(name, saved[i]);
+		else
+			var_unset(name);
+		free(saved[i]);
+	}
+	return last_status;
+}
+
+int run_program(PROGRAM* prog, int pc)
+{
+	LOOP* loops = NULL, *loop;
+	INSTR* in;
+	char* text;
+
+	while (pc >= 0 && pc < prog->n && !exit_flag)
+	{
+		in = &prog->v[pc];
+		switch (in->op)
+		{
+			case I_RUN:
+				if (!((in->cond == SLSH_AND && last_status != 0) || (in->cond == SLSH_OR && last_status == 0)))
+					last_status = run_item(in);
+				pc++;
+				break;
+
+			case I_JMP:
+				pc = in->target;
+				break;
+
+			case I_JFAIL:
+				pc = last_status != 0 ? in->target : pc+1;
+				break;
+
+			case I_FOR_INIT:
+				loop = (LOOP*) calloc(1, sizeof(LOOP));
+				text = expand_text(in->text);
+				if (loop != NULL && text != NULL)
+					loop->words = split_around_blank(text);
+				free(text);
+				if (loop == NULL || loop->words == NULL)
+				{
+					free(loop);
+					last_status = 1;
+					pc = prog->v[pc+1].target;		/* Skip the loop. */
+					break;
+				}
+				loop->outer = loops;
+				loops = loop;
+				pc++;
+				break;
+
+			case I_FOR_NEXT:
+				if (loops->words[loops->next] != NULL)
+				{
+					var_set(in->var, loops->words[loops->next++]);
+					pc++;
+					break;
+				}
+				loop = loops;
+				loops = loop->outer;
+				free(loop->words[0]);
+				free(loop->words);
+				free(loop);
+				pc = in->target;
+				break;
+
+			case I_FUNC:
+				define_function(in->text, prog, pc+1);
+				pc = in->target;
+				break;
+
+			case I_RET:
+				pc = -1;
+				break;
+		}
+	}
+
+	while (loops != NULL)		/* Left by 'exit' or the end of a function. */
+	{
+		loop = loops;
+		loops = loop->outer;
+		free(loop->words[0]);
+		free(loop->words);
+		free(loop);
+	}
+	return last_status;
+}
+
 /* ------- MANAGE RUNNING THINGS -------*/
 
-void fg_wait(JOB* job)
+static int exit_status(int status)
 {
-	int i;
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 0;
+}
+
+int fg_wait(JOB* job)
+{
+	int i, status, ret;
 
 	tcsetpgrp(STDIN_FILENO, job->pgid);
 	for (i = 0; i < job->ncmd && job->blocking; i++)
 	{
 		if (job->pid[i] > 0)
 		{
-			while (waitpid(job->pid[i], NULL, 0) < 0 && job->blocking)
+			while ((ret = waitpid(job->pid[i], &status, 0)) < 0 && job->blocking)
 			{
 				if (errno == ECHILD)	/* A suspended job stops being blocking (sigchld_handler sets job->blocking to 0) 			*/
 					break;          	/* The while loop is needed because if the child is killed then the wait will be canceled 	*/
 			}                       	/* (returning -1) by the call to sigchld_handler. It must be called again, otherwise zombie */
 			                        	/* processes would remain: sigchld_handler doesn't wait for blocking jobs 					*/
+			if (ret > 0 && i == job->ncmd-1)
+				job->status = exit_status(status);
 		}
 	}
+	while (job->fanpid > 0 && job->blocking && waitpid(job->fanpid, &status, 0) < 0 && errno != ECHILD)
+		;
+	if (job->capture != NULL && job->blocking)
+	{
+		while (waitpid(job->capture->pid, &status, 0) < 0 && errno != ECHILD)
+			;
+		capture_dump(job->capture, stdout);			/* Brought to the foreground, it's shown after all. */
+	}
 	tcsetpgrp(STDIN_FILENO, getpgid(0));
 	
+	ret = job->status;
 	if (job->blocking)		/* Blocking job has terminated */
 	{
 		job_list_erase(job);
 		destroy_job(&job);
 	}
+	else					/* Suspended */
+		ret = 0;
+	return ret;
+}
+
+/* Reaps pid if it has ended, and tells whether it had. Its exit status goes to status, */
+/* unless that is NULL. */
+
+static int reap(pid_t* pid, int* status)
+{
+	int st;
+
+	if (*pid <= 0 || waitpid(*pid, &st, WNOHANG) <= 0)
+		return 0;
+	*pid = 0;
+	if (status != NULL)
+		*status = exit_status(st);
+	return 1;
+}
+
+/* Reaps whatever background processes have ended. Finished jobs leave the list, except */
+/* captured ones, whose output is still to be read, and those with a cgroup, which is read */
+/* and removed outside the handler. */
+
+static void reap_jobs()
+{
+	JOB_LIST* list = job_list(JL_GET);
+	JOB* job;
+	int idx, i;
+
+	for (idx = 0; list != NULL && idx <= list->last; idx++)
+	{
+		job = list->v[idx];
+		if (job == NULL || job->blocking || job->done)
+			continue;
+		for (i = 0; i < job->ncmd; i++)
+			job->run_count -= reap(&job->pid[i], i == job->ncmd-1 ? &job->status : NULL);
+		job->run_count -= reap(&job->fanpid, NULL);
+		if (job->capture != NULL)
+			job->run_count -= reap(&job->capture->pid, NULL);
+
+		if (job->run_count == 0 && (job->capture != NULL || job->cgroup != NULL))
+			job->done = 1;
+		else if (job->run_count == 0)
+		{
+			list->ended[idx] = job->status;
+			job_list_erase(job);
+			destroy_job(&job);
+		}
+	}
 }
 
 void sigchld_handler(int sig, siginfo_t* info, void* u)
@@ -555,46 +1924,275 @@ void sigchld_handler(int sig, siginfo_t* info, void* u)
 	JOB* job;
 
 	job = job_list_find_by_pid(info->si_pid);
-	if (job == NULL)	
+	if (job != NULL && info->si_code == CLD_STOPPED)
+	{
+		job->blocking = 0;
 		return;
+	}
+	reap_jobs();			/* SIGCHLDs that arrive together count as one, so every background process is looked at. */
+}
+
+/* Tells whether the job that was in slot id when 'wait' started has finished, and takes */
+/* its status. */
 
-	switch(info->si_code)
+static int job_finished(JOB_LIST* list, int id, const JOB* job, int* status)
+{
+	if (list->v[id] == job && job != NULL && !job->done)
+		return 0;
+	if (list->v[id] == job && job != NULL)
+		*status = job->status;
+	else
 	{
-		case CLD_KILLED:
-		case CLD_EXITED:
-			if (!job->blocking)	
+		*status = list->ended[id] >= 0 ? list->ended[id] : 127;
+		list->ended[id] = -1;
+	}
+	return 1;
+}
+
+int wait_jobs(char* cmd[])
+{
+	JOB_LIST* list = job_list(JL_GET);
+	JOB** jobs;
+	int* ids, n = 0, np, any, i, j, k, status, last = 0, ret = -1;
+	pid_t* pids = NULL;
+	sigset_t chld, saved;
+
+	any = cmd[1] != NULL && !strcmp(cmd[1], "-n");
+	for (i = 1+any; cmd[i] != NULL; i++)
+		n++;
+	if (n == 0)
+		n = list->capacity;
+	ids = (int*) malloc(sizeof(int)*n);
+	jobs = (JOB**) malloc(sizeof(JOB*)*n);
+	if (ids == NULL || jobs == NULL)
+	{
+		free(ids);
+		free(jobs);
+		error(1, -1);
+	}
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &saved);
+
+	/* The jobs to wait for, and what occupied their slots at the start. */
+	k = 0;
+	if (cmd[1+any] != NULL)
+	{
+		for (i = 1+any; cmd[i] != NULL; i++)
+		{
+			j = atoi(cmd[i]);
+			if (j < 0 || j >= list->capacity || (list->v[j] == NULL && list->ended[j] < 0))
 			{
-				waitpid(info->si_pid, NULL, 0);
-				if (--job->run_count == 0)
+				printf("No such job: %s.\n", cmd[i]);
+				continue;
+			}
+			ids[k] = j;
+			jobs[k++] = list->v[j];
+		}
+		if (k == 0)
+			ret = 127;
+	}
+	else
+	{
+		for (j = 0; j < list->capacity; j++)
+		{
+			if (list->v[j] != NULL && !list->v[j]->blocking && !list->v[j]->done)
+			{
+				ids[k] = j;
+				jobs[k++] = list->v[j];
+			}
+			else if (list->v[j] == NULL && list->ended[j] >= 0)
+			{
+				if (any)
 				{
-					job_list_erase(job);
-					destroy_job(&job);
+					ids[k] = j;			/* 'wait -n' reports jobs that ended unnoticed first. */
+					jobs[k++] = NULL;
 				}
-				
+				else
+					list->ended[j] = -1;
 			}
-			break;
+		}
+		if (k == 0)
+			ret = any ? 127 : 0;
+	}
 
-		case CLD_STOPPED:
-			job->blocking = 0;		
+	while (ret < 0)
+	{
+		reap_jobs();
+		np = 0;
+		for (i = 0; i < k && ret < 0; i++)
+		{
+			if (jobs[i] == NULL && ids[i] < 0)			/* Already counted. */
+				continue;
+			if (job_finished(list, ids[i], jobs[i], &status))
+			{
+				jobs[i] = NULL;
+				ids[i] = -1;
+				if (any)
+					ret = status;
+				if (i == k-1)
+					last = status;
+				continue;
+			}
+			np += jobs[i]->ncmd + 2;
+		}
+		if (ret >= 0)
 			break;
+		if (np == 0)
+		{
+			ret = cmd[1+any] != NULL ? last : 0;		/* 'wait ID...' gives the last one's status. */
+			break;
+		}
 
-		default:
+		free(pids);
+		pids = (pid_t*) malloc(sizeof(pid_t)*np);
+		if (pids == NULL)
+			break;
+		np = 0;
+		for (i = 0; i < k; i++)
+		{
+			if (jobs[i] == NULL)
+				continue;
+			for (j = 0; j < jobs[i]->ncmd; j++)
+				pids[np++] = jobs[i]->pid[j];
+			pids[np++] = jobs[i]->fanpid;
+			pids[np++] = jobs[i]->capture != NULL ? jobs[i]->capture->pid : 0;
+		}
+		if (wait_pids(pids, np, &saved) < 0)		/* SIGCHLD is only let in while asleep. */
 			break;
 	}
+
+	sigprocmask(SIG_SETMASK, &saved, NULL);
+	free(pids);
+	free(ids);
+	free(jobs);
+	error(ret < 0, -1);
+	return ret;
 }
 
 
 /* MAIN PROGRAM */
 
+/* Runs one node of a parallel script or a command substitution, in its own process. */
+
+int run_node(const char* command)
+{
+	PROGRAM* prog;
+	int status;
+
+	prog = compile_text(command, &status);
+	if (prog == NULL)
+		return 2;
+	run_program(prog, 0);
+	destroy_program(&prog);
+	return last_status;
+}
+
+/* Appends line to *text (*len characters long, *cap allocated), separated by a newline. */
+
+int append_line(char** text, int* len, int* cap, const char* line)
+{
+	int linelen = strlen(line);
+
+	if (*text == NULL)
+		*len = *cap = 0;
+	if (*len + linelen + 2 > *cap)
+	{
+		int newcap = *cap > 0 ? *cap : INITIAL_SCRIPT_CAP;
+		char* newtext;
+
+		while (*len + linelen + 2 > newcap)
+			newcap *= 2;
+		newtext = (char*) realloc(*text, sizeof(char)*newcap);
+		error(newtext == NULL, -1);
+		*text = newtext;
+		*cap = newcap;
+	}
+	if (*len > 0)
+		(*text)[(*len)++] = '\n';
+	memcpy(*text + *len, line, linelen+1);
+	*len += linelen;
+	return 0;
+}
+
+/* Reads all of stdin at once into the text read_line and append_line would make of it: the */
+/* non-empty lines, separated by newlines. With blank set the empty lines stay, so that each */
+/* line keeps its number. Returns NULL, with *len 0 if there are none and -1 on errors.      */
+
+char* read_script(int* len, int blank)
+{
+	int cap = INITIAL_SCRIPT_CAP, n = 0, r;
+	char* text = (char*) malloc(sizeof(char)*cap), *newtext, *line, *eol, *end, *out;
+
+	*len = -1;
+	error(text == NULL, NULL);
+	while ((r = read(STDIN_FILENO, text + n, cap - n - 1)) != 0)
+	{
+		if (r < 0 && errno == EINTR)
+			continue;
+		error(r < 0, (free(text), NULL));
+		n += r;
+		if (n == cap - 1)
+		{
+			newtext = (char*) realloc(text, sizeof(char)*2*cap);
+			error(newtext == NULL, (free(text), NULL));
+			text = newtext;
+			cap *= 2;
+		}
+	}
+
+	end = text + n;
+	out = text;
+	for (line = text; line < end; line = eol+1)
+	{
+		eol = (char*) memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		if (eol == line && !blank)
+			continue;
+		if (out != text || (blank && line != text))
+			*out++ = '\n';
+		memmove(out, line, eol - line);
+		out += eol - line;
+	}
+	*out = '\0';
+	*len = out - text;
+	if (*len == 0)
+	{
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+int open_history()
+{
+	const char* path = var_get(SLSH_HISTFILE_VAR), *home = var_get("HOME");
+	char* buf;
+	int ret;
+
+	if (path != NULL)
+		return path[0] != '\0' ? history_open(path) : 0;		/* HISTFILE= turns it off. */
+	if (home == NULL)
+		return 0;
+	buf = (char*) malloc(strlen(home) + strlen(SLSH_HISTFILE_DEFAULT) + 2);
+	error(buf == NULL, -1);
+	sprintf(buf, "%s/%s", home, SLSH_HISTFILE_DEFAULT);
+	ret = history_open(buf);
+	free(buf);
+	return ret;
+}
+
 int main(int argc, char* argv[])
 {
-	char* str, dir[SLSH_MAX_PATH];
-	char opt_ver[] = "version", opt_comm[] = "command";
+	char* str, *text = NULL;
+	PROGRAM* prog = NULL;
+	char opt_ver[] = "version", opt_comm[] = "command", opt_par[] = "parallel-script";
 	char shortopts[] = "c:";
-	JOB* job = NULL;
 	struct sigaction chld;
-	struct option longopts[3];
-	int opt, is_script = 0;
+	struct option longopts[4];
+	int opt, is_script = 0, status, textlen = 0, textcap = 0, eof;
 	char doc[] = "SoloSH 1.0 (beta)\nCopyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>\n"
 	   			 "This program comes WITHOUT ANY WARRANTY, without even the implied\n"
 			     "warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n"
@@ -613,9 +2211,15 @@ int main(int argc, char* argv[])
 	longopts[1].flag = NULL;
 	longopts[1].val = 'c';
 
-	memset(longopts+2, 0, sizeof(struct option)); 
+	longopts[2].name = opt_par;
+	longopts[2].has_arg = required_argument;
+	longopts[2].flag = NULL;
+	longopts[2].val = 2;
+
+	memset(longopts+3, 0, sizeof(struct option)); 
 	
 	setpgid(0, 0);
+	fatal_error(vars_init() < 0, -1);
 
 	memset(&chld, 0, sizeof(struct sigaction));
 	chld.sa_flags |= SA_SIGINFO;
@@ -631,10 +2235,22 @@ int main(int argc, char* argv[])
 	opt = getopt_long(argc, argv, shortopts, longopts, NULL);
 	if (opt == 'c')
 	{
-		job = create_job(optarg);
-		run_job(job);
+		prog = compile_text(optarg, &status);
+		if (prog != NULL)
+			run_program(prog, 0);
+		else
+		{
+			if (status == SLSH_COMPILE_INCOMPLETE)
+				printf("Syntax error: unexpected end of input.\n");
+			last_status = 2;
+		}
+		destroy_program(&prog);
+		destroy_functions();
 		job_list(JL_DESTROY);
-		return 0;
+		vars_destroy();
+		glob_cache_clear();
+		job_cache_destroy();
+		return last_status;
 	}
 	if (opt == '?')
 		return -1;
@@ -645,6 +2261,12 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
+	if (opt == 2)
+	{
+		argv[1] = optarg;		/* Read like a script, but run by run_parallel_script. */
+		argc = 2;
+	}
+
 	if (argc > 2)
 	{
 		printf("Too many arguments.\n");
@@ -662,37 +2284,72 @@ int main(int argc, char* argv[])
 
 	if (!is_script)
 		printf("%s", doc);
-	
-	while (!exit_flag)
+	else
 	{
-		if (!is_script)
+		/* The whole script is compiled once, before anything runs, so that a syntax error */
+		/* anywhere in it stops all of it (see lex_script). */
+		text = read_script(&textlen, opt == 2);		/* Parallel scripts report line numbers. */
+		fatal_error(text == NULL && textlen < 0, -1);
+		prog = text != NULL && opt != 2 ? compile_text(text, &status) : NULL;
+		if (prog != NULL)
+			run_program(prog, 0);
+		else if (text != NULL && opt == 2)
+			last_status = run_parallel_script(text, run_node);
+		else if (text != NULL)
 		{
-			char *raux = getcwd(dir, SLSH_MAX_PATH*sizeof(char));
-            fatal_error (raux == NULL, -1);
-			printf("@ %s: ", dir);
+			if (status == SLSH_COMPILE_INCOMPLETE)
+				printf("Syntax error: unexpected end of input.\n");
+			last_status = 2;
 		}
+		destroy_program(&prog);
+		free(text);
+		exit_flag = 1;
+	}
 
-		while (str = read_line(), str == NULL)
+	if (!exit_flag && isatty(STDIN_FILENO))
+		open_history();
+	if (!exit_flag)
+		fatal_error(update_cwd() < 0, -1);
+	
+	while (!exit_flag)
+	{
+		cgroup_sweep();
+		status = SLSH_COMPILE_INCOMPLETE;
+		while (status == SLSH_COMPILE_INCOMPLETE && !exit_flag)
 		{
-			if (feof(stdin))
+			/* A construct that isn't finished yet keeps reading with "> ". */
+			while (str = edit_line(text == NULL ? prompt : "> ", complete, history_search, &eof), str == NULL)
 			{
-				exit_flag = 1;
-				printf("\n");
-				break;
+				if (eof)
+				{
+					exit_flag = 1;
+					printf("\n");
+					break;
+				}
 			}
-			else if (!is_script)
-				printf("@ %s: ", dir);
-		}
-		
-		if (!exit_flag)
-		{
-			job = create_job(str);
-			run_job(job);
+			if (exit_flag)
+				break;
+
+			fatal_error(append_line(&text, &textlen, &textcap, str) < 0, -1);
+			free(str);
+			prog = compile_text(text, &status);
 		}
-		free(str);
-		str = NULL;
+		if (text != NULL && status != SLSH_COMPILE_INCOMPLETE)
+			history_add(text);
+
+		if (prog != NULL && !exit_flag)
+			run_program(prog, 0);
+		destroy_program(&prog);
+		free(text);
+		text = NULL;
 	}
 
+	destroy_functions();
 	job_list(JL_DESTROY);
-	return 0;
+	vars_destroy();
+	glob_cache_clear();
+	complete_index_clear();
+	history_close();
+	job_cache_destroy();
+	return is_script ? last_status : 0;
 }
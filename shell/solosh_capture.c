@@ -0,0 +1,264 @@
+/*   solosh_capture.c - background job output capture
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE				/* memfd_create() and syscall() */
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <signal.h>
+#include <solosh_capture.h>
+#include <solosh_errors.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The memfd holds this header followed by the data. Only the drainer changes written and writing, */
+/* and only the shell changes read, so neither needs a lock. */
+
+typedef struct capture_ring
+{
+	volatile unsigned long written;		/* Bytes put in since the job started. */
+	volatile unsigned long writing;		/* Up to where the read in progress may put them. */
+	volatile unsigned long read;		/* Bytes taken out by capture_dump. */
+	volatile int read_seq;				/* Futex the drainer sleeps on while the ring is full. */
+	volatile int write_seq;				/* Futex 'jobs -o -f' sleeps on while the ring is empty. */
+	volatile int closed;				/* The shell has let go of the job. */
+	int policy;
+	unsigned long size;
+	unsigned long mapped;
+}RING;
+
+#define RING_DATA(ring) ((char*) (ring) + sizeof(RING))
+
+int capture_policy(const char* value)
+{
+	if (value == NULL)
+		return CAPTURE_OFF;
+	if (!strcmp(value, "drop"))
+		return CAPTURE_DROP;
+	if (!strcmp(value, "block"))
+		return CAPTURE_BLOCK;
+	return CAPTURE_OFF;
+}
+
+static void drain(RING* ring, int in, pid_t shell)
+{
+	struct timespec timeout = {0, 100000000};
+	struct pollfd pfd;
+	unsigned long off, space, used;
+	ssize_t n;
+	int seq, avail;
+
+	pfd.fd = in;
+	pfd.events = POLLIN;
+
+	for (;;)
+	{
+		off = ring->written % ring->size;
+		space = ring->size - off;
+		if (ring->policy == CAPTURE_BLOCK)
+		{
+			seq = ring->read_seq;
+			__sync_synchronize();
+			used = ring->written - ring->read;
+			if (used == ring->size)
+			{
+				if (ring->closed || getppid() != shell)		/* Nobody will read it any more. */
+					return;
+				syscall(SYS_futex, &ring->read_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+				continue;
+			}
+			if (space > ring->size - used)
+				space = ring->size - used;
+		}
+		else
+		{
+			/* Only ask for what the pipe already has, so writing doesn't claim more of the */
+			/* ring than this read can overwrite while the drainer sits waiting for the job. */
+			if (poll(&pfd, 1, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			if (ioctl(in, FIONREAD, &avail) == 0 && (unsigned long) avail < space)		/* 0 at the end. */
+				space = avail;
+		}
+
+		ring->writing = ring->written + space;
+		__sync_synchronize();			/* Before the read starts overwriting. */
+		n = read(in, RING_DATA(ring) + off, space);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		__sync_synchronize();			/* The data before the count that publishes it. */
+		ring->written += n;
+		ring->write_seq++;
+		syscall(SYS_futex, &ring->write_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+}
+
+CAPTURE* capture_start(int policy, unsigned long size)
+{
+	CAPTURE* c;
+	pid_t shell = getpid();
+	int memfd, fds[2];
+	unsigned long mapped = sizeof(RING) + size;
+
+	c = (CAPTURE*) calloc(1, sizeof(CAPTURE));
+	error(c == NULL, NULL);
+	c->writefd = -1;
+
+	memfd = memfd_create("solosh-capture", MFD_CLOEXEC);
+	error(memfd < 0, (free(c), NULL));
+	if (ftruncate(memfd, mapped) < 0)
+	{
+		close(memfd);
+		free(c);
+		error(1, NULL);
+	}
+	c->ring = (RING*) mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	close(memfd);					/* The mapping keeps it. */
+	if (c->ring == MAP_FAILED)
+	{
+		free(c);
+		error(1, NULL);
+	}
+	c->ring->policy = policy;
+	c->ring->size = size;
+	c->ring->mapped = mapped;
+
+	if (pipe(fds) < 0)
+	{
+		capture_destroy(&c);
+		error(1, NULL);
+	}
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);		/* Only the job's dup2'd copies outlive an exec. */
+	c->writefd = fds[1];
+
+	fflush(stdout);
+	c->pid = fork();
+	if (c->pid == 0)
+	{
+		setpgid(0, 0);						/* Away from the terminal's signals. */
+		close(fds[1]);
+		close(STDIN_FILENO);				/* Don't hold the shell's own pipes open. */
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+		drain(c->ring, fds[0], shell);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[0]);
+	if (c->pid < 0)
+	{
+		capture_destroy(&c);
+		error(1, NULL);
+	}
+	return c;
+}
+
+void capture_close_writer(CAPTURE* c)
+{
+	if (c->writefd >= 0)
+		close(c->writefd);
+	c->writefd = -1;
+}
+
+int capture_dump(CAPTURE* c, FILE* out)
+{
+	RING* ring = c->ring;
+	unsigned long start, end, first, n, now, lost = 0;
+	char* buf;
+
+	end = ring->written;
+	__sync_synchronize();
+	start = ring->read;
+	if (end - start > ring->size)
+	{
+		lost = end - ring->size - start;
+		start = end - ring->size;
+	}
+	n = end - start;
+	if (n == 0)
+		return 0;
+
+	buf = (char*) malloc(n);
+	error(buf == NULL, -1);
+	first = ring->size - start % ring->size;
+	if (first > n)
+		first = n;
+	memcpy(buf, RING_DATA(ring) + start % ring->size, first);
+	memcpy(buf + first, RING_DATA(ring), n - first);
+
+	__sync_synchronize();
+	now = ring->writing;				/* Counts a read that is still going on too. */
+	if (now > ring->size && now - ring->size > start)		/* The drainer went around while we copied. */
+	{
+		first = now - ring->size - start;
+		if (first > n)
+			first = n;
+		lost += first;
+		memmove(buf, buf + first, n - first);
+		n -= first;
+	}
+
+	if (lost > 0)
+		fprintf(out, "[%lu bytes dropped]\n", lost);
+	fwrite(buf, 1, n, out);
+	fflush(out);
+	free(buf);
+
+	ring->read = end;
+	__sync_synchronize();
+	ring->read_seq++;
+	syscall(SYS_futex, &ring->read_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+	return (int) n;
+}
+
+void capture_wait(CAPTURE* c, long nsec)
+{
+	struct timespec timeout;
+	int seq = c->ring->write_seq;
+
+	timeout.tv_sec = nsec / 1000000000;
+	timeout.tv_nsec = nsec % 1000000000;
+	__sync_synchronize();
+	if (c->ring->written == c->ring->read)
+		syscall(SYS_futex, &c->ring->write_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+}
+
+void capture_destroy(CAPTURE** c)
+{
+	if (c == NULL || *c == NULL)
+		return;
+	capture_close_writer(*c);
+	if ((*c)->ring != NULL && (*c)->ring != MAP_FAILED)
+	{
+		(*c)->ring->closed = 1;
+		syscall(SYS_futex, &(*c)->ring->read_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+		munmap((*c)->ring, (*c)->ring->mapped);
+	}
+	free(*c);
+	*c = NULL;
+}
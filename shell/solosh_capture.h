@@ -0,0 +1,56 @@
+/*   solosh_capture.h - background job output capture header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_CAPTURE_H
+#define SOLOSH_CAPTURE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define SLSH_CAPTURE_VAR "BG_CAPTURE"				/* "drop" or "block" captures the output of '&' jobs. */
+#define SLSH_CAPTURE_SIZE_VAR "BG_CAPTURE_SIZE"		/* Bytes kept per job. */
+#define SLSH_CAPTURE_DEFAULT_SIZE 65536
+
+enum
+{
+	CAPTURE_OFF = 0,
+	CAPTURE_DROP,			/* A full buffer loses its oldest bytes, the job never waits. */
+	CAPTURE_BLOCK			/* A full buffer stops the job until 'jobs -o' reads it. */
+};
+
+struct capture_ring;
+
+/* The job writes to a pipe, and a drainer process moves what comes out of it into a ring */
+/* buffer in a memfd that the shell has mapped too. */
+
+typedef struct capture
+{
+	struct capture_ring* ring;
+	int writefd;			/* For the job's stdout and stderr, until capture_close_writer. */
+	pid_t pid;				/* The drainer, which exits once every writer is gone. */
+}CAPTURE;
+
+int capture_policy(const char* value);
+CAPTURE* capture_start(int policy, unsigned long size);
+void capture_close_writer(CAPTURE* c);
+int capture_dump(CAPTURE* c, FILE* out);		/* Writes what hasn't been read yet. Returns how many bytes. */
+void capture_wait(CAPTURE* c, long nsec);		/* Until there is something to read, or nsec pass. */
+void capture_destroy(CAPTURE** c);				/* Doesn't wait for the drainer. */
+
+#endif
@@ -0,0 +1,259 @@
+/*   solosh_cgroup.c - per-job cgroups
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <solosh_cgroup.h>
+#include <solosh_errors.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#define CGROUP_PERIOD 100000				/* cpu.max period, in microseconds. */
+#define CGROUP_VALUE_SIZE 64
+
+enum
+{
+	WARN_PARENT = 1,
+	WARN_CPU = 2,
+	WARN_MEMORY = 4
+};
+
+static int warned = 0;			/* Each problem is told once, not for every job. */
+static unsigned long created = 0;
+static char** busy = NULL;		/* Groups something outlived its job in, to be removed later. */
+static int nbusy = 0, capbusy = 0;
+
+static void warn(int what, const char* path, const char* why)
+{
+	if (warned & what)
+		return;
+	warned |= what;
+	printf("cgroup: %s: %s. Jobs run without %s.\n", path, why,
+		   what == WARN_PARENT ? "a group" : what == WARN_CPU ? "a CPU limit" : "a memory limit");
+}
+
+static char* join(const char* dir, const char* name)
+{
+	char* path = (char*) malloc(strlen(dir) + strlen(name) + 2);
+
+	error(path == NULL, NULL);
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static int write_file(const char* dir, const char* name, const char* value)
+{
+	char* path = join(dir, name);
+	int fd, ret = -1, len = strlen(value);
+
+	if (path == NULL)
+		return -1;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	free(path);
+	if (fd >= 0)
+	{
+		ret = write(fd, value, len) == len ? 0 : -1;
+		close(fd);
+	}
+	return ret;
+}
+
+static int read_file(const char* dir, const char* name, char* buf, int size)
+{
+	char* path = join(dir, name);
+	int fd, n = -1;
+
+	if (path == NULL)
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd >= 0)
+	{
+		n = read(fd, buf, size-1);
+		close(fd);
+	}
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+/* "50" is half a CPU and "200" two of them. */
+
+static int cpu_max_value(const char* percent, char* value)
+{
+	char* end;
+	long p;
+
+	if (!strcmp(percent, "max"))
+	{
+		sprintf(value, "max %d", CGROUP_PERIOD);
+		return 0;
+	}
+	p = strtol(percent, &end, 10);
+	if (end == percent || *end != '\0' || p <= 0 || p > 100000)
+		return -1;
+	sprintf(value, "%ld %d", p * (CGROUP_PERIOD / 100), CGROUP_PERIOD);
+	return 0;
+}
+
+/* Sets a limit, turning on its controller for the groups under parent first. */
+
+static void limit(CGROUP* g, const char* parent, const char* controller, const char* file, const char* value, int what)
+{
+	char enable[CGROUP_VALUE_SIZE];
+
+	sprintf(enable, "+%s", controller);
+	write_file(parent, "cgroup.subtree_control", enable);		/* Fails harmlessly if it already is on. */
+	if (write_file(g->path, file, value) < 0)
+		warn(what, parent, errno == ENOENT ? "controller not delegated" : strerror(errno));
+}
+
+CGROUP* cgroup_create(const char* parent, const char* cpu_max, const char* memory_high)
+{
+	struct statfs fs;
+	char name[CGROUP_VALUE_SIZE], value[CGROUP_VALUE_SIZE];
+	CGROUP* g;
+	char* procs;
+
+	if (statfs(parent, &fs) < 0)
+	{
+		warn(WARN_PARENT, parent, strerror(errno));
+		return NULL;
+	}
+	if (fs.f_type != CGROUP2_SUPER_MAGIC)
+	{
+		warn(WARN_PARENT, parent, "not a cgroup v2 directory");
+		return NULL;
+	}
+
+	g = (CGROUP*) calloc(1, sizeof(CGROUP));
+	error(g == NULL, NULL);
+	g->procs = -1;
+	sprintf(name, "solosh.%ld.%lu", (long) getpid(), created++);
+	g->path = join(parent, name);
+	if (g->path == NULL || mkdir(g->path, 0755) < 0)
+	{
+		if (g->path != NULL)
+			warn(WARN_PARENT, parent, strerror(errno));
+		free(g->path);
+		free(g);
+		return NULL;
+	}
+	procs = join(g->path, "cgroup.procs");
+	g->procs = procs != NULL ? open(procs, O_WRONLY | O_CLOEXEC) : -1;
+	free(procs);
+	if (g->procs < 0)
+	{
+		warn(WARN_PARENT, parent, strerror(errno));
+		cgroup_destroy(&g);
+		return NULL;
+	}
+
+	if (cpu_max != NULL && cpu_max_value(cpu_max, value) < 0)
+		warn(WARN_CPU, SLSH_CPU_MAX_VAR, "not a percentage");
+	else if (cpu_max != NULL)
+		limit(g, parent, "cpu", "cpu.max", value, WARN_CPU);
+	if (memory_high != NULL)
+		limit(g, parent, "memory", "memory.high", memory_high, WARN_MEMORY);
+	return g;
+}
+
+void cgroup_enter(const CGROUP* g)
+{
+	if (g != NULL)
+		while (write(g->procs, "0", 1) < 0 && errno == EINTR)		/* "0" is whoever writes it. */
+			;
+}
+
+int cgroup_usage(const CGROUP* g, CGROUP_USAGE* u)
+{
+	char buf[512], *s;
+
+	u->usec = u->user_usec = u->system_usec = u->peak = -1;
+	if (g == NULL)
+		return -1;
+	if (read_file(g->path, "cpu.stat", buf, sizeof(buf)) > 0)
+	{
+		for (s = buf; s != NULL && *s != '\0'; s = strchr(s, '\n'), s = s != NULL ? s+1 : NULL)
+		{
+			if (!strncmp(s, "usage_usec ", 11))
+				u->usec = atol(s+11);
+			else if (!strncmp(s, "user_usec ", 10))
+				u->user_usec = atol(s+10);
+			else if (!strncmp(s, "system_usec ", 12))
+				u->system_usec = atol(s+12);
+		}
+	}
+	if (read_file(g->path, "memory.peak", buf, sizeof(buf)) > 0)
+		u->peak = atol(buf);
+	return 0;
+}
+
+static int keep_busy(char* path)
+{
+	char** newbusy;
+
+	if (nbusy == capbusy)
+	{
+		newbusy = (char**) realloc(busy, sizeof(char*)*(capbusy > 0 ? 2*capbusy : 4));
+		error(newbusy == NULL, -1);
+		busy = newbusy;
+		capbusy = capbusy > 0 ? 2*capbusy : 4;
+	}
+	busy[nbusy++] = path;
+	return 0;
+}
+
+void cgroup_destroy(CGROUP** g)
+{
+	if (g == NULL || *g == NULL)
+		return;
+	if ((*g)->procs >= 0)
+		close((*g)->procs);
+	if ((*g)->path != NULL && rmdir((*g)->path) < 0 && errno == EBUSY && keep_busy((*g)->path) == 0)
+		(*g)->path = NULL;
+	free((*g)->path);
+	free(*g);
+	*g = NULL;
+}
+
+int cgroup_sweep()
+{
+	int i, n = 0;
+
+	for (i = 0; i < nbusy; i++)
+	{
+		if (rmdir(busy[i]) < 0 && errno == EBUSY)
+			busy[n++] = busy[i];
+		else
+			free(busy[i]);
+	}
+	nbusy = n;
+	if (nbusy == 0)
+	{
+		free(busy);
+		busy = NULL;
+		capbusy = 0;
+	}
+	return nbusy;
+}
@@ -0,0 +1,52 @@
+/*   solosh_cgroup.h - per-job cgroups header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_CGROUP_H
+#define SOLOSH_CGROUP_H
+
+#define SLSH_CGROUP_VAR "JOB_CGROUP"				/* A cgroup v2 directory '&' jobs get a group of their own in. */
+#define SLSH_CPU_MAX_VAR "JOB_CPU_MAX"				/* Percent of one CPU each of them may use, or "max". */
+#define SLSH_MEMORY_HIGH_VAR "JOB_MEMORY_HIGH"		/* Their memory.high: bytes, with K, M or G, or "max". */
+
+/* Each group is made when the job starts and removed when the job leaves the list, which an    */
+/* ended job only does after 'jobs' has shown it, so its counters can still be read. Every      */
+/* process of the job moves itself into it between fork and exec, so whatever they start is in  */
+/* it too, and the group's own counters see all of it. Without a cgroup v2 directory that can   */
+/* be written to, or without the controllers for a limit, jobs run as before, after a warning.  */
+
+typedef struct cgroup
+{
+	char* path;
+	int procs;				/* Its cgroup.procs, open across fork for the job's processes. */
+}CGROUP;
+
+typedef struct cgroup_usage
+{
+	long usec, user_usec, system_usec;		/* From cpu.stat, or -1. */
+	long peak;								/* memory.peak in bytes, or -1. */
+}CGROUP_USAGE;
+
+CGROUP* cgroup_create(const char* parent, const char* cpu_max, const char* memory_high);
+void cgroup_enter(const CGROUP* g);						/* In the child, before exec. */
+int cgroup_usage(const CGROUP* g, CGROUP_USAGE* u);
+void cgroup_destroy(CGROUP** g);						/* Not in a signal handler. A group something in it */
+int cgroup_sweep();										/* outlived the job in is left for cgroup_sweep to */
+														/* try again. Returns how many are still there. */
+
+#endif
@@ -0,0 +1,710 @@
+/*   solosh_compile.c - script compiler
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <solosh_compile.h>
+#include <solosh_errors.h>
+#include <solosh_glob.h>
+#include <solosh_parallel.h>
+#include <solosh_parser.h>
+#include <solosh_vars.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_TOKEN_CAP 32
+#define INITIAL_PROGRAM_CAP 32
+#define LEX_CHUNK_MIN (1 << 18)			/* Scripts are lexed in chunks of at least this many bytes, */
+										/* one per CPU. */
+
+enum
+{
+	T_ITEM = 0,
+	T_IF,
+	T_THEN,
+	T_ELIF,
+	T_ELSE,
+	T_FI,
+	T_WHILE,
+	T_DO,
+	T_DONE,
+	T_FOR,
+	T_FUNC,
+	T_LBRACE,
+	T_RBRACE
+};
+
+#define MASK(type) (1 << (type))
+
+static const char* keyword[] = {"", "if", "then", "elif", "else", "fi", "while", "do", "done", "for", "", "{", "}"};
+
+typedef struct token
+{
+	int type;
+	int op;
+	char* text;				/* The job for T_ITEM, the header for T_FOR and the name for T_FUNC. */
+	char** words;			/* split_words(text) of a T_ITEM without variables. */
+}TOKEN;
+
+typedef struct compiler
+{
+	TOKEN* t;
+	int n, cap, pos;
+	PROGRAM* prog;
+	int status;
+	int quiet;				/* Lexing speculatively: the errors will be found again. */
+}COMPILER;
+
+/* A piece of a script lexed by a thread of its own. */
+
+typedef struct chunk
+{
+	COMPILER c;
+	const char* start, *end;
+	const char* stop;		/* Where lexing ended: past end when a here-document goes on. */
+	int ret;
+	int started;
+	pthread_t thread;
+}CHUNK;
+
+typedef struct function
+{
+	char* name;
+	PROGRAM* prog;
+	int pc;
+	struct function* next;
+}FUNCTION;
+
+static FUNCTION* functions = NULL;
+
+/* ------- LEXER ------- */
+
+static int push_token(COMPILER* c, int type, int op, const char* text, int len)
+{
+	if (c->n == c->cap)
+	{
+		int newcap = c->cap > 0 ? 2*c->cap : INITIAL_TOKEN_CAP;
+		TOKEN* newt = (TOKEN*) realloc(c->t, sizeof(TOKEN)*newcap);
+		error(newt == NULL, -1);
+		c->t = newt;
+		c->cap = newcap;
+	}
+	c->t[c->n].type = type;
+	c->t[c->n].op = op;
+	c->t[c->n].text = NULL;
+	c->t[c->n].words = NULL;
+	if (text != NULL)
+	{
+		c->t[c->n].text = (char*) malloc(sizeof(char)*(len+1));
+		error(c->t[c->n].text == NULL, -1);
+		memcpy(c->t[c->n].text, text, len);
+		c->t[c->n].text[len] = '\0';
+	}
+	if (type == T_ITEM && strchr(c->t[c->n].text, SLSH_VAR_SIGN) == NULL)
+	{
+		c->t[c->n].words = split_words(c->t[c->n].text);
+		error(c->t[c->n].words == NULL, (free(c->t[c->n].text), -1));
+	}
+	c->n++;
+	return 0;
+}
+
+static void free_tokens(COMPILER* c)
+{
+	int i;
+
+	for (i = 0; i < c->n; i++)
+	{
+		free(c->t[i].text);
+		if (c->t[i].words != NULL)
+			free(c->t[i].words[0]);
+		free(c->t[i].words);
+	}
+	free(c->t);
+	c->t = NULL;
+	c->n = c->cap = 0;
+}
+
+static int word_length(const char* s)
+{
+	return strcspn(s, SLSH_BLANK_CHARS);
+}
+
+static const char* skip_blanks(const char* s)
+{
+	return s + strspn(s, SLSH_BLANK_CHARS);
+}
+
+/* Splits a list item into keywords and the job that follows them, if any. */
+
+static int lex_item(COMPILER* c, const char* item, int op)
+{
+	int len, type;
+
+	while (*item != '\0')
+	{
+		len = word_length(item);
+
+		for (type = T_IF; type <= T_RBRACE; type++)
+			if (keyword[type][0] != '\0' && (int) strlen(keyword[type]) == len && !strncmp(item, keyword[type], len))
+				break;
+
+		if (type > T_RBRACE)
+		{
+			const char* paren = strstr(item, "()");
+
+			if (paren != NULL && paren > item && (paren - item == len - 2 || paren == skip_blanks(item+len)))
+			{
+				len = paren - item;
+				while (len > 0 && strchr(SLSH_BLANK_CHARS, item[len-1]) != NULL)
+					len--;
+				error(push_token(c, T_FUNC, op, item, len) < 0, -1);
+				item = skip_blanks(paren+2);
+				op = SLSH_SEQ;
+				continue;
+			}
+			return push_token(c, T_ITEM, op, item, strlen(item));
+		}
+
+		if (type == T_FOR)
+			return push_token(c, T_FOR, op, skip_blanks(item+len), strlen(skip_blanks(item+len)));
+
+		error(push_token(c, type, op, NULL, 0) < 0, -1);
+		item = skip_blanks(item+len);
+		op = SLSH_SEQ;
+
+		if ((type == T_FI || type == T_DONE || type == T_RBRACE) && *item != '\0')
+		{
+			if (!c->quiet)
+				printf("Syntax error near '%s'.\n", item);
+			c->status = SLSH_COMPILE_ERROR;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Returns item followed by the lines of its here-documents, which start at *next, and moves */
+/* *next past them. */
+
+static char* add_here_docs(COMPILER* c, const char* item, const char** next)
+{
+	const char* word = item, *start = *next;
+	char* body, *ret;
+	int len;
+
+	while ((word = find_here_doc(word, &len)) != NULL)
+	{
+		body = get_here_body(next, word, len);
+		if (body == NULL)
+		{
+			c->status = SLSH_COMPILE_INCOMPLETE;
+			return NULL;
+		}
+		free(body);
+		word += len;
+	}
+
+	len = *next - start;
+	if (len > 0 && start[len-1] == '\n')
+		len--;
+	ret = (char*) malloc(sizeof(char)*(strlen(item)+len+2));
+	error(ret == NULL, NULL);
+	strcpy(ret, item);
+	if (len > 0)
+	{
+		strcat(ret, "\n");
+		strncat(ret, start, len);
+	}
+	return ret;
+}
+
+/* Lexes the lines of text that start before end, and sets *stop to where the next line starts. */
+
+static int lex(COMPILER* c, const char* text, const char* end, const char** stop)
+{
+	const char* line = text, *eol, *next;
+	char* copy, *item;
+	CMD_LIST* list;
+	int i, ret = 0;
+
+	while (line < end && *line != '\0' && ret == 0)
+	{
+		eol = strchr(line, '\n');
+		if (eol == NULL)
+			eol = line + strlen(line);
+
+		if (*skip_blanks(line) != SLSH_COMMENT)
+		{
+			copy = (char*) malloc(sizeof(char)*(eol-line+1));
+			error(copy == NULL, -1);
+			memcpy(copy, line, eol-line);
+			copy[eol-line] = '\0';
+
+			list = make_cmd_list(copy);
+			free(copy);
+			error(list == NULL, -1);
+			next = *eol != '\0' ? eol+1 : eol;
+			for (i = 0; i < list->n && ret == 0; i++)
+			{
+				item = add_here_docs(c, list->item[i], &next);
+				if (item == NULL)
+					ret = -1;
+				else
+					ret = lex_item(c, item, list->op[i]);
+				free(item);
+			}
+			destroy_cmd_list(&list);
+			line = next;
+		}
+		else
+			line = *eol != '\0' ? eol+1 : eol;
+	}
+	*stop = line;
+	return ret;
+}
+
+static void* lex_chunk(void* arg)
+{
+	CHUNK* k = (CHUNK*) arg;
+
+	k->ret = lex(&k->c, k->start, k->end, &k->stop);
+	return NULL;
+}
+
+/* Appends the tokens of k to c if they are right, that is if k starts where c stopped and lexed */
+/* without errors. Otherwise lexes the chunk again from *pos, in order, which also reports the   */
+/* errors. A here-document that goes on into the next chunk makes that one start at the wrong   */
+/* place, and its tokens are thrown away.                                                       */
+
+static int merge_chunk(COMPILER* c, CHUNK* k, const char** pos)
+{
+	if (k->ret == 0 && k->start == *pos)
+	{
+		if (c->cap - c->n < k->c.n)
+		{
+			TOKEN* newt = (TOKEN*) realloc(c->t, sizeof(TOKEN)*(c->n + k->c.n));
+			error(newt == NULL, -1);
+			c->t = newt;
+			c->cap = c->n + k->c.n;
+		}
+		memcpy(c->t + c->n, k->c.t, sizeof(TOKEN)*k->c.n);
+		c->n += k->c.n;
+		k->c.n = 0;
+		*pos = k->stop;
+		return 0;
+	}
+	return lex(c, *pos, k->end, pos);
+}
+
+/* Big scripts are split at newlines into one chunk per CPU, and the chunks but the first are */
+/* lexed by threads while this one lexes the first. Splitting items into words is most of the */
+/* work, so it's done here rather than at code generation. Nothing runs while the later chunks */
+/* are lexed: a script with a syntax error anywhere must not run at all, and a construct or a */
+/* here-document can go on into the next chunk, so the first one isn't known to be whole.    */
+
+static int lex_script(COMPILER* c, const char* text)
+{
+	int len = strlen(text), n, i, ret;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* limit = var_get(SLSH_PARALLEL_VAR), *pos, *split;
+	CHUNK* k;
+
+	n = limit != NULL && atoi(limit) > 0 ? atoi(limit) : ncpu > 0 ? (int) ncpu : 1;
+	if (n > len / LEX_CHUNK_MIN)
+		n = len / LEX_CHUNK_MIN;
+	if (n < 2 || (k = (CHUNK*) calloc(n, sizeof(CHUNK))) == NULL)
+		return lex(c, text, text + len, &pos);
+
+	for (i = 0; i < n; i++)
+	{
+		split = i+1 < n ? strchr(text + (long) len*(i+1)/n, '\n') : NULL;
+		k[i].start = i > 0 ? k[i-1].end : text;
+		k[i].end = split != NULL ? split+1 : text + len;
+		if (k[i].end < k[i].start)
+			k[i].end = k[i].start;
+		k[i].c.quiet = 1;
+		k[i].ret = -1;
+		if (i > 0 && k[i].start < k[i].end)
+			k[i].started = pthread_create(&k[i].thread, NULL, lex_chunk, &k[i]) == 0;
+	}
+
+	ret = lex(c, text, k[0].end, &pos);
+	for (i = 1; i < n; i++)
+	{
+		if (k[i].started)
+			pthread_join(k[i].thread, NULL);
+		if (ret == 0)
+			ret = merge_chunk(c, &k[i], &pos);
+		free_tokens(&k[i].c);
+	}
+	free(k);
+	return ret;
+}
+
+/* ------- CODE GENERATION ------- */
+
+static int emit(COMPILER* c, int op, const char* text)
+{
+	PROGRAM* p = c->prog;
+	INSTR* in;
+
+	if (p->n == p->cap)
+	{
+		int newcap = p->cap > 0 ? 2*p->cap : INITIAL_PROGRAM_CAP;
+		INSTR* newv = (INSTR*) realloc(p->v, sizeof(INSTR)*newcap);
+		error(newv == NULL, -1);
+		p->v = newv;
+		p->cap = newcap;
+	}
+	in = &p->v[p->n];
+	memset(in, 0, sizeof(INSTR));
+	in->op = op;
+	in->target = -1;
+	if (text != NULL)
+	{
+		in->text = (char*) malloc(sizeof(char)*(strlen(text)+1));
+		error(in->text == NULL, -1);
+		strcpy(in->text, text);
+	}
+	return p->n++;
+}
+
+/* Decides once how a job will be run, so that the executor doesn't have to look at the text */
+/* again unless it has variables in it. */
+
+static int emit_run(COMPILER* c, TOKEN* t)
+{
+	const char* text = t->text;
+	int pc, i, all = 1;
+	INSTR* in;
+	char** words = t->words;
+
+	pc = emit(c, I_RUN, text);
+	error(pc < 0, -1);
+	in = &c->prog->v[pc];
+	in->cond = t->op;
+
+	if (words == NULL)
+	{
+		in->kind = RUN_TEXT;
+		return pc;
+	}
+	t->words = NULL;			/* The instruction or this function frees them now. */
+	for (i = 0; words[i] != NULL && all; i++)
+		all = is_assignment(words[i]);
+
+	if (words[0] != NULL && all)
+		in->kind = RUN_ASSIGN;
+	else if (words[0] != NULL && strpbrk(text, SLSH_PIPE "<>&") == NULL)
+	{
+		in->argv = words;
+		in->builtin = get_builtin_cmd(words[0]);
+		in->kind = in->builtin && strpbrk(text, SLSH_GLOB_CHARS) == NULL ? RUN_BUILTIN : RUN_JOB;
+		return pc;
+	}
+	else
+		in->kind = RUN_JOB;
+
+	free(words[0]);
+	free(words);
+	return pc;
+}
+
+static int expect(COMPILER* c, int type)
+{
+	if (c->pos == c->n)
+	{
+		c->status = SLSH_COMPILE_INCOMPLETE;
+		return -1;
+	}
+	if (c->t[c->pos].type != type)
+	{
+		printf("Syntax error: expected '%s'.\n", keyword[type]);
+		c->status = SLSH_COMPILE_ERROR;
+		return -1;
+	}
+	c->pos++;
+	return 0;
+}
+
+static int parse_command(COMPILER* c);
+
+/* Compiles commands until one of the token types in stop is next. stop == 0 means until the end. */
+
+static int parse_list(COMPILER* c, int stop)
+{
+	while (c->pos < c->n && !(MASK(c->t[c->pos].type) & stop))
+		if (parse_command(c) < 0)
+			return -1;
+
+	if (c->pos == c->n && stop != 0)
+	{
+		c->status = SLSH_COMPILE_INCOMPLETE;
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_if(COMPILER* c)
+{
+	int jfail, end = -1, jmp;
+
+	c->pos++;
+	if (parse_list(c, MASK(T_THEN)) < 0 || expect(c, T_THEN) < 0)
+		return -1;
+	error((jfail = emit(c, I_JFAIL, NULL)) < 0, -1);
+	if (parse_list(c, MASK(T_ELIF) | MASK(T_ELSE) | MASK(T_FI)) < 0)
+		return -1;
+
+	while (c->t[c->pos].type != T_FI)
+	{
+		error((jmp = emit(c, I_JMP, NULL)) < 0, -1);
+		c->prog->v[jmp].target = end;				/* The jumps to the end are chained until fi. */
+		end = jmp;
+		c->prog->v[jfail].target = c->prog->n;
+		jfail = -1;
+
+		if (c->t[c->pos++].type == T_ELIF)
+		{
+			if (parse_list(c, MASK(T_THEN)) < 0 || expect(c, T_THEN) < 0)
+				return -1;
+			error((jfail = emit(c, I_JFAIL, NULL)) < 0, -1);
+			if (parse_list(c, MASK(T_ELIF) | MASK(T_ELSE) | MASK(T_FI)) < 0)
+				return -1;
+		}
+		else if (parse_list(c, MASK(T_FI)) < 0)
+			return -1;
+	}
+	c->pos++;
+
+	if (jfail >= 0)
+		c->prog->v[jfail].target = c->prog->n;
+	while (end >= 0)
+	{
+		jmp = c->prog->v[end].target;
+		c->prog->v[end].target = c->prog->n;
+		end = jmp;
+	}
+	return 0;
+}
+
+static int parse_while(COMPILER* c)
+{
+	int top = c->prog->n, jfail;
+
+	c->pos++;
+	if (parse_list(c, MASK(T_DO)) < 0 || expect(c, T_DO) < 0)
+		return -1;
+	error((jfail = emit(c, I_JFAIL, NULL)) < 0, -1);
+	if (parse_list(c, MASK(T_DONE)) < 0 || expect(c, T_DONE) < 0)
+		return -1;
+	error(emit(c, I_JMP, NULL) < 0, -1);
+	c->prog->v[c->prog->n-1].target = top;
+	c->prog->v[jfail].target = c->prog->n;
+	return 0;
+}
+
+static int parse_for(COMPILER* c)
+{
+	const char* header = c->t[c->pos].text, *words;
+	int len = word_length(header), next, i;
+
+	words = skip_blanks(header+len);
+	for (i = 0; i < len && (header[i] == '_' || (header[i] >= 'a' && header[i] <= 'z') ||
+			(header[i] >= 'A' && header[i] <= 'Z') || (i > 0 && header[i] >= '0' && header[i] <= '9')); i++)
+		;
+	if (len == 0 || i < len || strncmp(words, "in", 2) || (words[2] != '\0' && strchr(SLSH_BLANK_CHARS, words[2]) == NULL))
+	{
+		printf("Syntax error: expected 'for NAME in WORDS'.\n");
+		c->status = SLSH_COMPILE_ERROR;
+		return -1;
+	}
+	words = skip_blanks(words+2);
+
+	c->pos++;
+	if (expect(c, T_DO) < 0)
+		return -1;
+	error(emit(c, I_FOR_INIT, words) < 0, -1);
+	error((next = emit(c, I_FOR_NEXT, NULL)) < 0, -1);
+	c->prog->v[next].var = (char*) malloc(sizeof(char)*(len+1));
+	error(c->prog->v[next].var == NULL, -1);
+	memcpy(c->prog->v[next].var, header, len);
+	c->prog->v[next].var[len] = '\0';
+
+	if (parse_list(c, MASK(T_DONE)) < 0 || expect(c, T_DONE) < 0)
+		return -1;
+	error(emit(c, I_JMP, NULL) < 0, -1);
+	c->prog->v[c->prog->n-1].target = next;
+	c->prog->v[next].target = c->prog->n;
+	return 0;
+}
+
+static int parse_function(COMPILER* c)
+{
+	int def;
+
+	error((def = emit(c, I_FUNC, c->t[c->pos].text)) < 0, -1);
+	c->pos++;
+	if (expect(c, T_LBRACE) < 0 || parse_list(c, MASK(T_RBRACE)) < 0 || expect(c, T_RBRACE) < 0)
+		return -1;
+	error(emit(c, I_RET, NULL) < 0, -1);
+	c->prog->v[def].target = c->prog->n;
+	return 0;
+}
+
+static int parse_command(COMPILER* c)
+{
+	TOKEN* t = &c->t[c->pos];
+
+	switch (t->type)
+	{
+		case T_ITEM:
+			c->pos++;
+			return emit_run(c, t) < 0 ? -1 : 0;
+		case T_IF:
+			return parse_if(c);
+		case T_WHILE:
+			return parse_while(c);
+		case T_FOR:
+			return parse_for(c);
+		case T_FUNC:
+			return parse_function(c);
+		default:
+			printf("Syntax error near '%s'.\n", keyword[t->type]);
+			c->status = SLSH_COMPILE_ERROR;
+			return -1;
+	}
+}
+
+/* ------- INTERFACE ------- */
+
+PROGRAM* compile(const char* text, int* status)
+{
+	COMPILER c;
+	int ret;
+
+	memset(&c, 0, sizeof(COMPILER));
+	c.status = SLSH_COMPILE_ERROR;
+
+	c.prog = (PROGRAM*) calloc(1, sizeof(PROGRAM));
+	if (c.prog != NULL)
+	{
+		c.prog->refs = 1;
+		ret = lex_script(&c, text);
+		if (ret == 0)
+			ret = parse_list(&c, 0);
+		if (ret == 0)
+			c.status = SLSH_COMPILE_OK;
+		else
+			destroy_program(&c.prog);
+	}
+
+	free_tokens(&c);
+
+	if (status != NULL)
+		*status = c.status;
+	return c.prog;
+}
+
+void destroy_program(PROGRAM** prog)
+{
+	INSTR* in;
+	int i;
+
+	if (prog == NULL || *prog == NULL)
+		return;
+
+	if (--(*prog)->refs == 0)
+	{
+		for (i = 0; i < (*prog)->n; i++)
+		{
+			in = &(*prog)->v[i];
+			free(in->text);
+			free(in->var);
+			if (in->argv != NULL)
+			{
+				free(in->argv[0]);
+				free(in->argv);
+			}
+			if (in->data != NULL && (*prog)->destroy_data != NULL)
+				(*prog)->destroy_data(in->data);
+		}
+		free((*prog)->v);
+		free(*prog);
+	}
+	*prog = NULL;
+}
+
+int define_function(const char* name, PROGRAM* prog, int pc)
+{
+	FUNCTION* f;
+
+	for (f = functions; f != NULL; f = f->next)
+		if (!strcmp(f->name, name))
+			break;
+
+	if (f == NULL)
+	{
+		f = (FUNCTION*) calloc(1, sizeof(FUNCTION));
+		error(f == NULL, -1);
+		f->name = (char*) malloc(sizeof(char)*(strlen(name)+1));
+		error(f->name == NULL, (free(f), -1));
+		strcpy(f->name, name);
+		f->next = functions;
+		functions = f;
+	}
+	else
+		destroy_program(&f->prog);
+
+	prog->refs++;
+	f->prog = prog;
+	f->pc = pc;
+	return 0;
+}
+
+int find_function(const char* name, PROGRAM** prog, int* pc)
+{
+	FUNCTION* f;
+
+	for (f = functions; f != NULL; f = f->next)
+	{
+		if (!strcmp(f->name, name))
+		{
+			*prog = f->prog;
+			*pc = f->pc;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void destroy_functions()
+{
+	FUNCTION* next;
+
+	while (functions != NULL)
+	{
+		next = functions->next;
+		destroy_program(&functions->prog);
+		free(functions->name);
+		free(functions);
+		functions = next;
+	}
+}
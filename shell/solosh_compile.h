@@ -0,0 +1,87 @@
+/*   solosh_compile.h - script compiler header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_COMPILE_H
+#define SOLOSH_COMPILE_H
+
+#define SLSH_COMMENT '#'
+
+/* A script (or an interactive line) is compiled once into an array of instructions. Plain jobs */
+/* become I_RUN instructions; 'if', 'while', 'for' and functions become jumps around them. The    */
+/* supported forms are:                                                                          */
+/*                                                                                               */
+/*     if LIST; then LIST; [elif LIST; then LIST;]... [else LIST;] fi                            */
+/*     while LIST; do LIST; done                                                                 */
+/*     for NAME in WORDS; do LIST; done                                                          */
+/*     NAME() { LIST; }                                                                          */
+/*                                                                                               */
+/* where newlines can be used instead of ';'. Lines starting with '#' are comments.              */
+
+enum
+{
+	I_RUN = 0,				/* Run text (if cond holds for last_status). */
+	I_JMP,					/* Go to target. */
+	I_JFAIL,				/* Go to target if last_status is non-zero. */
+	I_FOR_INIT,				/* Expand text into the words a new loop iterates over. */
+	I_FOR_NEXT,				/* Set var to the next word of the innermost loop, or end it and go to target. */
+	I_FUNC,					/* Define function text, whose body is the next instruction, and go to target. */
+	I_RET					/* End of a function body. */
+};
+
+enum						/* How an I_RUN is executed, decided at compile time. */
+{
+	RUN_TEXT = 0,			/* Has variables: expanded and parsed each time. */
+	RUN_ASSIGN,				/* Only NAME=VALUE words. */
+	RUN_BUILTIN,			/* A single built-in command, run straight from argv. */
+	RUN_JOB					/* Anything else, run from a job template built on first use. */
+};
+
+typedef struct instr
+{
+	int op;
+	int cond;				/* SLSH_SEQ, SLSH_AND or SLSH_OR, for I_RUN. */
+	int kind;				/* RUN_*, for I_RUN. */
+	char* text;
+	char* var;				/* Loop variable, for I_FOR_NEXT. */
+	char** argv;			/* Pre-split words (split_words layout) of RUN_BUILTIN and RUN_JOB simple commands. */
+	int builtin;			/* get_builtin_cmd(argv[0]). */
+	int target;
+	void* data;				/* Owned by the executor, see destroy_data. */
+}INSTR;
+
+typedef struct program
+{
+	INSTR* v;
+	int n, cap;
+	int refs;				/* Functions defined by a program keep it alive. */
+	void (*destroy_data)(void*);
+}PROGRAM;
+
+#define SLSH_COMPILE_OK 0
+#define SLSH_COMPILE_INCOMPLETE 1	/* Unterminated construct: more lines may complete it. */
+#define SLSH_COMPILE_ERROR 2
+
+PROGRAM* compile(const char* text, int* status);
+void destroy_program(PROGRAM** prog);		/* Drops a reference. */
+
+int define_function(const char* name, PROGRAM* prog, int pc);
+int find_function(const char* name, PROGRAM** prog, int* pc);
+void destroy_functions();
+
+#endif
@@ -0,0 +1,522 @@
+/*   solosh_complete.c - tab completion
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dirent.h>
+#include <solosh_complete.h>
+#include <solosh_errors.h>
+#include <solosh_glob.h>
+#include <solosh_parser.h>
+#include <solosh_vars.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INITIAL_INDEX_CAP 1024
+#define INITIAL_COMPLETIONS_CAP 16
+#define COMPLETE_MAX_PATH 4096
+#define EVENT_BUFFER_SIZE 4096
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WORD_END " \t|;&<>()"					/* Characters that end a word. */
+
+typedef struct exe
+{
+	char* name;
+	int dir;							/* Index in dirs, to tell the same name in two directories apart. */
+}EXE;
+
+typedef struct path_index
+{
+	EXE* v;								/* Sorted by name, then directory. */
+	int n, cap;
+	char* path;							/* The $PATH the index is for. */
+	char** dirs;
+	int ndirs;
+	int* watch;							/* inotify watch of each directory, or -1. */
+	struct timespec* mtim;				/* Of each directory when it was read. */
+	int fd;								/* The inotify instance, or -1. */
+}PATH_INDEX;
+
+typedef struct completions
+{
+	char** v;
+	int n, cap;
+	int more;							/* There were more than SLSH_COMPLETE_MAX. */
+	int common;							/* Length of the prefix they all have. */
+}COMPLETIONS;
+
+static PATH_INDEX path_index = {NULL, 0, 0, NULL, NULL, 0, NULL, NULL, -1};
+
+/* ------- PATH INDEX ------- */
+
+static int compare_exes(const void* a, const void* b)
+{
+	const EXE* x = (const EXE*) a, *y = (const EXE*) b;
+	int cmp = strcmp(x->name, y->name);
+
+	return cmp != 0 ? cmp : x->dir - y->dir;
+}
+
+/* Where name from directory dir is in the index, or should go. */
+
+static int find_exe(const char* name, int dir, int* found)
+{
+	int lo = 0, hi = path_index.n, mid, cmp;
+	EXE key;
+
+	key.name = (char*) name;
+	key.dir = dir;
+	*found = 0;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		cmp = compare_exes(&path_index.v[mid], &key);
+		if (cmp == 0)
+		{
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int is_executable(int dir, const char* name)
+{
+	char path[COMPLETE_MAX_PATH];
+	struct stat st;
+
+	if (snprintf(path, sizeof(path), "%s/%s", path_index.dirs[dir], name) >= (int) sizeof(path))
+		return 0;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* Appends name without keeping the index sorted, for reading whole directories. */
+
+static int append_exe(const char* name, int dir)
+{
+	if (path_index.n == path_index.cap)
+	{
+		int newcap = path_index.cap > 0 ? 2*path_index.cap : INITIAL_INDEX_CAP;
+		EXE* newv = (EXE*) realloc(path_index.v, sizeof(EXE)*newcap);
+		error(newv == NULL, -1);
+		path_index.v = newv;
+		path_index.cap = newcap;
+	}
+	path_index.v[path_index.n].name = (char*) malloc(strlen(name)+1);
+	error(path_index.v[path_index.n].name == NULL, -1);
+	strcpy(path_index.v[path_index.n].name, name);
+	path_index.v[path_index.n].dir = dir;
+	path_index.n++;
+	return 0;
+}
+
+static void remove_exe(int i)
+{
+	free(path_index.v[i].name);
+	memmove(&path_index.v[i], &path_index.v[i+1], sizeof(EXE)*(path_index.n-i-1));
+	path_index.n--;
+}
+
+/* Brings name from directory dir in or out of the index, after an event about it. */
+
+static int update_exe(const char* name, int dir)
+{
+	int found, i = find_exe(name, dir, &found), exe = is_executable(dir, name);
+	EXE e;
+
+	if (found && !exe)
+		remove_exe(i);
+	else if (!found && exe)
+	{
+		error(append_exe(name, dir) < 0, -1);
+		e = path_index.v[path_index.n-1];
+		memmove(&path_index.v[i+1], &path_index.v[i], sizeof(EXE)*(path_index.n-1-i));
+		path_index.v[i] = e;
+	}
+	return 0;
+}
+
+static void drop_dir(int dir)
+{
+	int i, j;
+
+	for (i = j = 0; i < path_index.n; i++)
+	{
+		if (path_index.v[i].dir == dir)
+			free(path_index.v[i].name);
+		else
+			path_index.v[j++] = path_index.v[i];
+	}
+	path_index.n = j;
+}
+
+/* Reads directory dir into the index, which has to be sorted afterwards. */
+
+static void read_dir(int dir)
+{
+	struct stat st;
+	struct dirent* d;
+	DIR* dp;
+
+	if (stat(path_index.dirs[dir], &st) < 0 || (dp = opendir(path_index.dirs[dir])) == NULL)
+	{
+		path_index.mtim[dir].tv_sec = path_index.mtim[dir].tv_nsec = 0;
+		return;
+	}
+	path_index.mtim[dir] = st.st_mtim;
+	while ((d = readdir(dp)) != NULL)
+		if (d->d_name[0] != '.' && is_executable(dir, d->d_name) && append_exe(d->d_name, dir) < 0)
+			break;
+	closedir(dp);
+}
+
+void complete_index_clear()
+{
+	int i;
+
+	for (i = 0; i < path_index.n; i++)
+		free(path_index.v[i].name);
+	for (i = 0; i < path_index.ndirs; i++)
+		free(path_index.dirs[i]);
+	free(path_index.v);
+	free(path_index.path);
+	free(path_index.dirs);
+	free(path_index.watch);
+	free(path_index.mtim);
+	if (path_index.fd >= 0)
+		close(path_index.fd);
+	memset(&path_index, 0, sizeof(PATH_INDEX));
+	path_index.fd = -1;
+}
+
+static int build_index(const char* path)
+{
+	const char* p, *end;
+	int i, len;
+
+	path_index.path = (char*) malloc(strlen(path)+1);
+	path_index.dirs = (char**) malloc(sizeof(char*)*(strlen(path)/2+1));
+	error(path_index.path == NULL || path_index.dirs == NULL, -1);
+	strcpy(path_index.path, path);
+
+	for (p = path; *p != '\0'; p = *end != '\0' ? end+1 : end)
+	{
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0)
+			continue;					/* The current directory changes, so it isn't indexed. */
+		for (i = 0; i < path_index.ndirs; i++)
+			if ((int) strlen(path_index.dirs[i]) == len && !strncmp(path_index.dirs[i], p, len))
+				break;
+		if (i < path_index.ndirs)
+			continue;
+		path_index.dirs[path_index.ndirs] = (char*) malloc(len+1);
+		error(path_index.dirs[path_index.ndirs] == NULL, -1);
+		memcpy(path_index.dirs[path_index.ndirs], p, len);
+		path_index.dirs[path_index.ndirs++][len] = '\0';
+	}
+
+	path_index.watch = (int*) malloc(sizeof(int)*(path_index.ndirs+1));
+	path_index.mtim = (struct timespec*) malloc(sizeof(struct timespec)*(path_index.ndirs+1));
+	error(path_index.watch == NULL || path_index.mtim == NULL, -1);
+	path_index.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (i = 0; i < path_index.ndirs; i++)
+	{
+		path_index.watch[i] = path_index.fd >= 0 ? inotify_add_watch(path_index.fd, path_index.dirs[i], WATCH_MASK) : -1;
+		read_dir(i);
+	}
+	qsort(path_index.v, path_index.n, sizeof(EXE), compare_exes);
+	return 0;
+}
+
+/* Applies what the watches saw since the last completion. */
+
+static int read_events()
+{
+	union
+	{
+		struct inotify_event event;
+		char buf[EVENT_BUFFER_SIZE];
+	}u;
+	struct inotify_event* e;
+	ssize_t n, pos;
+	int i;
+
+	while ((n = read(path_index.fd, u.buf, sizeof(u.buf))) > 0)
+	{
+		for (pos = 0; pos < n; pos += sizeof(struct inotify_event) + e->len)
+		{
+			e = (struct inotify_event*) (u.buf + pos);
+			if (e->mask & IN_Q_OVERFLOW)
+				return -1;
+			for (i = 0; i < path_index.ndirs && path_index.watch[i] != e->wd; i++)
+				;
+			if (i == path_index.ndirs)
+				continue;
+			if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+			{
+				drop_dir(i);
+				inotify_rm_watch(path_index.fd, path_index.watch[i]);
+				path_index.watch[i] = -1;		/* From now on its mtime is checked instead. */
+				path_index.mtim[i].tv_sec = path_index.mtim[i].tv_nsec = 0;
+			}
+			else if (e->len > 0 && e->name[0] != '.')
+				error(update_exe(e->name, i) < 0, -1);
+		}
+	}
+	return 0;
+}
+
+/* Makes the index match $PATH as it is now. */
+
+static int update_index()
+{
+	const char* path = var_get("PATH");
+	struct stat st;
+	int i, changed = 0;
+
+	if (path == NULL)
+		path = "";
+	if (path_index.path == NULL || strcmp(path_index.path, path))
+	{
+		complete_index_clear();
+		return build_index(path);
+	}
+
+	if (path_index.fd >= 0 && read_events() < 0)
+	{
+		complete_index_clear();				/* Events were lost. */
+		return build_index(path);
+	}
+
+	for (i = 0; i < path_index.ndirs; i++)
+	{
+		if (path_index.watch[i] >= 0)
+			continue;
+		if (stat(path_index.dirs[i], &st) < 0)
+			st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+		if (st.st_mtim.tv_sec == path_index.mtim[i].tv_sec && st.st_mtim.tv_nsec == path_index.mtim[i].tv_nsec)
+			continue;
+		drop_dir(i);
+		read_dir(i);
+		changed = 1;
+	}
+	if (changed)
+		qsort(path_index.v, path_index.n, sizeof(EXE), compare_exes);
+	return 0;
+}
+
+/* ------- COMPLETIONS ------- */
+
+static int common_length(const char* first, const char* name, int slash)
+{
+	int i;
+
+	for (i = 0; first[i] != '\0' && first[i] == name[i]; i++)
+		;
+	if (name[i] == '\0' && slash && first[i] == '/')
+		i++;
+	return i;
+}
+
+/* Adds dir followed by name, and a '/' if slash. Past SLSH_COMPLETE_MAX only the common prefix */
+/* is kept track of. */
+
+static int add_completion(COMPLETIONS* c, const char* dir, int dirlen, const char* name, int slash)
+{
+	int len = strlen(name);
+
+	if (c->n > 0)
+	{
+		len = dirlen + common_length(c->v[0] + dirlen, name, slash);
+		if (len < c->common)
+			c->common = len;
+	}
+	if (c->n == SLSH_COMPLETE_MAX)
+	{
+		c->more = 1;
+		return 0;
+	}
+
+	if (c->n+1 >= c->cap)
+	{
+		int newcap = c->cap > 0 ? 2*c->cap : INITIAL_COMPLETIONS_CAP;
+		char** newv = (char**) realloc(c->v, sizeof(char*)*(newcap+1));
+		error(newv == NULL, -1);
+		c->v = newv;
+		c->cap = newcap;
+	}
+	len = strlen(name);
+	c->v[c->n] = (char*) malloc(dirlen+len+2);
+	error(c->v[c->n] == NULL, -1);
+	memcpy(c->v[c->n], dir, dirlen);
+	strcpy(c->v[c->n] + dirlen, name);
+	if (slash)
+		strcat(c->v[c->n], "/");
+	if (c->n == 0)
+		c->common = strlen(c->v[0]);
+	c->v[++c->n] = NULL;
+	return 0;
+}
+
+/* The end of the entries from i on that start with prefix. */
+
+static int prefix_end(int i, const char* prefix, int len)
+{
+	int hi = path_index.n, mid;
+
+	while (i < hi)
+	{
+		mid = (i + hi) / 2;
+		if (strncmp(path_index.v[mid].name, prefix, len) <= 0)
+			i = mid+1;
+		else
+			hi = mid;
+	}
+	return i;
+}
+
+static int complete_command(COMPLETIONS* c, const char* word, int len)
+{
+	char* prefix;
+	int i, end, found, ret = 0;
+
+	error(update_index() < 0, -1);
+	prefix = (char*) malloc(len+1);
+	error(prefix == NULL, -1);
+	memcpy(prefix, word, len);
+	prefix[len] = '\0';
+
+	i = find_exe(prefix, -1, &found);
+	end = prefix_end(i, prefix, len);
+	for (; i < end && ret == 0 && !c->more; i++)
+		if (i == 0 || strcmp(path_index.v[i].name, path_index.v[i-1].name))
+			ret = add_completion(c, "", 0, path_index.v[i].name, 0);
+	if (ret == 0 && c->more)			/* What the first and the last have in common, all have. */
+		ret = add_completion(c, "", 0, path_index.v[end-1].name, 0);
+	free(prefix);
+	return ret;
+}
+
+static int complete_file(COMPLETIONS* c, const char* word, int len)
+{
+	char dir[COMPLETE_MAX_PATH], path[COMPLETE_MAX_PATH], **names;
+	const char* base = word;
+	struct stat st;
+	int i, n, dirlen, baselen, slash;
+
+	for (i = 0; i < len; i++)
+		if (word[i] == '/')
+			base = word+i+1;
+	dirlen = base - word;
+	baselen = len - dirlen;
+	if (dirlen >= COMPLETE_MAX_PATH)
+		return 0;
+	memcpy(dir, word, dirlen);
+	dir[dirlen] = '\0';
+
+	names = glob_listing(dirlen > 0 ? dir : ".", &n);
+	for (i = 0; names != NULL && i < n; i++)
+	{
+		if (strncmp(names[i], base, baselen) || (names[i][0] == '.' && (baselen == 0 || base[0] != '.')))
+			continue;
+		slash = 0;
+		if (c->n < SLSH_COMPLETE_MAX && snprintf(path, sizeof(path), "%s%s", dirlen > 0 ? dir : "./", names[i]) < (int) sizeof(path))
+			slash = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+		error(add_completion(c, dir, dirlen, names[i], slash) < 0, -1);
+	}
+	return 0;
+}
+
+/* A command name is expected after these, or at the start of the line. */
+
+static int command_position(const char* line, int start)
+{
+	static const char* keywords[] = {"if", "then", "elif", "else", "while", "do", "{", NULL};
+	int end, i;
+
+	while (start > 0 && strchr(SLSH_BLANK_CHARS, line[start-1]) != NULL)
+		start--;
+	if (start == 0 || strchr("|;&(", line[start-1]) != NULL)
+		return 1;
+	end = start;
+	while (start > 0 && strchr(WORD_END, line[start-1]) == NULL)
+		start--;
+	for (i = 0; keywords[i] != NULL; i++)
+		if ((int) strlen(keywords[i]) == end-start && !strncmp(line+start, keywords[i], end-start))
+			return command_position(line, start);
+	return 0;
+}
+
+char** complete(const char* line, int point, int* start)
+{
+	COMPLETIONS c = {NULL, 0, 0, 0, 0};
+	const char* word;
+	int len, ret;
+
+	*start = point;
+	while (*start > 0 && strchr(WORD_END, line[*start-1]) == NULL)
+		(*start)--;
+	word = line + *start;
+	len = point - *start;
+
+	if (memchr(word, '/', len) == NULL && command_position(line, *start))
+		ret = complete_command(&c, word, len);
+	else
+		ret = complete_file(&c, word, len);
+	if (ret == 0 && c.more)
+	{
+		c.v[c.n] = (char*) malloc(c.common+1);		/* There is room for it, see add_completion. */
+		if (c.v[c.n] == NULL)
+			ret = -1;
+		else
+		{
+			memcpy(c.v[c.n], c.v[0], c.common);
+			c.v[c.n][c.common] = '\0';
+			c.v[++c.n] = NULL;
+		}
+	}
+	if (ret < 0)
+		destroy_completions(&c.v);
+	else if (c.v == NULL)
+	{
+		c.v = (char**) calloc(1, sizeof(char*));
+		error(c.v == NULL, NULL);
+	}
+	return c.v;
+}
+
+void destroy_completions(char*** matches)
+{
+	int i;
+
+	if (matches == NULL || *matches == NULL)
+		return;
+	for (i = 0; (*matches)[i] != NULL; i++)
+		free((*matches)[i]);
+	free(*matches);
+	*matches = NULL;
+}
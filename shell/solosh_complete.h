@@ -0,0 +1,38 @@
+/*   solosh_complete.h - tab completion header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_COMPLETE_H
+#define SOLOSH_COMPLETE_H
+
+/* Command names are completed from an index of the executables in $PATH, sorted by name, which */
+/* is built on the first completion and then kept up to date by inotify watches on the $PATH    */
+/* directories instead of reading them again. A directory that can't be watched is read again  */
+/* when its mtime changes. Other words are completed from the directory listings cached by the  */
+/* glob module. Directories complete with a '/' after them.                                     */
+
+#define SLSH_COMPLETE_MAX 100		/* Candidates returned, at most. If there are more, they are followed */
+									/* by the prefix they all have, so that is still what they share.    */
+
+char** complete(const char* line, int point, int* start);	/* Candidates for the word of line that ends */
+															/* at point and starts at *start, sorted and */
+															/* NULL-terminated, each malloc'd. */
+void destroy_completions(char*** matches);
+void complete_index_clear();
+
+#endif
@@ -0,0 +1,769 @@
+/*   solosh_edit.c - line editor
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <solosh_complete.h>
+#include <solosh_edit.h>
+#include <solosh_errors.h>
+#include <solosh_history.h>
+#include <solosh_parser.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define INITIAL_EDIT_CAP 128
+#define EDIT_INPUT_SIZE 256
+#define EDIT_QUERY_SIZE 256
+#define EDIT_DEFAULT_COLS 80
+#define EDIT_MOVE_SIZE 32			/* Room for the escape sequences that move the cursor once. */
+#define SEARCH_PROMPT "(reverse-i-search)`"
+#define FAILED_SEARCH_PROMPT "(failed reverse-i-search)`"
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_BACKSPACE 0x7f
+#define KEY_ESC 0x1b
+
+typedef struct edit
+{
+	char* buf;
+	int len, cap;
+	int point;					/* Where the cursor is in buf. */
+	const char* prompt;
+	int prompt_cols;			/* Columns the prompt takes. */
+	int cols;					/* Width of the terminal. */
+	int row;					/* Row the cursor is on, counting from the prompt's. */
+	int drawn;					/* Columns taken by what is on the screen. */
+	COMPLETER complete;
+	SEARCHER search;
+	int esc;					/* Inside an escape sequence: 1 after ESC, 2 after ESC [, 3 after ESC O. */
+	int arg[2], narg;			/* Its numbers, as in ESC [ 1 ; 5 D. */
+	char* kill;					/* What the last Ctrl-K, Ctrl-U or Ctrl-W took out, for Ctrl-Y. */
+	int klen;
+	long* hist;					/* Where the entries Up went through start, newest first. */
+	int nhist, hcap;
+	char* edited;				/* The line as it was before the first Up. */
+	int searching;				/* In a Ctrl-R search. */
+	char query[EDIT_QUERY_SIZE];
+	int qlen;
+	char* match;				/* The entry the search is at, or NULL. */
+	long pos;					/* Where it starts in the history. */
+	int failed;
+	int eof;
+}EDIT;
+
+static char input[EDIT_INPUT_SIZE];			/* Read but not used yet: what was typed or pasted */
+static int input_pos = 0, input_len = 0;	/* after the end of the last line. */
+
+static int key(EDIT* e, unsigned char c);
+
+static void put(const char* s, int n)
+{
+	ssize_t w;
+
+	while (n > 0)
+	{
+		w = write(STDOUT_FILENO, s, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return;
+		s += w;
+		n -= w;
+	}
+}
+
+/* Copies s to out, which has room for 2*n, with control characters as ^X. Returns the length. */
+
+static int render(const char* s, int n, char* out)
+{
+	int i, len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((unsigned char) s[i] < ' ')
+		{
+			out[len++] = '^';
+			out[len++] = s[i] + '@';
+		}
+		else
+			out[len++] = s[i];
+	}
+	return len;
+}
+
+/* Columns s takes once rendered. Each UTF-8 character counts as one. */
+
+static int width(const char* s, int n)
+{
+	int i, w = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((unsigned char) s[i] < ' ')
+			w += 2;
+		else if ((s[i] & 0xc0) != 0x80)
+			w++;
+	}
+	return w;
+}
+
+/* Columns from the start of the prompt to p in the line. */
+
+static int columns(EDIT* e, int p)
+{
+	return e->prompt_cols + width(e->buf, p);
+}
+
+/* Writes to out what takes the cursor from column from to column to, both counted from the   */
+/* start of the prompt, and returns its length. The line wraps at the edge of the terminal. */
+
+static int move(EDIT* e, char* out, int from, int to)
+{
+	int len = 0, rows = to / e->cols - from / e->cols;
+
+	if (rows < 0)
+		len += sprintf(out+len, "\033[%dA", -rows);
+	else if (rows > 0)
+		len += sprintf(out+len, "\033[%dB", rows);
+	if (rows != 0 && to % e->cols == 0)
+		out[len++] = '\r';
+	else if (rows != 0)
+		len += sprintf(out+len, "\r\033[%dC", to % e->cols);
+	else if (to > from)
+		len += sprintf(out+len, "\033[%dC", to - from);
+	else if (to < from)
+		len += sprintf(out+len, "\033[%dD", from - to);
+	e->row = to / e->cols;
+	return len;
+}
+
+/* After writing up to column end, which is where the cursor is, puts it at column at. A line */
+/* that fills its last row leaves the cursor past the edge, so it is taken to the next one.   */
+
+static int finish(EDIT* e, char* out, int end, int at)
+{
+	int len = 0;
+
+	if (end > 0 && end % e->cols == 0)
+	{
+		memcpy(out, "\r\n", 2);
+		len = 2;
+	}
+	if (end < e->drawn)
+	{
+		memcpy(out+len, "\033[J", 3);
+		len += 3;
+	}
+	e->drawn = end;
+	return len + move(e, out+len, end, at);
+}
+
+/* Draws the prompt and the line again, or the search and what it found, from the first row, */
+/* and puts the cursor back. Everything goes out in one write.                                */
+
+static void redraw(EDIT* e)
+{
+	const char* head = e->searching ? (e->failed ? FAILED_SEARCH_PROMPT : SEARCH_PROMPT) : e->prompt;
+	const char* text = e->searching ? (e->match != NULL ? e->match : "") : e->buf;
+	int hlen = strlen(head), tlen = strlen(text), len = 0, end, at;
+	char* out = (char*) malloc(hlen + 2*e->qlen + 2*tlen + 2*EDIT_MOVE_SIZE);
+
+	if (out == NULL)
+		return;
+	if (e->row > 0)
+		len += sprintf(out, "\033[%dA", e->row);
+	memcpy(out+len, "\r\033[J", 4);
+	len += 4;
+	memcpy(out+len, head, hlen);
+	len += hlen;
+	end = width(head, hlen);
+	if (e->searching)
+	{
+		len += render(e->query, e->qlen, out+len);
+		memcpy(out+len, "': ", 3);
+		len += 3;
+		end += width(e->query, e->qlen) + 3;
+	}
+	len += render(text, tlen, out+len);
+	at = end + width(text, e->searching ? tlen : e->point);
+	end += width(text, tlen);
+	e->drawn = 0;
+	len += finish(e, out+len, end, at);
+	put(out, len);
+	free(out);
+}
+
+/* Writes the line again from position from on, where it changed, with the cursor at column */
+/* cursor before and at the point after. Typing at the end of the line writes just the key. */
+
+static void refresh(EDIT* e, int cursor, int from)
+{
+	int len, start = columns(e, from), end;
+	char* out = (char*) malloc(2*(e->len - from) + 3*EDIT_MOVE_SIZE);
+
+	if (out == NULL)
+		return;
+	len = move(e, out, cursor, start);
+	len += render(e->buf + from, e->len - from, out+len);
+	end = start + width(e->buf + from, e->len - from);
+	len += finish(e, out+len, end, columns(e, e->point));
+	put(out, len);
+	free(out);
+}
+
+static void move_to(EDIT* e, int point)
+{
+	char out[EDIT_MOVE_SIZE];
+	int from = columns(e, e->point);
+
+	e->point = point;
+	put(out, move(e, out, from, columns(e, point)));
+}
+
+static int set_line(EDIT* e, const char* s)
+{
+	int len = strlen(s);
+
+	if (len+1 > e->cap)
+	{
+		char* newbuf = (char*) realloc(e->buf, len+1);
+		error(newbuf == NULL, -1);
+		e->buf = newbuf;
+		e->cap = len+1;
+	}
+	strcpy(e->buf, s);
+	e->len = e->point = len;
+	return 0;
+}
+
+static int insert(EDIT* e, const char* s, int n)
+{
+	int cursor = columns(e, e->point);
+
+	if (e->len + n + 1 > e->cap)
+	{
+		int newcap = e->cap;
+		char* newbuf;
+
+		while (e->len + n + 1 > newcap)
+			newcap *= 2;
+		newbuf = (char*) realloc(e->buf, newcap);
+		error(newbuf == NULL, -1);
+		e->buf = newbuf;
+		e->cap = newcap;
+	}
+	memmove(e->buf + e->point + n, e->buf + e->point, e->len - e->point + 1);
+	memcpy(e->buf + e->point, s, n);
+	e->len += n;
+	e->point += n;
+	refresh(e, cursor, e->point - n);
+	return 0;
+}
+
+/* Takes [from, to) out of the line, and keeps it for Ctrl-Y when save is set. */
+
+static int delete_text(EDIT* e, int from, int to, int save)
+{
+	int cursor = columns(e, e->point);
+
+	if (from >= to)
+		return 0;
+	if (save)
+	{
+		char* kill = (char*) realloc(e->kill, to - from);
+		error(kill == NULL, -1);
+		e->kill = kill;
+		e->klen = to - from;
+		memcpy(e->kill, e->buf + from, to - from);
+	}
+	memmove(e->buf + from, e->buf + to, e->len - to + 1);
+	e->len -= to - from;
+	e->point = from;
+	refresh(e, cursor, from);
+	return 0;
+}
+
+/* The character before and after p, UTF-8 sequences taken whole. */
+
+static int char_before(EDIT* e, int p)
+{
+	while (p > 0 && (e->buf[--p] & 0xc0) == 0x80)
+		;
+	return p;
+}
+
+static int char_after(EDIT* e, int p)
+{
+	while (p < e->len && (e->buf[++p] & 0xc0) == 0x80)
+		;
+	return p;
+}
+
+static int blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static int word_before(EDIT* e, int p)
+{
+	while (p > 0 && blank(e->buf[p-1]))
+		p--;
+	while (p > 0 && !blank(e->buf[p-1]))
+		p--;
+	return p;
+}
+
+static int word_after(EDIT* e, int p)
+{
+	while (p < e->len && blank(e->buf[p]))
+		p++;
+	while (p < e->len && !blank(e->buf[p]))
+		p++;
+	return p;
+}
+
+/* Lists the candidates under the line, then draws the prompt and the line again. */
+
+static void show_completions(EDIT* e, char** matches, int n)
+{
+	char count[64];
+	int i;
+
+	put(count, move(e, count, columns(e, e->point), e->drawn));
+	put("\n", 1);
+	if (n > SLSH_COMPLETE_MAX)
+	{
+		sprintf(count, "[more than %d candidates]", SLSH_COMPLETE_MAX);
+		put(count, strlen(count));
+	}
+	for (i = 0; i < n && n <= SLSH_COMPLETE_MAX; i++)
+	{
+		put(matches[i], strlen(matches[i]));
+		put(i+1 < n ? "  " : "", i+1 < n ? 2 : 0);
+	}
+	put("\n", 1);
+	e->row = e->drawn = 0;
+	redraw(e);
+}
+
+/* Adds what all the candidates for the word before the cursor have in common, and a blank after */
+/* the only one. Lists them if there was nothing to add. */
+
+static int complete_word(EDIT* e)
+{
+	char** matches;
+	int start, n, common, i, ret = 0;
+
+	matches = e->complete(e->buf, e->point, &start);
+	if (matches == NULL || matches[0] == NULL)
+	{
+		put("\a", 1);
+		free(matches);
+		return 0;
+	}
+
+	common = strlen(matches[0]);
+	for (n = 1; matches[n] != NULL; n++)
+		for (i = 0; i < common; i++)
+			if (matches[n][i] != matches[0][i])
+				common = i;
+
+	if (common > e->point - start)
+		ret = insert(e, matches[0] + e->point - start, common - (e->point - start));
+	else if (n > 1)
+		show_completions(e, matches, n);
+	if (ret == 0 && n == 1 && matches[0][common-1] != '/')
+		ret = insert(e, " ", 1);
+
+	for (i = 0; i < n; i++)
+		free(matches[i]);
+	free(matches);
+	return ret;
+}
+
+/* ------- HISTORY ------- */
+
+/* Up puts the entry before the one shown in the line, Down the one after it, and Down past the */
+/* newest brings back what was being typed. */
+
+static int history_move(EDIT* e, int older)
+{
+	char* entry;
+	long pos;
+
+	if (e->search == NULL || (!older && e->nhist == 0))
+	{
+		put("\a", 1);
+		return 0;
+	}
+	if (older)
+	{
+		pos = e->nhist > 0 ? e->hist[e->nhist-1] : SLSH_HISTORY_END;
+		entry = e->search("", &pos);
+		if (entry == NULL)
+		{
+			put("\a", 1);
+			return 0;
+		}
+		if (e->nhist == e->hcap)
+		{
+			long* hist = (long*) realloc(e->hist, sizeof(long)*(2*e->hcap + 8));
+			error(hist == NULL, (free(entry), -1));
+			e->hist = hist;
+			e->hcap = 2*e->hcap + 8;
+		}
+		if (e->nhist == 0)
+		{
+			free(e->edited);
+			e->edited = (char*) malloc(e->len+1);
+			error(e->edited == NULL, (free(entry), -1));
+			strcpy(e->edited, e->buf);
+		}
+		e->hist[e->nhist++] = pos;
+	}
+	else if (--e->nhist > 0)
+	{
+		pos = e->hist[e->nhist-1] + 1;
+		entry = e->search("", &pos);
+		if (entry == NULL)		/* The file was cut short under us. */
+		{
+			put("\a", 1);
+			return 0;
+		}
+	}
+	else
+	{
+		entry = e->edited;
+		e->edited = NULL;
+	}
+	if (set_line(e, entry) < 0)
+	{
+		free(entry);
+		return -1;
+	}
+	free(entry);
+	redraw(e);
+	return 0;
+}
+
+/* ------- REVERSE SEARCH ------- */
+
+/* Looks for the query in the entries that start before pos. */
+
+static void search_from(EDIT* e, long pos)
+{
+	char* match;
+
+	e->failed = 0;
+	if (e->qlen == 0)
+	{
+		free(e->match);
+		e->match = NULL;
+		return;
+	}
+	e->query[e->qlen] = '\0';
+	match = e->search(e->query, &pos);
+	if (match == NULL)
+	{
+		e->failed = 1;
+		put("\a", 1);
+		return;
+	}
+	free(e->match);
+	e->match = match;
+	e->pos = pos;
+}
+
+static void end_search(EDIT* e, int keep)
+{
+	if (keep && e->match != NULL)
+		set_line(e, e->match);
+	free(e->match);
+	e->match = NULL;
+	e->searching = 0;
+	redraw(e);
+}
+
+/* Returns 1 when the line is done. */
+
+static int search_key(EDIT* e, unsigned char c)
+{
+	if (c == KEY_CTRL('R'))
+		search_from(e, e->match != NULL ? e->pos : SLSH_HISTORY_END);
+	else if (c == KEY_BACKSPACE || c == KEY_CTRL('H'))
+	{
+		if (e->qlen > 0)
+			e->qlen--;
+		search_from(e, SLSH_HISTORY_END);
+	}
+	else if (c >= ' ' && e->qlen+1 < EDIT_QUERY_SIZE)
+	{
+		e->query[e->qlen++] = c;
+		search_from(e, e->match != NULL ? e->pos+1 : SLSH_HISTORY_END);
+	}
+	else if (c == KEY_CTRL('G'))
+	{
+		end_search(e, 0);
+		return 0;
+	}
+	else if (c == KEY_CTRL('C'))
+	{
+		end_search(e, 0);
+		return -1;
+	}
+	else
+	{
+		end_search(e, 1);
+		return c == '\r' || c == '\n' ? 1 : key(e, c);		/* The key works on what was found. */
+	}
+	redraw(e);
+	return 0;
+}
+
+/* ------- KEYS ------- */
+
+/* The last byte of ESC [ ... or ESC O ...: arrows, Home, End and Delete. Ctrl or Alt with the */
+/* left and right arrows moves by words. */
+
+static int sequence_key(EDIT* e, unsigned char c)
+{
+	int word = e->narg > 0 && e->arg[1] > 1;
+
+	switch (c)
+	{
+		case 'A':
+			return history_move(e, 1);
+		case 'B':
+			return history_move(e, 0);
+		case 'C':
+			move_to(e, word ? word_after(e, e->point) : char_after(e, e->point));
+			break;
+		case 'D':
+			move_to(e, word ? word_before(e, e->point) : char_before(e, e->point));
+			break;
+		case 'H':
+			move_to(e, 0);
+			break;
+		case 'F':
+			move_to(e, e->len);
+			break;
+		case '~':
+			if (e->arg[0] == 1 || e->arg[0] == 7)
+				move_to(e, 0);
+			else if (e->arg[0] == 4 || e->arg[0] == 8)
+				move_to(e, e->len);
+			else if (e->arg[0] == 3)
+				return delete_text(e, e->point, char_after(e, e->point), 0);
+			break;
+	}
+	return 0;
+}
+
+/* The key after ESC alone: Alt-b, Alt-f, Alt-d and Alt-Backspace work on words. */
+
+static int meta_key(EDIT* e, unsigned char c)
+{
+	e->esc = 0;
+	e->narg = e->arg[0] = e->arg[1] = 0;
+	if (c == '[' || c == 'O')
+		e->esc = c == '[' ? 2 : 3;
+	else if (c == 'b')
+		move_to(e, word_before(e, e->point));
+	else if (c == 'f')
+		move_to(e, word_after(e, e->point));
+	else if (c == 'd')
+		return delete_text(e, e->point, word_after(e, e->point), 1);
+	else if (c == KEY_BACKSPACE)
+		return delete_text(e, word_before(e, e->point), e->point, 1);
+	return 0;
+}
+
+/* Returns 1 when the line is done, -1 when it is dropped. */
+
+static int key(EDIT* e, unsigned char c)
+{
+	if (e->searching)
+		return search_key(e, c);
+
+	if (e->esc == 1)
+		return meta_key(e, c) < 0;
+	if (e->esc >= 2)
+	{
+		if (c >= '0' && c <= '9' && e->esc == 2)
+			e->arg[e->narg] = 10*e->arg[e->narg] + c - '0';
+		else if (c == ';' && e->esc == 2)
+			e->narg = 1;
+		else if (c >= 0x40 && c <= 0x7e)
+		{
+			e->esc = 0;
+			return sequence_key(e, c) < 0;
+		}
+		return 0;
+	}
+
+	switch (c)
+	{
+		case KEY_ESC:
+			e->esc = 1;
+			return 0;
+		case '\r':
+		case '\n':
+			return 1;
+		case KEY_CTRL('C'):
+			return -1;
+		case KEY_CTRL('D'):
+			if (e->len == 0)
+			{
+				e->eof = 1;
+				return 1;
+			}
+			return delete_text(e, e->point, char_after(e, e->point), 0) < 0;
+		case KEY_BACKSPACE:
+		case KEY_CTRL('H'):
+			return delete_text(e, char_before(e, e->point), e->point, 0) < 0;
+		case KEY_CTRL('A'):
+			move_to(e, 0);
+			return 0;
+		case KEY_CTRL('E'):
+			move_to(e, e->len);
+			return 0;
+		case KEY_CTRL('B'):
+			move_to(e, char_before(e, e->point));
+			return 0;
+		case KEY_CTRL('F'):
+			move_to(e, char_after(e, e->point));
+			return 0;
+		case KEY_CTRL('P'):
+			return history_move(e, 1) < 0;
+		case KEY_CTRL('N'):
+			return history_move(e, 0) < 0;
+		case KEY_CTRL('K'):
+			return delete_text(e, e->point, e->len, 1) < 0;
+		case KEY_CTRL('U'):
+			return delete_text(e, 0, e->point, 1) < 0;
+		case KEY_CTRL('W'):
+			return delete_text(e, word_before(e, e->point), e->point, 1) < 0;
+		case KEY_CTRL('Y'):
+			return e->klen > 0 && insert(e, e->kill, e->klen) < 0;
+		case KEY_CTRL('L'):
+			put("\033[H\033[2J", 7);
+			e->row = e->drawn = 0;
+			redraw(e);
+			return 0;
+		case KEY_CTRL('R'):
+			if (e->search == NULL)
+				return 0;
+			e->searching = 1;
+			e->qlen = 0;
+			e->failed = 0;
+			redraw(e);
+			return 0;
+		case '\t':
+			if (e->complete != NULL)
+				return complete_word(e) < 0;
+			break;
+	}
+	if (c >= ' ' || c == '\t')
+		return insert(e, (char*) &c, 1) < 0;
+	return 0;
+}
+
+char* edit_line(const char* prompt, COMPLETER complete, SEARCHER search, int* eof)
+{
+	struct termios saved, raw;
+	struct winsize size;
+	char out[EDIT_MOVE_SIZE];
+	int n, done = 0;
+	EDIT e;
+
+	*eof = 0;
+	fflush(stdout);
+	if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0)
+	{
+		char* line;
+
+		printf("%s", prompt);
+		fflush(stdout);
+		line = read_line();
+		*eof = line == NULL && feof(stdin);
+		return line;
+	}
+
+	memset(&e, 0, sizeof(EDIT));
+	e.prompt = prompt;
+	e.prompt_cols = width(prompt, strlen(prompt));
+	e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : EDIT_DEFAULT_COLS;
+	e.complete = complete;
+	e.search = search;
+	e.cap = INITIAL_EDIT_CAP;
+	e.buf = (char*) malloc(e.cap);
+	error(e.buf == NULL, NULL);
+	e.buf[0] = '\0';
+
+	raw = saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+	put(prompt, strlen(prompt));
+	n = finish(&e, out, e.prompt_cols, e.prompt_cols);
+	put(out, n);
+
+	while (!done)
+	{
+		if (input_pos == input_len)
+		{
+			n = read(STDIN_FILENO, input, sizeof(input));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				e.eof = e.len == 0;
+				break;
+			}
+			input_pos = 0;
+			input_len = n;
+		}
+		while (input_pos < input_len && !done)
+			done = key(&e, input[input_pos++]);
+	}
+
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+	put(out, move(&e, out, columns(&e, e.point), e.drawn));		/* Below the whole line. */
+	free(e.match);
+	free(e.kill);
+	free(e.hist);
+	free(e.edited);
+	if (done < 0)
+	{
+		put("^C", 2);
+		e.len = 0;
+		input_pos = input_len = 0;		/* What was typed ahead goes with the line. */
+	}
+	*eof = e.eof;
+	if (!*eof)
+		put("\n", 1);
+	if (e.len == 0)
+	{
+		free(e.buf);
+		return NULL;
+	}
+	return e.buf;
+}
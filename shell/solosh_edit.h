@@ -0,0 +1,40 @@
+/*   solosh_edit.h - line editor header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_EDIT_H
+#define SOLOSH_EDIT_H
+
+typedef char** (*COMPLETER)(const char* line, int point, int* start);	/* See complete(). */
+typedef char* (*SEARCHER)(const char* query, long* pos);				/* See history_search(). */
+
+/* Reads a line from the terminal in raw mode, with the prompt in front of it. The cursor moves */
+/* with the arrows, Home, End, Ctrl-A, Ctrl-E, Ctrl-B and Ctrl-F, and by words with Alt-b,     */
+/* Alt-f or Ctrl and the arrows. Ctrl-K, Ctrl-U, Ctrl-W, Alt-d and Alt-Backspace cut text that  */
+/* Ctrl-Y puts back. Up and Down (Ctrl-P, Ctrl-N) go through the history with search. TAB      */
+/* completes the word before the cursor with complete, showing the candidates when it can't    */
+/* pick one, and Ctrl-R searches backwards through the history as the query is typed (Ctrl-R    */
+/* again for an older match, Enter runs it, Ctrl-G gives up, other keys keep it for editing).  */
+/* Ctrl-C drops the line and Ctrl-D on an empty line is the end of input. Each key sends one   */
+/* write to the terminal, just what changed when it can. When stdin is not a terminal it prints */
+/* the prompt and falls back to read_line(). Returns the line, or NULL for an empty line or,    */
+/* with *eof set, at the end of input.                                                          */
+
+char* edit_line(const char* prompt, COMPLETER complete, SEARCHER search, int* eof);
+
+#endif
@@ -0,0 +1,199 @@
+/*   solosh_fanout.c - pipeline fan-out
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE				/* tee() and splice() */
+#include <fcntl.h>
+#include <signal.h>
+#include <solosh_errors.h>
+#include <solosh_fanout.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FANOUT_CHUNK (1 << 20)
+
+static int write_all(int fd, const char* buf, ssize_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, char* buf, ssize_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Moves exactly len bytes from in to out, or throws them away if out is gone. */
+
+static int move_all(int in, int out, int* alive, ssize_t len, char* buf)
+{
+	ssize_t n;
+
+	while (len > 0 && *alive)
+	{
+		n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EPIPE)
+			*alive = 0;
+		else if (n <= 0)
+			return -1;
+		else
+			len -= n;
+	}
+	while (len > 0)
+	{
+		n = len < FANOUT_CHUNK ? len : FANOUT_CHUNK;
+		if (read_all(in, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+int fanout(int in, const int* out, int n)
+{
+	int* alive, i, first, last, ret = -1;
+	ssize_t len, k, *sent;
+	char* buf;
+
+	signal(SIGPIPE, SIG_IGN);		/* A consumer that exits just stops getting data. */
+
+	alive = (int*) malloc(sizeof(int)*n);
+	sent = (ssize_t*) malloc(sizeof(ssize_t)*n);
+	buf = (char*) malloc(FANOUT_CHUNK);
+	if (alive == NULL || sent == NULL || buf == NULL)
+	{
+		free(alive);
+		free(sent);
+		free(buf);
+		error(1, -1);
+	}
+	for (i = 0; i < n; i++)
+		alive[i] = 1;
+
+	for (;;)
+	{
+		for (first = 0; first < n && !alive[first]; first++)
+			;
+		for (last = n-1; last >= 0 && !alive[last]; last--)
+			;
+		if (last < 0)
+		{
+			ret = 0;
+			break;
+		}
+
+		if (first == last)				/* One consumer left: just move everything. */
+		{
+			len = splice(in, NULL, out[last], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno == EPIPE)
+			{
+				alive[last] = 0;
+				continue;
+			}
+			if (len <= 0)
+			{
+				ret = len == 0 ? 0 : -1;
+				break;
+			}
+			continue;
+		}
+
+		/* The first live consumer decides how much goes this round. The others, but the last, */
+		/* get the same bytes with tee, and the last one gets them by consuming the input.     */
+		len = tee(in, out[first], FANOUT_CHUNK, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EPIPE)
+		{
+			alive[first] = 0;
+			continue;
+		}
+		if (len <= 0)
+		{
+			ret = len == 0 ? 0 : -1;
+			break;
+		}
+		sent[first] = len;
+
+		k = len;
+		for (i = first+1; i < last; i++)
+		{
+			sent[i] = len;
+			if (!alive[i])
+				continue;
+			while ((sent[i] = tee(in, out[i], len, 0)) < 0 && errno == EINTR)
+				;
+			if (sent[i] < 0)
+			{
+				alive[i] = 0;
+				sent[i] = len;
+			}
+			if (sent[i] < k)
+				k = sent[i];
+		}
+
+		if (k == len)
+		{
+			if (move_all(in, out[last], &alive[last], len, buf) < 0)
+				break;
+			continue;
+		}
+
+		/* Someone only took part of the chunk; tee can't resume in the middle of it. */
+		if (read_all(in, buf, len) < 0)
+			break;
+		for (i = first+1; i < last; i++)
+			if (alive[i] && sent[i] < len && write_all(out[i], buf + sent[i], len - sent[i]) < 0)
+				alive[i] = 0;
+		if (alive[last] && write_all(out[last], buf, len) < 0)
+			alive[last] = 0;
+	}
+
+	free(alive);
+	free(sent);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,32 @@
+/*   solosh_fanout.h - pipeline fan-out header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_FANOUT_H
+#define SOLOSH_FANOUT_H
+
+#define SLSH_FANOUT "|+"			/* 'producer |+ consumer1 |+ consumer2' */
+
+/* Copies everything read from the pipe in to each of the n pipes in out[] with tee(2), and     */
+/* moves it into the last one with splice(2), so the data stays in the kernel. Only when a slow */
+/* consumer takes part of a chunk does that chunk go through a buffer. Consumers that go away   */
+/* are dropped. Returns 0 at end of input, or -1 on error.                                      */
+
+int fanout(int in, const int* out, int n);
+
+#endif
@@ -0,0 +1,495 @@
+/*   solosh_glob.c - pathname expansion
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE				/* syscall() and struct dirent64 */
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <solosh_errors.h>
+#include <solosh_glob.h>
+#include <solosh_parser.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define GETDENTS_BUFFER_SIZE 65536
+#define INITIAL_NAMES_CAP 64
+#define INITIAL_BLOCK_CAP 4096
+#define INITIAL_MATCHES_CAP 16
+
+/* A directory listing, sorted. names[i] points into block. */
+
+typedef struct dir_listing
+{
+	char* path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim, ctim;
+	char** names;
+	char* block;
+	int n;
+	unsigned long lastuse;
+}DIR_LISTING;
+
+typedef struct matches
+{
+	char** v;
+	int n, cap;
+}MATCHES;
+
+typedef struct sort_key
+{
+	char* key;
+	char* name;
+}SORT_KEY;
+
+static DIR_LISTING cache[SLSH_GLOB_CACHE_SIZE];
+static unsigned long clock_tick = 0;
+
+/* ------- DIRECTORY LISTINGS ------- */
+
+static void free_listing(DIR_LISTING* l)
+{
+	free(l->path);
+	free(l->names);
+	free(l->block);
+	memset(l, 0, sizeof(DIR_LISTING));
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+	return strcmp(((const SORT_KEY*) a)->key, ((const SORT_KEY*) b)->key);
+}
+
+/* Sorts the names once by their strxfrm() keys, so that every match taken from the listing */
+/* afterwards is already in collation order. */
+
+static int sort_listing(DIR_LISTING* l)
+{
+	SORT_KEY* keys;
+	int i, j;
+	size_t len;
+
+	if (l->n < 2)
+		return 0;
+
+	keys = (SORT_KEY*) malloc(sizeof(SORT_KEY)*l->n);
+	error(keys == NULL, -1);
+
+	for (i = 0; i < l->n; i++)
+	{
+		len = strxfrm(NULL, l->names[i], 0) + 1;
+		keys[i].name = l->names[i];
+		keys[i].key = (char*) malloc(len);
+		if (keys[i].key == NULL)
+		{
+			for (j = 0; j < i; j++)
+				free(keys[j].key);
+			free(keys);
+			error(1, -1);
+		}
+		strxfrm(keys[i].key, l->names[i], len);
+	}
+
+	qsort(keys, l->n, sizeof(SORT_KEY), compare_keys);
+
+	for (i = 0; i < l->n; i++)
+	{
+		l->names[i] = keys[i].name;
+		free(keys[i].key);
+	}
+	free(keys);
+	return 0;
+}
+
+/* Reads the whole directory with getdents64, skipping "." and "..". */
+
+static int read_listing(int fd, DIR_LISTING* l)
+{
+	char* buf, *newblock;
+	struct dirent64* d;
+	long nread, pos;
+	size_t used = 0, cap = INITIAL_BLOCK_CAP, len;
+	size_t* offsets = NULL, *newoffsets;
+	int noffsets = 0, capoffsets = INITIAL_NAMES_CAP, i;
+
+	buf = (char*) malloc(GETDENTS_BUFFER_SIZE);
+	l->block = (char*) malloc(cap);
+	offsets = (size_t*) malloc(sizeof(size_t)*capoffsets);
+	if (buf == NULL || l->block == NULL || offsets == NULL)
+	{
+		free(buf);
+		free(offsets);
+		error(1, -1);
+	}
+
+	while ((nread = syscall(SYS_getdents64, fd, buf, GETDENTS_BUFFER_SIZE)) > 0)
+	{
+		for (pos = 0; pos < nread; pos += d->d_reclen)
+		{
+			d = (struct dirent64*) (buf + pos);
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+
+			len = strlen(d->d_name) + 1;
+			if (used + len > cap)
+			{
+				while (used + len > cap)
+					cap *= 2;
+				newblock = (char*) realloc(l->block, cap);
+				error(newblock == NULL, (free(buf), (free(offsets), -1)));
+				l->block = newblock;
+			}
+			if (noffsets == capoffsets)
+			{
+				capoffsets *= 2;
+				newoffsets = (size_t*) realloc(offsets, sizeof(size_t)*capoffsets);
+				error(newoffsets == NULL, (free(buf), (free(offsets), -1)));
+				offsets = newoffsets;
+			}
+			memcpy(l->block + used, d->d_name, len);
+			offsets[noffsets++] = used;
+			used += len;
+		}
+	}
+	free(buf);
+	error(nread < 0, (free(offsets), -1));
+
+	l->names = (char**) malloc(sizeof(char*)*(noffsets+1));
+	error(l->names == NULL, (free(offsets), -1));
+	for (i = 0; i < noffsets; i++)
+		l->names[i] = l->block + offsets[i];	/* The block doesn't move anymore. */
+	l->n = noffsets;
+	free(offsets);
+
+	return sort_listing(l);
+}
+
+static int same_dir(const DIR_LISTING* l, const struct stat* st)
+{
+	return l->dev == st->st_dev && l->ino == st->st_ino &&
+		   l->mtim.tv_sec == st->st_mtim.tv_sec && l->mtim.tv_nsec == st->st_mtim.tv_nsec &&
+		   l->ctim.tv_sec == st->st_ctim.tv_sec && l->ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Returns the sorted listing of path, from the cache if the directory hasn't changed since it */
+/* was read. Returns NULL if path is not a readable directory. */
+
+static DIR_LISTING* get_listing(const char* path)
+{
+	struct stat st;
+	DIR_LISTING* l, *victim = NULL;
+	int i, fd;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	for (i = 0; i < SLSH_GLOB_CACHE_SIZE; i++)
+	{
+		l = &cache[i];
+		if (l->path != NULL && !strcmp(l->path, path))
+		{
+			if (same_dir(l, &st))
+			{
+				l->lastuse = ++clock_tick;
+				return l;
+			}
+			victim = l;			/* Stale, read it again into the same slot. */
+			break;
+		}
+		if (victim == NULL || (victim->path != NULL && (l->path == NULL || l->lastuse < victim->lastuse)))
+			victim = l;
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return NULL;
+
+	free_listing(victim);
+	if (fstat(fd, &st) < 0 || read_listing(fd, victim) < 0)
+	{
+		close(fd);
+		free_listing(victim);
+		return NULL;
+	}
+	close(fd);
+
+	victim->path = (char*) malloc(strlen(path)+1);
+	error(victim->path == NULL, (free_listing(victim), NULL));
+	strcpy(victim->path, path);
+	victim->dev = st.st_dev;
+	victim->ino = st.st_ino;
+	victim->mtim = st.st_mtim;
+	victim->ctim = st.st_ctim;
+	victim->lastuse = ++clock_tick;
+	return victim;
+}
+
+char** glob_listing(const char* path, int* n)
+{
+	DIR_LISTING* l = get_listing(path);
+
+	if (l == NULL)
+		return NULL;
+	*n = l->n;
+	return l->names;
+}
+
+void glob_cache_clear()
+{
+	int i;
+
+	for (i = 0; i < SLSH_GLOB_CACHE_SIZE; i++)
+		free_listing(&cache[i]);
+}
+
+/* ------- MATCHING ------- */
+
+static int has_glob_chars(const char* s, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (strchr(SLSH_GLOB_CHARS, s[i]) != NULL)
+			return 1;
+	return 0;
+}
+
+static int add_match(MATCHES* m, const char* path)
+{
+	if (m->n == m->cap)
+	{
+		int newcap = m->cap > 0 ? 2*m->cap : INITIAL_MATCHES_CAP;
+		char** newv = (char**) realloc(m->v, sizeof(char*)*newcap);
+		error(newv == NULL, -1);
+		m->v = newv;
+		m->cap = newcap;
+	}
+	m->v[m->n] = (char*) malloc(strlen(path)+1);
+	error(m->v[m->n] == NULL, -1);
+	strcpy(m->v[m->n++], path);
+	return 0;
+}
+
+/* Expands pattern (what is left of it) relative to base, which is empty or ends with '/'. */
+/* Components without glob characters are appended as they are. */
+
+static int expand(const char* base, const char* pattern, MATCHES* m)
+{
+	const char* slash, *rest;
+	char* comp, *path;
+	DIR_LISTING* l;
+	int clen, blen = strlen(base), i, ret = 0;
+
+	slash = strchr(pattern, '/');
+	clen = slash != NULL ? slash - pattern : (int) strlen(pattern);
+	rest = slash != NULL ? slash + 1 : NULL;
+	while (rest != NULL && *rest == '/')
+		rest++;
+
+	if (!has_glob_chars(pattern, clen))
+	{
+		struct stat st;
+
+		path = (char*) malloc(blen + clen + 2);
+		error(path == NULL, -1);
+		memcpy(path, base, blen);
+		memcpy(path + blen, pattern, clen);
+		path[blen+clen] = '\0';
+
+		if (rest == NULL || *rest == '\0')
+		{
+			if (rest != NULL)
+				strcat(path, "/");
+			if (lstat(path, &st) == 0)
+				ret = add_match(m, path);
+		}
+		else
+		{
+			strcat(path, "/");
+			ret = expand(path, rest, m);
+		}
+		free(path);
+		return ret;
+	}
+
+	comp = (char*) malloc(clen + 1);
+	error(comp == NULL, -1);
+	memcpy(comp, pattern, clen);
+	comp[clen] = '\0';
+
+	l = get_listing(blen > 0 ? base : ".");
+	for (i = 0; l != NULL && i < l->n && ret == 0; i++)
+	{
+		if (fnmatch(comp, l->names[i], FNM_PERIOD) != 0)
+			continue;
+
+		path = (char*) malloc(blen + strlen(l->names[i]) + 2);
+		error(path == NULL, (free(comp), -1));
+		strcpy(path, base);
+		strcat(path, l->names[i]);
+
+		if (rest == NULL)
+			ret = add_match(m, path);
+		else
+		{
+			strcat(path, "/");
+			if (*rest == '\0')
+			{
+				struct stat st;
+				if (stat(path, &st) == 0)		/* 'pattern/' only matches directories. */
+					ret = add_match(m, path);
+			}
+			else
+				ret = expand(path, rest, m);
+		}
+		free(path);
+		l = get_listing(blen > 0 ? base : ".");	/* The recursion may have evicted it. Normally a cache hit. */
+	}
+	free(comp);
+	return ret;
+}
+
+static void free_matches(MATCHES* m)
+{
+	int i;
+
+	for (i = 0; i < m->n; i++)
+		free(m->v[i]);
+	free(m->v);
+	m->v = NULL;
+	m->n = m->cap = 0;
+}
+
+/* ------- INTERFACE ------- */
+
+char** glob_words(char** words)
+{
+	MATCHES* found;
+	char** ret, *block, *p;
+	int nwords, i, j, total = 0, nret = 0;
+	size_t size = 0;
+
+	if (words == NULL || words[0] == NULL)
+		return words;
+
+	for (nwords = 0; words[nwords] != NULL; nwords++)
+		;
+	for (i = 0; i < nwords; i++)
+		if (has_glob_chars(words[i], strlen(words[i])))
+			break;
+	if (i == nwords)
+		return words;
+
+	found = (MATCHES*) calloc(nwords, sizeof(MATCHES));
+	error(found == NULL, (free(words[0]), (free(words), NULL)));
+
+	for (i = 0; i < nwords; i++)
+	{
+		if (has_glob_chars(words[i], strlen(words[i])))
+		{
+			if (words[i][0] == '/')
+				j = expand("/", words[i] + 1, &found[i]);
+			else
+				j = expand("", words[i], &found[i]);
+			if (j < 0)
+				break;
+		}
+		if (found[i].n == 0)
+			j = add_match(&found[i], words[i]);
+		if (j < 0)
+			break;
+		total += found[i].n;
+		for (j = 0; j < found[i].n; j++)
+			size += strlen(found[i].v[j]) + 1;
+	}
+
+	ret = NULL;
+	block = NULL;
+	if (i == nwords)
+	{
+		ret = (char**) malloc(sizeof(char*)*(total+1));
+		block = (char*) malloc(size);
+	}
+	if (ret != NULL && block != NULL)
+	{
+		p = block;
+		for (i = 0; i < nwords; i++)
+		{
+			for (j = 0; j < found[i].n; j++)
+			{
+				strcpy(p, found[i].v[j]);
+				ret[nret++] = p;
+				p += strlen(p) + 1;
+			}
+		}
+		ret[nret] = NULL;		/* ret[0] == block, as in split_around_blank. */
+	}
+	else
+	{
+		free(ret);
+		free(block);
+		ret = NULL;
+	}
+
+	for (i = 0; i < nwords; i++)
+		free_matches(&found[i]);
+	free(found);
+	free(words[0]);
+	free(words);
+	error(ret == NULL, NULL);
+	return ret;
+}
+
+char** split_around_blank(const char* str)
+{
+	return glob_words(split_words(str));
+}
+
+char*** make_cmd_array(const char* command)
+{
+	char*** ret = make_cmd_words(command), ***iter;
+
+	if (ret == NULL)
+		return NULL;
+
+	for (iter = ret; *iter != NULL; iter++)
+	{
+		*iter = glob_words(*iter);
+		if (*iter == NULL)
+		{
+			for (iter++; *iter != NULL; iter++)
+			{
+				free(**iter);
+				free(*iter);
+			}
+			for (iter = ret; *iter != NULL; iter++)
+			{
+				free(**iter);
+				free(*iter);
+			}
+			free(ret);
+			return NULL;
+		}
+	}
+	return ret;
+}
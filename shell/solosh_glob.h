@@ -0,0 +1,39 @@
+/*   solosh_glob.h - pathname expansion header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_GLOB_H
+#define SOLOSH_GLOB_H
+
+#define SLSH_GLOB_CHARS "*?["
+#define SLSH_GLOB_CACHE_SIZE 8		/* Number of directory listings kept between globs. */
+
+/* Directory listings are cached, already sorted, and are reused for as long as the directory's */
+/* device, inode, mtime and ctime stay the same, so globbing the same directory over and over   */
+/* (e.g. in a script loop) only costs a stat() per directory.                                    */
+
+char** glob_words(char** words);	/* Expands the words of a split_around_blank array (see there for the */
+									/* layout). The old array is freed. Patterns that match nothing are kept. */
+char** glob_listing(const char* path, int* n);	/* The cached names in directory path, in collation order, or */
+												/* NULL. Valid until the next call into this module. */
+void glob_cache_clear();
+
+char** split_around_blank(const char* str);		/* split_words, then glob_words. */
+char*** make_cmd_array(const char* command);	/* make_cmd_words, with the globs of each command expanded. */
+
+#endif
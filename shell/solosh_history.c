@@ -0,0 +1,296 @@
+/*   solosh_history.c - command history
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE				/* memmem() */
+#include <fcntl.h>
+#include <solosh_errors.h>
+#include <solosh_history.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HISTORY_BLOCK 4096					/* Bytes of the file per filter. */
+#define HISTORY_FILTER_BITS 4096
+#define HISTORY_FILTER_BYTES (HISTORY_FILTER_BITS / 8)
+#define HISTORY_ESCAPE '\\'
+
+typedef struct history
+{
+	int fd;									/* O_APPEND. */
+	char* map;
+	size_t mapped;							/* Bytes of the file in map. */
+	size_t indexed;							/* Entries that end past this aren't in the filters yet. */
+	size_t from;							/* Nor are those that start in the blocks before this one. */
+	unsigned char* filters;					/* HISTORY_FILTER_BYTES for each block. */
+	size_t nblocks;
+}HISTORY;
+
+static HISTORY history = {-1, NULL, 0, 0, 0, NULL, 0};
+
+static unsigned trigram_bit(const char* s)
+{
+	const unsigned char* p = (const unsigned char*) s;
+	unsigned long t = (unsigned long) p[0] << 16 | (unsigned long) p[1] << 8 | p[2];
+
+	return (unsigned) ((t * 2654435761UL) >> 16) % HISTORY_FILTER_BITS;
+}
+
+/* Maps the file as it is now, if it changed size. */
+
+static int map_history()
+{
+	struct stat st;
+	char* map;
+
+	if (fstat(history.fd, &st) < 0)
+		return -1;
+	if ((size_t) st.st_size < history.mapped)		/* Truncated: start over. */
+	{
+		munmap(history.map, history.mapped);
+		history.map = NULL;
+		history.mapped = history.indexed = history.from = 0;
+		if (history.filters != NULL)
+			memset(history.filters, 0, history.nblocks * HISTORY_FILTER_BYTES);
+	}
+	if ((size_t) st.st_size <= history.mapped)
+		return 0;
+	map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	if (history.map != NULL)
+		munmap(history.map, history.mapped);
+	history.map = map;
+	history.mapped = st.st_size;
+	return 0;
+}
+
+static void add_entry(unsigned char* filter, size_t start, size_t end)
+{
+	unsigned bit;
+
+	for (; start + 2 < end; start++)
+	{
+		bit = trigram_bit(history.map + start);
+		filter[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/* Makes room for the filters of the whole file, and puts the entries added since the last search */
+/* in them. The first time, only where the last whole entry ends is found: older blocks are      */
+/* indexed as searches get to them, newest first.                                                */
+
+static int index_history()
+{
+	size_t nblocks = (history.mapped + HISTORY_BLOCK - 1) / HISTORY_BLOCK, p = history.indexed;
+	unsigned char* newfilters;
+	const char* eol;
+
+	if (nblocks > history.nblocks)
+	{
+		newfilters = (unsigned char*) realloc(history.filters, nblocks * HISTORY_FILTER_BYTES);
+		error(newfilters == NULL, -1);
+		memset(newfilters + history.nblocks * HISTORY_FILTER_BYTES, 0, (nblocks - history.nblocks) * HISTORY_FILTER_BYTES);
+		history.filters = newfilters;
+		history.nblocks = nblocks;
+	}
+
+	if (history.indexed == 0 && history.from == 0)
+	{
+		for (p = history.mapped; p > 0 && history.map[p-1] != '\n'; p--)
+			;
+		history.indexed = p;
+		history.from = (p + HISTORY_BLOCK - 1) / HISTORY_BLOCK;
+		return 0;
+	}
+
+	while (p < history.mapped && (eol = (const char*) memchr(history.map + p, '\n', history.mapped - p)) != NULL)
+	{
+		add_entry(history.filters + (p / HISTORY_BLOCK) * HISTORY_FILTER_BYTES, p, eol - history.map);
+		p = eol - history.map + 1;
+	}
+	history.indexed = p;					/* Up to the last whole entry: another shell may be writing. */
+	return 0;
+}
+
+/* The first entry that starts at or after p. */
+
+static size_t entry_start(size_t p)
+{
+	const char* eol;
+
+	if (p == 0 || history.map[p-1] == '\n')
+		return p;
+	eol = (const char*) memchr(history.map + p, '\n', history.indexed - p);
+	return eol != NULL ? (size_t) (eol - history.map + 1) : history.indexed;
+}
+
+/* Indexes the entries that start in block, below history.from. */
+
+static void index_block(size_t block)
+{
+	size_t p = entry_start(block * HISTORY_BLOCK), end = (block+1) * HISTORY_BLOCK;
+	const char* eol;
+
+	if (end > history.indexed)
+		end = history.indexed;
+	while (p < end)
+	{
+		eol = (const char*) memchr(history.map + p, '\n', history.indexed - p);
+		add_entry(history.filters + block * HISTORY_FILTER_BYTES, p, eol - history.map);
+		p = eol - history.map + 1;
+	}
+	history.from = block;
+}
+
+int history_open(const char* path)
+{
+	history_close();
+	history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	error(history.fd < 0, -1);
+	return map_history();
+}
+
+int history_add(const char* entry)
+{
+	int len = strlen(entry), n = 0, i;
+	char* record;
+	ssize_t w;
+
+	if (history.fd < 0 || len == 0)
+		return 0;
+	record = (char*) malloc(2*len + 2);
+	error(record == NULL, -1);
+	for (i = 0; i < len; i++)
+	{
+		if (entry[i] == '\n' || entry[i] == HISTORY_ESCAPE)
+		{
+			record[n++] = HISTORY_ESCAPE;
+			record[n++] = entry[i] == '\n' ? 'n' : HISTORY_ESCAPE;
+		}
+		else
+			record[n++] = entry[i];
+	}
+	record[n++] = '\n';
+
+	while ((w = write(history.fd, record, n)) < 0 && errno == EINTR)		/* One write is one record. */
+		;
+	free(record);
+	error(w < 0, -1);
+	return 0;
+}
+
+static char* decode(const char* s, int len)
+{
+	char* entry = (char*) malloc(len+1);
+	int i, n = 0;
+
+	error(entry == NULL, NULL);
+	for (i = 0; i < len; i++)
+	{
+		if (s[i] == HISTORY_ESCAPE && i+1 < len)
+			entry[n++] = s[++i] == 'n' ? '\n' : s[i];
+		else
+			entry[n++] = s[i];
+	}
+	entry[n] = '\0';
+	return entry;
+}
+
+/* The newest entry with query in it that starts in [start, end). */
+
+static long search_block(const char* query, int qlen, size_t start, size_t end)
+{
+	const char* map = history.map, *eol;
+	long found = -1;
+
+	start = entry_start(start);
+	while (start < end)
+	{
+		eol = (const char*) memchr(map + start, '\n', history.indexed - start);
+		if (memmem(map + start, eol - (map + start), query, qlen) != NULL)
+			found = start;
+		start = eol - map + 1;
+	}
+	return found;
+}
+
+char* history_search(const char* query, long* pos)
+{
+	int qlen = strlen(query), nbits, i, j;
+	char* q;
+	unsigned* bits;
+	size_t before, block, end;
+	const unsigned char* filter;
+	long found = -1;
+
+	if (history.fd < 0 || map_history() < 0 || index_history() < 0)
+		return NULL;
+
+	q = (char*) malloc(2*qlen + 1);			/* Escaped, like the entries in the file. */
+	bits = (unsigned*) malloc(sizeof(unsigned)*(2*qlen + 1));
+	if (q == NULL || bits == NULL)
+	{
+		free(q);
+		free(bits);
+		error(1, NULL);
+	}
+	for (i = j = 0; i < qlen; i++)
+	{
+		if (query[i] == '\n' || query[i] == HISTORY_ESCAPE)
+			q[j++] = HISTORY_ESCAPE;
+		q[j++] = query[i] == '\n' ? 'n' : query[i];
+	}
+	qlen = j;
+	for (nbits = 0; nbits + 2 < qlen; nbits++)
+		bits[nbits] = trigram_bit(q + nbits);
+
+	before = *pos < 0 || (size_t) *pos > history.indexed ? history.indexed : (size_t) *pos;
+	for (block = (before + HISTORY_BLOCK - 1) / HISTORY_BLOCK; block-- > 0 && found < 0; )
+	{
+		if (block < history.from)
+			index_block(block);
+		filter = history.filters + block * HISTORY_FILTER_BYTES;
+		for (i = 0; i < nbits && (filter[bits[i] / 8] & 1 << (bits[i] % 8)); i++)
+			;
+		if (i < nbits)
+			continue;
+		end = (block+1) * HISTORY_BLOCK < before ? (block+1) * HISTORY_BLOCK : before;
+		found = search_block(q, qlen, block * HISTORY_BLOCK, end);
+	}
+	free(q);
+	free(bits);
+	if (found < 0)
+		return NULL;
+
+	*pos = found;
+	return decode(history.map + found, (const char*) memchr(history.map + found, '\n', history.indexed - found) - (history.map + found));
+}
+
+void history_close()
+{
+	if (history.map != NULL)
+		munmap(history.map, history.mapped);
+	free(history.filters);
+	if (history.fd >= 0)
+		close(history.fd);
+	memset(&history, 0, sizeof(HISTORY));
+	history.fd = -1;
+}
@@ -0,0 +1,43 @@
+/*   solosh_history.h - command history header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_HISTORY_H
+#define SOLOSH_HISTORY_H
+
+#define SLSH_HISTFILE_VAR "HISTFILE"
+#define SLSH_HISTFILE_DEFAULT ".solosh_history"		/* In $HOME, when $HISTFILE is not set. */
+#define SLSH_HISTORY_END -1L						/* Search from the newest entry on. */
+
+/* The history file holds one entry per line, with '\' and newlines escaped as "\\" and "\n".   */
+/* Each entry is appended with a single write to a descriptor opened with O_APPEND, so shells   */
+/* sharing the file don't mix their entries. The file is mapped, not read, when the shell       */
+/* starts. Every 4 KiB block of it gets a bit filter of the trigrams of the entries that start  */
+/* in it, and a search only looks inside the blocks whose filter has all of the trigrams of the */
+/* query. Blocks are indexed when a search first gets to them, newest first, and entries added  */
+/* later, by any shell, when the next search sees them.                                         */
+
+int history_open(const char* path);
+int history_add(const char* entry);
+char* history_search(const char* query, long* pos);		/* The newest entry that has query in it and */
+														/* starts before *pos, or NULL. *pos is set  */
+														/* to where it starts. The entry is malloc'd. */
+														/* An empty query matches any entry.         */
+void history_close();
+
+#endif
@@ -0,0 +1,366 @@
+/*   solosh_parallel.c - parallel script execution
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <solosh_compile.h>
+#include <solosh_errors.h>
+#include <solosh_parallel.h>
+#include <solosh_parser.h>
+#include <solosh_vars.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define INITIAL_NODES_CAP 64
+#define INITIAL_DEPENDENTS_CAP 4
+#define COPY_BUFFER_SIZE 65536
+
+enum
+{
+	NODE_WAITING = 0,
+	NODE_RUNNING,
+	NODE_DONE
+};
+
+typedef struct node
+{
+	char* label;			/* NULL for unlabelled nodes. */
+	char* command;
+	int line;
+	int waiting_for;		/* Dependencies that haven't finished yet. */
+	int* dependents;
+	int ndependents, capdependents;
+	int state, status;
+	pid_t pid;
+	FILE* out;				/* Buffered output, written in script order. */
+}NODE;
+
+typedef struct graph
+{
+	NODE* v;
+	int n, cap;
+	int barrier_lo, barrier_hi;		/* Nodes of the segment before the last barrier. */
+}GRAPH;
+
+/* ------- GRAPH ------- */
+
+static void destroy_graph(GRAPH* g)
+{
+	int i;
+
+	for (i = 0; i < g->n; i++)
+	{
+		free(g->v[i].label);
+		free(g->v[i].command);
+		free(g->v[i].dependents);
+		if (g->v[i].out != NULL)
+			fclose(g->v[i].out);
+	}
+	free(g->v);
+}
+
+static int add_edge(GRAPH* g, int from, int to)
+{
+	NODE* dep = &g->v[from];
+
+	if (dep->ndependents == dep->capdependents)
+	{
+		int newcap = dep->capdependents > 0 ? 2*dep->capdependents : INITIAL_DEPENDENTS_CAP;
+		int* newv = (int*) realloc(dep->dependents, sizeof(int)*newcap);
+		error(newv == NULL, -1);
+		dep->dependents = newv;
+		dep->capdependents = newcap;
+	}
+	dep->dependents[dep->ndependents++] = to;
+	g->v[to].waiting_for++;
+	return 0;
+}
+
+static char* copy_range(const char* s, int len)
+{
+	char* ret = (char*) malloc(sizeof(char)*(len+1));
+
+	error(ret == NULL, NULL);
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static int find_label(const GRAPH* g, const char* label, int len)
+{
+	int i;
+
+	for (i = 0; i < g->n; i++)
+		if (g->v[i].label != NULL && (int) strlen(g->v[i].label) == len && !strncmp(g->v[i].label, label, len))
+			return i;
+	return -1;
+}
+
+/* Adds the node for one line (already trimmed) of the script. */
+
+static int add_node(GRAPH* g, const char* line, int lineno)
+{
+	NODE* node;
+	const char* p = line, *deps = NULL, *end;
+	int idx, i, len, dep;
+
+	if (g->n == g->cap)
+	{
+		int newcap = g->cap > 0 ? 2*g->cap : INITIAL_NODES_CAP;
+		NODE* newv = (NODE*) realloc(g->v, sizeof(NODE)*newcap);
+		error(newv == NULL, -1);
+		g->v = newv;
+		g->cap = newcap;
+	}
+	idx = g->n;
+	node = &g->v[idx];
+	memset(node, 0, sizeof(NODE));
+	node->line = lineno;
+
+	if (*p == SLSH_LABEL)
+	{
+		len = strcspn(p+1, "(:" SLSH_BLANK_CHARS);
+		end = p+1+len;
+		if (*end == '(')
+		{
+			deps = end+1;
+			end = strchr(deps, ')');
+			if (end != NULL)
+				end++;
+		}
+		if (len == 0 || end == NULL || *end != ':')
+		{
+			printf("Line %d: expected '@NAME: COMMAND' or '@NAME(DEPS): COMMAND'.\n", lineno);
+			return -1;
+		}
+		if (find_label(g, p+1, len) >= 0)
+		{
+			printf("Line %d: label '%.*s' is already used.\n", lineno, len, p+1);
+			return -1;
+		}
+		node->label = copy_range(p+1, len);
+		error(node->label == NULL, -1);
+		p = end+1;
+		p += strspn(p, SLSH_BLANK_CHARS);
+	}
+
+	node->command = copy_range(p, strlen(p));
+	if (node->command == NULL)
+	{
+		free(node->label);
+		error(1, -1);
+	}
+	g->n++;
+
+	for (i = g->barrier_lo; i < g->barrier_hi; i++)
+		error(add_edge(g, i, idx) < 0, -1);
+
+	while (deps != NULL && *(deps += strspn(deps, SLSH_BLANK_CHARS)) != ')')
+	{
+		len = strcspn(deps, ")" SLSH_BLANK_CHARS);
+		dep = find_label(g, deps, len);
+		if (dep < 0 || dep == idx)
+		{
+			printf("Line %d: '%.*s' is not the label of an earlier line.\n", lineno, len, deps);
+			return -1;
+		}
+		error(add_edge(g, dep, idx) < 0, -1);
+		deps += len;
+	}
+	return 0;
+}
+
+static int build_graph(GRAPH* g, const char* text)
+{
+	const char* line = text, *eol;
+	char* copy, *p;
+	int lineno = 1, len, ret = 0, segment = 0;
+
+	while (*line != '\0' && ret == 0)
+	{
+		eol = strchr(line, '\n');
+		if (eol == NULL)
+			eol = line + strlen(line);
+
+		copy = copy_range(line, eol-line);
+		error(copy == NULL, -1);
+		p = copy + strspn(copy, SLSH_BLANK_CHARS);
+		len = strlen(p);
+		while (len > 0 && strchr(SLSH_BLANK_CHARS, p[len-1]) != NULL)
+			p[--len] = '\0';
+
+		if (!strcmp(p, SLSH_BARRIER))
+		{
+			if (segment < g->n)			/* An empty segment leaves the last barrier in place. */
+			{
+				g->barrier_lo = segment;
+				g->barrier_hi = segment = g->n;
+			}
+		}
+		else if (*p != '\0' && *p != SLSH_COMMENT)
+			ret = add_node(g, p, lineno);
+
+		free(copy);
+		line = *eol != '\0' ? eol+1 : eol;
+		lineno++;
+	}
+	return ret;
+}
+
+/* ------- SCHEDULING ------- */
+
+static pid_t start_node(NODE* node, int (*run)(const char* command))
+{
+	pid_t pid;
+	int null, status;
+
+	node->out = tmpfile();
+	error(node->out == NULL, -1);
+
+	fflush(stdout);					/* Otherwise the child would write it again. */
+	pid = fork();
+	error(pid < 0, -1);
+
+	if (pid == 0)
+	{
+		null = open("/dev/null", O_RDONLY);		/* Nodes don't compete for the terminal. */
+		if (null >= 0)
+		{
+			dup2(null, 0);
+			close(null);
+		}
+		dup2(fileno(node->out), 1);
+		dup2(fileno(node->out), 2);
+
+		status = run(node->command);
+		fflush(stdout);
+		exit(status);
+	}
+	return pid;
+}
+
+static void write_output(NODE* node)
+{
+	char buf[COPY_BUFFER_SIZE];
+	size_t n;
+
+	if (node->out == NULL)
+		return;
+
+	rewind(node->out);
+	while ((n = fread(buf, 1, sizeof(buf), node->out)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fflush(stdout);
+	fclose(node->out);
+	node->out = NULL;
+}
+
+static int run_graph(GRAPH* g, int (*run)(const char* command))
+{
+	int i, j, running = 0, next_output = 0, failed = -1, maxrunning, status;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* limit = var_get(SLSH_PARALLEL_VAR);
+	pid_t pid;
+	NODE* node;
+
+	maxrunning = limit != NULL && atoi(limit) > 0 ? atoi(limit) : ncpu > 0 ? (int) ncpu : 1;
+
+	for (;;)
+	{
+		for (i = 0; i < g->n && running < maxrunning && failed < 0; i++)
+		{
+			node = &g->v[i];
+			if (node->state != NODE_WAITING || node->waiting_for > 0)
+				continue;
+			node->pid = start_node(node, run);
+			if (node->pid < 0)
+			{
+				node->state = NODE_DONE;
+				node->status = 1;
+				failed = i;
+				break;
+			}
+			node->state = NODE_RUNNING;
+			running++;
+		}
+
+		if (running == 0)
+			break;
+
+		while ((pid = waitpid(-1, &status, 0)) < 0 && errno == EINTR)
+			;
+		if (pid < 0)
+			break;
+
+		for (i = 0; i < g->n && (g->v[i].state != NODE_RUNNING || g->v[i].pid != pid); i++)
+			;
+		if (i == g->n)
+			continue;
+
+		node = &g->v[i];
+		node->state = NODE_DONE;
+		running--;
+		if (WIFEXITED(status))
+			node->status = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status))
+			node->status = 128 + WTERMSIG(status);
+
+		if (node->status != 0)
+		{
+			if (failed < 0)
+				failed = i;
+		}
+		else
+			for (j = 0; j < node->ndependents; j++)
+				g->v[node->dependents[j]].waiting_for--;
+
+		while (next_output < g->n && g->v[next_output].state == NODE_DONE)
+			write_output(&g->v[next_output++]);
+	}
+
+	for (i = next_output; i < g->n; i++)		/* Only after a failure: whatever ran, in order. */
+		if (g->v[i].state == NODE_DONE)
+			write_output(&g->v[i]);
+
+	if (failed < 0)
+		return 0;
+
+	node = &g->v[failed];
+	printf("Line %d%s%s failed with status %d, stopped.\n", node->line, node->label != NULL ? ", @" : "",
+		   node->label != NULL ? node->label : "", node->status);
+	return node->status != 0 ? node->status : 1;
+}
+
+/* ------- INTERFACE ------- */
+
+int run_parallel_script(const char* text, int (*run)(const char* command))
+{
+	GRAPH g;
+	int ret;
+
+	memset(&g, 0, sizeof(GRAPH));
+	if (build_graph(&g, text) < 0)
+		ret = 2;
+	else
+		ret = run_graph(&g, run);
+	destroy_graph(&g);
+	return ret;
+}
@@ -0,0 +1,42 @@
+/*   solosh_parallel.h - parallel script execution header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_PARALLEL_H
+#define SOLOSH_PARALLEL_H
+
+#define SLSH_LABEL '@'
+#define SLSH_BARRIER "---"
+#define SLSH_PARALLEL_VAR "PARALLEL_JOBS"		/* Overrides the number of CPUs. */
+
+/* In a parallel script every non-blank, non-comment line is a node of a dependency graph:    */
+/*                                                                                            */
+/*     @NAME: COMMAND                 a node other lines can depend on                        */
+/*     @NAME(DEP DEP...): COMMAND     a node that runs after the nodes labelled DEP...        */
+/*     COMMAND                        an unlabelled node                                      */
+/*     ---                            a barrier: what follows runs after everything before it */
+/*                                                                                            */
+/* Dependencies must be labelled earlier in the script. Ready nodes run concurrently, one     */
+/* forked shell each, at most one per CPU (or $PARALLEL_JOBS). Each node's output is buffered */
+/* and written in script order. No new node starts after one fails.                           */
+
+int run_parallel_script(const char* text, int (*run)(const char* command));		/* run is called in the */
+																					/* node's process. Returns the */
+																					/* first failed status, or 0. */
+
+#endif
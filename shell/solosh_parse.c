@@ -0,0 +1,196 @@
+/*   solosh_parse.c - reentrant parser API
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <solosh_fanout.h>
+#include <solosh_parse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct slsh_parser
+{
+	char error[SLSH_PARSE_ERROR_SIZE];
+};
+
+SLSH_PARSER* slsh_parser_create()
+{
+	return (SLSH_PARSER*) calloc(1, sizeof(SLSH_PARSER));
+}
+
+void slsh_parser_destroy(SLSH_PARSER** parser)
+{
+	if (parser == NULL)
+		return;
+	free(*parser);
+	*parser = NULL;
+}
+
+const char* slsh_parser_error(const SLSH_PARSER* parser)
+{
+	return parser->error;
+}
+
+static void destroy_pipeline(SLSH_PIPELINE* pl)
+{
+	int i;
+
+	for (i = 0; i < pl->ncmd; i++)
+	{
+		if (pl->cmd[i].argv != NULL)
+			free(pl->cmd[i].argv[0]);
+		free(pl->cmd[i].argv);
+		destroy_redirs(pl->cmd[i].redir, pl->cmd[i].nredir);
+	}
+	free(pl->cmd);
+}
+
+void slsh_line_destroy(SLSH_LINE** line)
+{
+	int i;
+
+	if (line == NULL || *line == NULL)
+		return;
+	for (i = 0; i < (*line)->npipeline; i++)
+		destroy_pipeline(&(*line)->pipeline[i]);
+	free((*line)->pipeline);
+	free(*line);
+	*line = NULL;
+}
+
+static int out_of_memory(SLSH_PARSER* parser)
+{
+	snprintf(parser->error, sizeof(parser->error), "Error: %s", strerror(ENOMEM));
+	return -1;
+}
+
+/* Parses text[0..len), one command of a pipeline, into cmd. */
+
+static int parse_command(SLSH_PARSER* parser, const char* text, int len, SLSH_COMMAND* cmd)
+{
+	char* copy, *clean;
+
+	copy = (char*) malloc(sizeof(char)*(len+1));
+	if (copy == NULL)
+		return out_of_memory(parser);
+	memcpy(copy, text, len);
+	copy[len] = '\0';
+
+	cmd->nredir = get_redirs_r(copy, &cmd->redir, parser->error, sizeof(parser->error));
+	if (cmd->nredir < 0)
+	{
+		cmd->nredir = 0;
+		cmd->redir = NULL;
+		free(copy);
+		return -1;
+	}
+	clean = clean_command(copy);
+	free(copy);
+	if (clean == NULL)
+		return out_of_memory(parser);
+	cmd->argv = split_words(clean);
+	free(clean);
+	if (cmd->argv == NULL)
+		return out_of_memory(parser);
+
+	for (cmd->argc = 0; cmd->argv[cmd->argc] != NULL; cmd->argc++)
+		;
+	if (cmd->argc == 0)
+	{
+		snprintf(parser->error, sizeof(parser->error), "Syntax error: empty command around '%s'.", SLSH_PIPE);
+		return -1;
+	}
+	return 0;
+}
+
+/* Splits item at each '|' and '|+'. */
+
+static int parse_pipeline(SLSH_PARSER* parser, const char* item, SLSH_PIPELINE* pl)
+{
+	SLSH_COMMAND* newcmd;
+	int start = 0, i, len, branch = 0, cap = 0;
+
+	pl->background = !is_blocking(item);
+	for (i = 0; ; i++)
+	{
+		if (!strncmp(item+i, SLSH_SUBST_OPEN, strlen(SLSH_SUBST_OPEN)) && (len = subst_length(item+i)) > 0)
+		{
+			i += len-1;					/* Its '|'s are its own. */
+			continue;
+		}
+		if (item[i] != '\0' && item[i] != SLSH_PIPE[0])
+			continue;
+
+		if (pl->ncmd == cap)
+		{
+			cap = cap > 0 ? 2*cap : 2;
+			newcmd = (SLSH_COMMAND*) realloc(pl->cmd, sizeof(SLSH_COMMAND)*cap);
+			if (newcmd == NULL)
+				return out_of_memory(parser);
+			pl->cmd = newcmd;
+		}
+		memset(&pl->cmd[pl->ncmd], 0, sizeof(SLSH_COMMAND));
+		pl->cmd[pl->ncmd].branch = branch;
+		if (parse_command(parser, item+start, i-start, &pl->cmd[pl->ncmd++]) < 0)
+			return -1;
+
+		if (item[i] == '\0')
+			break;
+		if (!strncmp(item+i, SLSH_FANOUT, strlen(SLSH_FANOUT)))
+		{
+			branch++;
+			i += strlen(SLSH_FANOUT) - 1;
+		}
+		start = i+1;
+	}
+	return 0;
+}
+
+SLSH_LINE* slsh_parse(SLSH_PARSER* parser, const char* line)
+{
+	SLSH_LINE* ret;
+	CMD_LIST* list;
+	int i;
+
+	parser->error[0] = '\0';
+	ret = (SLSH_LINE*) calloc(1, sizeof(SLSH_LINE));
+	list = make_cmd_list(line);
+	if (ret == NULL || list == NULL)
+	{
+		free(ret);
+		destroy_cmd_list(&list);
+		out_of_memory(parser);
+		return NULL;
+	}
+
+	ret->pipeline = (SLSH_PIPELINE*) calloc(list->n > 0 ? list->n : 1, sizeof(SLSH_PIPELINE));
+	if (ret->pipeline == NULL)
+	{
+		out_of_memory(parser);
+		slsh_line_destroy(&ret);
+	}
+	for (i = 0; ret != NULL && i < list->n; i++)
+	{
+		ret->npipeline++;
+		ret->pipeline[i].op = list->op[i];
+		if (parse_pipeline(parser, list->item[i], &ret->pipeline[i]) < 0)
+			slsh_line_destroy(&ret);
+	}
+	destroy_cmd_list(&list);
+	return ret;
+}
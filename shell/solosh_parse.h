@@ -0,0 +1,63 @@
+/*   solosh_parse.h - reentrant parser API header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_PARSE_H
+#define SOLOSH_PARSE_H
+
+#include <solosh_parser.h>
+
+/* The parser of libsolosh-parse, for programs that parse command lines in several threads at */
+/* once. Nothing here touches global state: each thread uses its own SLSH_PARSER, and what a  */
+/* parse returns belongs to the caller. Errors are kept in the parser instead of printed.     */
+/*                                                                                            */
+/* Words are split but not expanded: no variables, no globs. A here-document's lines are not  */
+/* on the line, so its REDIR has the end word in filename and a NULL body.                    */
+
+typedef struct slsh_parser SLSH_PARSER;
+
+typedef struct slsh_command
+{
+	char** argv;			/* NULL-terminated. The words share the block argv[0] points to. */
+	int argc;
+	REDIR* redir;			/* In the order they appear. */
+	int nredir;
+	int branch;				/* 0 before any '|+', b after the b-th one. */
+}SLSH_COMMAND;
+
+typedef struct slsh_pipeline
+{
+	SLSH_COMMAND* cmd;
+	int ncmd;
+	int op;					/* SLSH_SEQ, SLSH_AND or SLSH_OR: how it depends on the previous pipeline. */
+	int background;			/* Ended by '&'. */
+}SLSH_PIPELINE;
+
+typedef struct slsh_line
+{
+	SLSH_PIPELINE* pipeline;
+	int npipeline;
+}SLSH_LINE;
+
+SLSH_PARSER* slsh_parser_create();
+void slsh_parser_destroy(SLSH_PARSER** parser);
+SLSH_LINE* slsh_parse(SLSH_PARSER* parser, const char* line);		/* NULL on error. */
+const char* slsh_parser_error(const SLSH_PARSER* parser);			/* Why the last slsh_parse failed. */
+void slsh_line_destroy(SLSH_LINE** line);
+
+#endif
@@ -16,18 +16,23 @@
      You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE				/* memfd_create() */
+#include <ctype.h>
 #include <fcntl.h>
 #include <solosh_errors.h>
 #include <solosh_parser.h>
+#include <solosh_scan.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define INITIAL_TOKEN_ARRAY_CAP 10
 #define INITIAL_LINE_CAP 10
 
-static const int nbcmd = 6;
-static const char* builtin_cmd[] = {"bg", "cd", "exit", "fg", "jobs", "quit"};
+static const int nbcmd = 12;
+static const char* builtin_cmd[] = {"bg", "cd", "coproc", "exec", "exit", "export", "fg", "jobs", "pwd", "quit", "unset", "wait"};
 
 char* read_line()
 {
@@ -76,17 +81,7 @@ int get_builtin_cmd(const char* cmd)
 
 static int is_blank(char c)
 {
-	char blank[] = SLSH_BLANK_CHARS;
-	int i, len;
-
-	len = strlen(blank);
-
-	for (i = 0; i < len; i++)
-	{
-		if (c == blank[i])
-			return 1;
-	}
-	return 0;
+	return c == ' ' || c == '\t';		/* SLSH_BLANK_CHARS */
 }
 
 static char* trim_front(const char* str)
@@ -104,39 +99,49 @@ static char* trim_front(const char* str)
 	return ret;
 }
 
-char** split_around_blank(const char* str)
+char** split_words(const char* str)
 {
 	int captok = INITIAL_TOKEN_ARRAY_CAP, ntok = 0;
-	char** s, *cpstr;
+	char** s, *cpstr, *p;
 
 	if (str == NULL)
 		return NULL;
 
 	cpstr = trim_front(str);
-	error(cpstr == NULL, NULL);
+	if (cpstr == NULL)
+		return NULL;
 	
 	s = (char**) malloc(sizeof(char*)*captok);
-	error(s == NULL, (free(cpstr), NULL));
+	if (s == NULL)
+		return (free(cpstr), NULL);
 
-	s[ntok++] = strtok(cpstr, SLSH_BLANK_CHARS);
-	while ((s[ntok++] = strtok(NULL, SLSH_BLANK_CHARS)) != NULL)
+	p = cpstr;
+	while (*p != '\0')
 	{
-		if (ntok == captok)
+		if (ntok+1 == captok)
 		{
 			char** new_s;
 
 			captok*=2;
 			new_s = (char**) realloc(s, sizeof(char*)*captok);
-			error(new_s == NULL, (free(cpstr),(free(s),  NULL)));
+			if (new_s == NULL)
+				return (free(cpstr), (free(s), NULL));
 			s = new_s;
 		}
+		s[ntok++] = p;
+		p = (char*) scan(p, SCAN_BLANK);
+		while (is_blank(*p))
+			*p++ = '\0';
 	}
+	s[ntok] = NULL;
+	if (ntok == 0)
+		free(cpstr);
 	return s;
 }
 
-char*** make_cmd_array(const char* command)
+char*** make_cmd_words(const char* command)
 {
-	char** aux, *cpcommand, ***ret;
+	char** aux, *cpcommand, ***ret, *save;
 	int len, nprog = 0, i;
 
 	if (command == NULL)
@@ -148,17 +153,17 @@ char*** make_cmd_array(const char* command)
 	error(cpcommand == NULL, NULL);
 	strcpy(cpcommand, command);
 
-	aux = (char**) malloc(sizeof(char*)*len);
+	aux = (char**) malloc(sizeof(char*)*(len+2));		/* At most len tokens, plus the final NULL strtok returns twice. */
 	error(aux == NULL, (free(cpcommand),  NULL));
 
-	aux[nprog++] = strtok(cpcommand, SLSH_PIPE);
-	while ((aux[nprog++] = strtok(NULL, SLSH_PIPE)) != NULL);
+	aux[nprog++] = strtok_r(cpcommand, SLSH_PIPE, &save);
+	while ((aux[nprog++] = strtok_r(NULL, SLSH_PIPE, &save)) != NULL);
 
 	ret = (char***) malloc(sizeof(char**)*(nprog+1));
 	error(ret == NULL, (free(cpcommand),(free(aux), NULL)));
 
 	for (i = 0; i < nprog; i++)
-		ret[i] = split_around_blank(aux[i]);
+		ret[i] = split_words(aux[i]);
 	
 	ret[nprog] = NULL;
 	free(aux);
@@ -195,34 +200,43 @@ void print_job_cmd(char*** cmd)
 
 int get_io_redir_file(const char* command, int io)
 {
-	int i = 0, len, fnsize = 0, file;
 	char* filename;
+	int file;
 
-	if (io != SLSH_INPUT && io != SLSH_OUTPUT)
+	filename = get_io_redir_filename(command, io);
+	if (filename == NULL)
 		return -1;
+
+	file = open_io_redir_file(filename, io);
+	free(filename);
+	return file;
+}
+
+char* get_io_redir_filename(const char* command, int io)
+{
+	int i = 0, len, fnsize = 0;
+	char* filename;
+
+	if (io != SLSH_INPUT && io != SLSH_OUTPUT)
+		return NULL;
 	
 	len = strlen(command);
-	filename = (char*) malloc(sizeof(char)*(len+1));
-	error(filename == NULL, -1);
 
 	while (i < len && command[i] != io)
 		i++;
 	
 	if (i == len)
-	{
-		free(filename);
-		return -1;
-	}
+		return NULL;
 
 	i++;
 	while (i < len && is_blank(command[i]))
 		i++;
 	
 	if (i == len)
-	{
-		free(filename);
-		return -1;
-	}
+		return NULL;
+
+	filename = (char*) malloc(sizeof(char)*(strlen(command+i)+1));
+	error(filename == NULL, NULL);
 
 	while (i < len && !is_blank(command[i]))
 	{
@@ -231,14 +245,261 @@ int get_io_redir_file(const char* command, int io)
 	}
 
 	filename[fnsize] = '\0';
+	return filename;
+}
 
+int open_io_redir_file(const char* filename, int io)
+{
 	if (io == SLSH_INPUT)
-		file = open(filename, O_RDONLY);
+		return open(filename, O_RDONLY);
+	return open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+}
+
+/* If the redirection operator at command[i] has a descriptor number in front of it, returns where */
+/* the number starts, otherwise i. */
+
+static int redir_start(const char* command, int i)
+{
+	int j = i;
+
+	while (j > 0 && isdigit((unsigned char) command[j-1]))
+		j--;
+	if (j < i && (j == 0 || is_blank(command[j-1])))
+		return j;
+	return i;
+}
+
+/* Returns where the redirection at command[i] ends, -1 if it is malformed or -2 if memory ran out. */
+
+static int parse_redir(const char* command, int i, REDIR* r)
+{
+	int start = redir_start(command, i), len;
+	int here_string = !strncmp(command+i, SLSH_HERE_STRING, strlen(SLSH_HERE_STRING));
+
+	r->filename = r->body = NULL;
+	r->target = -1;
+	r->fd = start < i ? atoi(command+start) : command[i] == SLSH_INPUT ? 0 : 1;
+	if (r->fd > SLSH_MAX_FD)
+		return -1;
+
+	if (here_string)
+	{
+		r->op = REDIR_HERE;
+		i += strlen(SLSH_HERE_STRING) - 1;
+	}
+	else if (!strncmp(command+i, SLSH_HERE_DOC, strlen(SLSH_HERE_DOC)))
+	{
+		r->op = REDIR_HERE;
+		i += strlen(SLSH_HERE_DOC) - 1;
+	}
+	else if (command[i] == SLSH_INPUT)
+		r->op = REDIR_IN;
+	else if (command[i+1] == SLSH_OUTPUT)
+	{
+		r->op = REDIR_APPEND;
+		i++;
+	}
 	else
-		file = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	
-	free(filename);
-	return file;	
+		r->op = REDIR_OUT;
+	i++;
+
+	if (command[i] == SLSH_DUP_FD && r->op != REDIR_HERE)
+	{
+		i++;
+		if (command[i] == SLSH_CLOSE_FD)
+		{
+			r->op = REDIR_CLOSE;
+			return i+1;
+		}
+		if (r->op == REDIR_APPEND || !isdigit((unsigned char) command[i]))
+			return -1;
+		r->op = REDIR_DUP;
+		r->target = atoi(command+i);
+		while (isdigit((unsigned char) command[i]))
+			i++;
+		return r->target > SLSH_MAX_FD ? -1 : i;
+	}
+
+	while (is_blank(command[i]))
+		i++;
+	len = strcspn(command+i, SLSH_BLANK_CHARS "<>&|;");
+	if (len == 0)
+		return -1;
+	r->filename = (char*) malloc(sizeof(char)*(len+2));
+	if (r->filename == NULL)
+		return -2;
+	memcpy(r->filename, command+i, len);
+	r->filename[len] = '\0';
+
+	if (here_string)				/* The word and a newline. */
+	{
+		r->body = r->filename;
+		r->filename = NULL;
+		strcat(r->body, "\n");
+	}
+	return i+len;
+}
+
+int get_redirs(const char* command, REDIR** redirs)
+{
+	char err[SLSH_PARSE_ERROR_SIZE];
+	int n = get_redirs_r(command, redirs, err, sizeof(err));
+
+	if (n < 0)
+		printf("%s\n", err);
+	return n;
+}
+
+int get_redirs_r(const char* command, REDIR** redirs, char* err, int errsize)
+{
+	int i = 0, n = 0, cap = 0, next;
+	REDIR* v = NULL, *newv;
+
+	while (command[i] != '\0')
+	{
+		if (command[i] != SLSH_INPUT && command[i] != SLSH_OUTPUT)
+		{
+			i++;
+			continue;
+		}
+
+		if (n == cap)
+		{
+			cap = cap > 0 ? 2*cap : 2;
+			newv = (REDIR*) realloc(v, sizeof(REDIR)*cap);
+			if (newv == NULL)
+			{
+				snprintf(err, errsize, "Error: %s", strerror(errno));
+				destroy_redirs(v, n);
+				return -1;
+			}
+			v = newv;
+		}
+		next = parse_redir(command, i, &v[n]);
+		if (next == -2)
+		{
+			snprintf(err, errsize, "Error: %s", strerror(ENOMEM));
+			destroy_redirs(v, n);
+			return -1;
+		}
+		if (next < 0)
+		{
+			snprintf(err, errsize, "Syntax error: bad redirection near '%s'.", command+redir_start(command, i));
+			destroy_redirs(v, n);
+			return -1;
+		}
+		n++;
+		i = next;
+	}
+
+	*redirs = v;
+	return n;
+}
+
+void destroy_redirs(REDIR* redirs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		free(redirs[i].filename);
+		free(redirs[i].body);
+	}
+	free(redirs);
+}
+
+int open_redir_file(const REDIR* redir)
+{
+	switch (redir->op)
+	{
+		case REDIR_IN:
+			return open(redir->filename, O_RDONLY | O_CLOEXEC);
+		case REDIR_OUT:
+			return open(redir->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		case REDIR_APPEND:
+			return open(redir->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		default:
+			return -1;
+	}
+}
+
+const char* find_here_doc(const char* command, int* len)
+{
+	const char* p = command;
+
+	while ((p = strstr(p, SLSH_HERE_DOC)) != NULL)
+	{
+		if (!strncmp(p, SLSH_HERE_STRING, strlen(SLSH_HERE_STRING)))
+		{
+			p += strlen(SLSH_HERE_STRING);
+			continue;
+		}
+		p += strlen(SLSH_HERE_DOC);
+		while (is_blank(*p))
+			p++;
+		*len = strcspn(p, SLSH_BLANK_CHARS "<>&|;");
+		return *len > 0 ? p : NULL;
+	}
+	return NULL;
+}
+
+char* get_here_body(const char** text, const char* word, int len)
+{
+	const char* line = *text, *eol;
+	char* body;
+
+	for (;;)
+	{
+		eol = strchr(line, '\n');
+		if (eol == NULL)
+			eol = line + strlen(line);
+		if (eol - line == len && !strncmp(line, word, len))
+			break;
+		if (*eol == '\0')
+			return NULL;
+		line = eol+1;
+	}
+
+	body = (char*) malloc(sizeof(char)*(line - *text + 1));
+	error(body == NULL, NULL);
+	memcpy(body, *text, line - *text);
+	body[line - *text] = '\0';
+	*text = *eol != '\0' ? eol+1 : eol;
+	return body;
+}
+
+int make_here_file(const char* body)
+{
+	int fd, high;
+	size_t len = strlen(body);
+	ssize_t n;
+
+	fd = memfd_create("solosh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	error(fd < 0, -1);
+
+	while (len > 0)
+	{
+		n = write(fd, body, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		error(n < 0, (close(fd), -1));
+		body += n;
+		len -= n;
+	}
+	error(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0, (close(fd), -1));
+
+	high = fcntl(fd, F_DUPFD_CLOEXEC, SLSH_MAX_FD+1);		/* Out of the way of 'exec N>...'. */
+	close(fd);
+	error(high < 0, -1);
+	return high;
+}
+
+int open_here_file(int here)
+{
+	char path[32];
+
+	sprintf(path, "/proc/self/fd/%d", here);
+	return open(path, O_RDONLY | O_CLOEXEC);
 }
 
 int is_blocking(const char* command)
@@ -256,24 +517,144 @@ int is_blocking(const char* command)
 
 char* clean_command(const char* command)
 {
-	int len = strlen(command), i = 0;
-	char* ret, *rret;
-	
+	int len;
+	char* ret;
+
+	len = scan(command, SCAN_REDIR | SCAN_AMP) - command;
+	if (command[len] == SLSH_INPUT || command[len] == SLSH_OUTPUT)
+		len = redir_start(command, len);		/* The '2' of '2>file' is not an argument. */
+
 	ret = (char*) malloc(sizeof(char)*(len+1));
-	error(ret == NULL, NULL);
+	if (ret == NULL)
+		return NULL;
+	memcpy(ret, command, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+int subst_length(const char* str)
+{
+	int i, depth = 0;
 
-	while (i < len && command[i] != SLSH_INPUT && command[i] != SLSH_OUTPUT && command[i] != SLSH_NOBLOCK)
+	for (i = 0; str[i] != '\0'; i++)
 	{
-		ret[i] = command[i];
-		i++;
+		if (str[i] == '(')
+			depth++;
+		else if (str[i] == SLSH_SUBST_CLOSE && --depth == 0)
+			return i+1;
 	}
-	
-	ret[i] = '\0';
-	
-	rret = (char*) realloc(ret, sizeof(char)*i);
+	return -1;
+}
 
-	if (rret != NULL)
-		ret = rret;	
-	
-	return ret;
+/* Appends line[start..end) to list, trimmed, unless it is blank. */
+
+static int cmd_list_push(CMD_LIST* list, const char* line, int start, int end, int op)
+{
+	char* item;
+
+	while (start < end && is_blank(line[start]))
+		start++;
+	while (end > start && is_blank(line[end-1]))
+		end--;
+	if (start == end)
+		return 0;
+
+	item = (char*) malloc(sizeof(char)*(end-start+1));
+	if (item == NULL)
+		return -1;
+	memcpy(item, line+start, end-start);
+	item[end-start] = '\0';
+
+	list->item[list->n] = item;
+	list->op[list->n] = list->n == 0 ? SLSH_SEQ : op;
+	list->n++;
+	return 0;
+}
+
+CMD_LIST* make_cmd_list(const char* line)
+{
+	CMD_LIST* list;
+	int len, i, start = 0, op = SLSH_SEQ, maxitems;
+
+	if (line == NULL)
+		return NULL;
+
+	len = strlen(line);
+	maxitems = len/2 + 1;
+
+	list = (CMD_LIST*) malloc(sizeof(CMD_LIST));
+	if (list == NULL)
+		return NULL;
+	list->n = 0;
+	list->item = (char**) malloc(sizeof(char*)*maxitems);
+	list->op = (int*) malloc(sizeof(int)*maxitems);
+	if (list->item == NULL || list->op == NULL)
+	{
+		destroy_cmd_list(&list);
+		return NULL;
+	}
+
+	/* Only ';', '&', '|' and '$' can end an item or start a substitution. */
+	for (i = 0; (i = scan(line+i, SCAN_SEQ | SCAN_AMP | SCAN_PIPE | SCAN_DOLLAR) - line) < len; i++)
+	{
+		int next = -1, end = i, skip = 0;
+
+		if (!strncmp(line+i, SLSH_SUBST_OPEN, strlen(SLSH_SUBST_OPEN)))
+		{
+			skip = subst_length(line+i);		/* Its separators are its own. */
+			i += skip > 0 ? skip-1 : len-i;
+			continue;
+		}
+		if (line[i] == SLSH_SEQUENCE)
+			next = SLSH_SEQ;
+		else if (line[i] == SLSH_NOBLOCK && line[i+1] == SLSH_NOBLOCK)
+		{
+			next = SLSH_AND;
+			skip = 1;
+		}
+		else if (line[i] == SLSH_NOBLOCK && (i == 0 || (line[i-1] != SLSH_OUTPUT && line[i-1] != SLSH_INPUT)))
+		{
+			next = SLSH_SEQ;
+			end = i+1;				/* The '&' stays with its job. */
+		}
+		else if (line[i] == SLSH_PIPE[0] && line[i+1] == SLSH_PIPE[0])
+		{
+			next = SLSH_OR;
+			skip = 1;
+		}
+
+		if (next < 0)
+			continue;
+
+		if (cmd_list_push(list, line, start, end, op) < 0)
+		{
+			destroy_cmd_list(&list);
+			return NULL;
+		}
+		op = next;
+		i += skip;
+		start = i+1;
+	}
+
+	if (cmd_list_push(list, line, start, len, op) < 0)
+		destroy_cmd_list(&list);
+	return list;
+}
+
+void destroy_cmd_list(CMD_LIST** list)
+{
+	int i;
+
+	if (list == NULL || *list == NULL)
+		return;
+
+	if ((*list)->item != NULL)
+	{
+		for (i = 0; i < (*list)->n; i++)
+			free((*list)->item[i]);
+	}
+	free((*list)->item);
+	free((*list)->op);
+	free(*list);
+	*list = NULL;
 }
@@ -26,24 +26,94 @@
 #define SLSH_INPUT '<'
 #define SLSH_OUTPUT '>'
 #define SLSH_NOBLOCK '&'
+#define SLSH_SEQUENCE ';'
+#define SLSH_DUP_FD '&'			/* 'N>&M' */
+#define SLSH_CLOSE_FD '-'		/* 'N>&-' */
+#define SLSH_MAX_FD 9			/* Highest N a redirection can name. */
+#define SLSH_HERE_DOC "<<"		/* 'cmd <<WORD', with the lines up to WORD after it */
+#define SLSH_HERE_STRING "<<<"	/* 'cmd <<<word' */
+#define SLSH_SUBST_OPEN "$("		/* '$(command)' */
+#define SLSH_SUBST_CLOSE ')'
+#define SLSH_PARSE_ERROR_SIZE 256	/* Room for the message of a syntax error. */
+
+/* How an element of a command list depends on the exit status left by the previous ones. */
+enum
+{
+	SLSH_SEQ = 0,			/* Always run ('a ; b', 'a & b' and the first element). */
+	SLSH_AND,				/* Run only if the status is zero ('a && b'). */
+	SLSH_OR					/* Run only if the status is non-zero ('a || b'). */
+};
+
+typedef struct cmd_list
+{
+	char** item;			/* item[i] is a single job ('|'-separated commands, redirections, '&'). */
+	int* op;				/* op[i] is the operator before item[i]. */
+	int n;
+}CMD_LIST;
+
+/* One redirection of a job: '[N]<file', '[N]>file', '[N]>>file', '[N]>&M', '[N]>&-', '[N]<<WORD' */
+/* or '[N]<<<word'. */
+enum
+{
+	REDIR_IN = 1,
+	REDIR_OUT,
+	REDIR_APPEND,
+	REDIR_DUP,
+	REDIR_CLOSE,
+	REDIR_HERE
+};
+
+typedef struct redir
+{
+	int fd;					/* The descriptor being redirected. */
+	int op;
+	char* filename;			/* For REDIR_IN, REDIR_OUT and REDIR_APPEND. */
+	int target;				/* For REDIR_DUP, what fd becomes a copy of. */
+	char* body;				/* For REDIR_HERE. NULL for a here-document until its lines are read, */
+}REDIR;						/* then filename is the word that ends them. */
 
 enum
 {
 	CMD_BG = 1,
 	CMD_CD,
+	CMD_COPROC,
+	CMD_EXEC,
 	CMD_EXIT,
+	CMD_EXPORT,
 	CMD_FG,
 	CMD_JOBS,
-	CMD_QUIT
+	CMD_PWD,
+	CMD_QUIT,
+	CMD_UNSET,
+	CMD_WAIT
 };
 
-char** split_around_blank(const char* str);
-char*** make_cmd_array(const char* command);
+/* split_words, clean_command and make_cmd_list are also used by libsolosh-parse, and return */
+/* NULL without printing anything when they run out of memory; their callers report it.      */
+
+char** split_words(const char* str);			/* Only splits. */
+char*** make_cmd_words(const char* command);	/* Each command of a pipeline, split into words. */
 void print_job_cmd(char*** cmd);
 int get_io_redir_file(const char* command, int io);
+char* get_io_redir_filename(const char* command, int io);
+int open_io_redir_file(const char* filename, int io);
+int get_redirs(const char* command, REDIR** redirs);	/* In the order they appear. Returns how many, or -1 on */
+void destroy_redirs(REDIR* redirs, int n);			/* a syntax error. */
+int get_redirs_r(const char* command, REDIR** redirs, char* err, int errsize);	/* Leaves the message in */
+																				/* err instead of printing it. */
+int open_redir_file(const REDIR* redir);				/* With O_CLOEXEC. */
+const char* find_here_doc(const char* command, int* len);	/* The next here-document's end word. */
+char* get_here_body(const char** text, const char* word, int len);	/* The lines of *text before the */
+																	/* one that is word, and moves *text */
+																	/* past it. NULL if there's none. */
+int make_here_file(const char* body);		/* A sealed memfd with body in it. */
+int open_here_file(int here);				/* Each job reads from its own offset. */
 char* clean_command(const char* command);
 int is_blocking(const char* command);
 int get_builtin_cmd(const char* command);
 char* read_line();
+int subst_length(const char* str);			/* str starts with '$(': the length up to its ')', or -1. */
+CMD_LIST* make_cmd_list(const char* line);		/* Doesn't split inside '$(...)'. */
+void destroy_cmd_list(CMD_LIST** list);
 
 #endif
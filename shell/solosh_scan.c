@@ -0,0 +1,185 @@
+/*   solosh_scan.c - metacharacter scanner
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <solosh_scan.h>
+#include <stddef.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#define SCAN_MAX_CHARS 9			/* Of all the classes together. */
+#define SCAN_END 0x80				/* '\0', which is always looked for. */
+#define SCAN_SHORT 16				/* Bytes looked at one by one before the vectors are set up. */
+
+static int char_class(unsigned char c)
+{
+	switch (c)
+	{
+		case '\0':
+			return SCAN_END;
+		case '\n':
+			return SCAN_NEWLINE;
+		case ' ':
+		case '\t':
+			return SCAN_BLANK;
+		case '|':
+			return SCAN_PIPE;
+		case '<':
+		case '>':
+			return SCAN_REDIR;
+		case '&':
+			return SCAN_AMP;
+		case ';':
+			return SCAN_SEQ;
+		case '$':
+			return SCAN_DOLLAR;
+		default:
+			return 0;
+	}
+}
+
+/* The characters of the classes, and how many there are. */
+
+static int class_chars(int classes, char* c)
+{
+	int n = 0;
+
+	if (classes & SCAN_NEWLINE)
+		c[n++] = '\n';
+	if (classes & SCAN_BLANK)
+	{
+		c[n++] = ' ';
+		c[n++] = '\t';
+	}
+	if (classes & SCAN_PIPE)
+		c[n++] = '|';
+	if (classes & SCAN_REDIR)
+	{
+		c[n++] = '<';
+		c[n++] = '>';
+	}
+	if (classes & SCAN_AMP)
+		c[n++] = '&';
+	if (classes & SCAN_SEQ)
+		c[n++] = ';';
+	if (classes & SCAN_DOLLAR)
+		c[n++] = '$';
+	return n;
+}
+
+static const char* scan_scalar(const char* s, int classes)
+{
+	while (!(char_class(*s) & (classes | SCAN_END)))
+		s++;
+	return s;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2")))
+static const char* scan_sse2(const char* s, int classes)
+{
+	char c[SCAN_MAX_CHARS];
+	__m128i want[SCAN_MAX_CHARS + 1], block, hit;
+	const char* p = (const char*) ((size_t) s & ~(size_t) 15);
+	unsigned mask;
+	int i, n = class_chars(classes, c);
+
+	for (i = 0; i < n; i++)
+		want[i] = _mm_set1_epi8(c[i]);
+	want[n++] = _mm_setzero_si128();
+
+	mask = ~0u << (s - p);				/* Not the bytes before s. */
+	for (;;)
+	{
+		block = _mm_load_si128((const __m128i*) p);
+		hit = _mm_cmpeq_epi8(block, want[0]);
+		for (i = 1; i < n; i++)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, want[i]));
+		mask &= (unsigned) _mm_movemask_epi8(hit);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 16;
+		mask = ~0u;
+	}
+}
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char* s, int classes)
+{
+	char c[SCAN_MAX_CHARS];
+	__m256i want[SCAN_MAX_CHARS + 1], block, hit;
+	const char* p = (const char*) ((size_t) s & ~(size_t) 31);
+	unsigned mask;
+	int i, n = class_chars(classes, c);
+
+	for (i = 0; i < n; i++)
+		want[i] = _mm256_set1_epi8(c[i]);
+	want[n++] = _mm256_setzero_si256();
+
+	mask = ~0u << (s - p);
+	for (;;)
+	{
+		block = _mm256_load_si256((const __m256i*) p);
+		hit = _mm256_cmpeq_epi8(block, want[0]);
+		for (i = 1; i < n; i++)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(block, want[i]));
+		mask &= (unsigned) _mm256_movemask_epi8(hit);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 32;
+		mask = ~0u;
+	}
+}
+
+#endif
+
+static const char* scan_first(const char* s, int classes);
+static const char* (*scan_impl)(const char*, int) = scan_first;
+
+/* Picks the implementation on the first call. Every thread would pick the same one, so */
+/* the race to set scan_impl is harmless. */
+
+static const char* scan_first(const char* s, int classes)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_impl = scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan_impl = scan_sse2;
+	else
+		scan_impl = scan_scalar;
+#else
+	scan_impl = scan_scalar;
+#endif
+	return scan_impl(s, classes);
+}
+
+/* Words are mostly short, and are over before the vectors would be ready. */
+
+const char* scan(const char* s, int classes)
+{
+	int i;
+
+	for (i = 0; i < SCAN_SHORT; i++, s++)
+		if (char_class(*s) & (classes | SCAN_END))
+			return s;
+	return scan_impl(s, classes);
+}
@@ -0,0 +1,38 @@
+/*   solosh_scan.h - metacharacter scanner header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_SCAN_H
+#define SOLOSH_SCAN_H
+
+/* The characters the parser stops at, by class. */
+#define SCAN_NEWLINE	0x01		/* '\n' */
+#define SCAN_BLANK		0x02		/* SLSH_BLANK_CHARS */
+#define SCAN_PIPE		0x04		/* '|' */
+#define SCAN_REDIR		0x08		/* '<' and '>' */
+#define SCAN_AMP		0x10		/* '&' */
+#define SCAN_SEQ		0x20		/* ';' */
+#define SCAN_DOLLAR		0x40		/* '$' */
+
+/* Returns the first character of s in one of the classes, or the '\0' that ends s. It looks */
+/* at 32 bytes at a time with AVX2 or 16 with SSE2, whichever the CPU has, and a byte at a   */
+/* time elsewhere. Blocks are aligned, so it never reads a page that s doesn't reach.        */
+
+const char* scan(const char* s, int classes);
+
+#endif
@@ -0,0 +1,420 @@
+/*   solosh_subst.c - command substitution
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <poll.h>
+#include <solosh_errors.h>
+#include <solosh_parser.h>
+#include <solosh_subst.h>
+#include <solosh_vars.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define INITIAL_OUTPUT_CAP 256
+
+typedef struct subst
+{
+	const char* start;		/* Where '$(' is in the text. */
+	int len;				/* Up to and including ')'. */
+	char* out;				/* What the command wrote. */
+	int outlen, outcap;
+	int fd;					/* The pipe it writes to, while open. */
+	pid_t pid;
+}SUBST;
+
+static int find_substs(const char* str, SUBST** v)
+{
+	const char* p = str;
+	SUBST* newv;
+	int n = 0, cap = 0, len;
+
+	*v = NULL;
+	while ((p = strstr(p, SLSH_SUBST_OPEN)) != NULL)
+	{
+		len = subst_length(p);
+		if (len < 0)
+		{
+			printf("Syntax error: missing '%c'.\n", SLSH_SUBST_CLOSE);
+			free(*v);
+			return -1;
+		}
+		if (n == cap)
+		{
+			cap = cap > 0 ? 2*cap : 2;
+			newv = (SUBST*) realloc(*v, sizeof(SUBST)*cap);
+			error(newv == NULL, (free(*v), -1));
+			*v = newv;
+		}
+		memset(&(*v)[n], 0, sizeof(SUBST));
+		(*v)[n].start = p;
+		(*v)[n].len = len;
+		(*v)[n].fd = -1;
+		n++;
+		p += len;
+	}
+	return n;
+}
+
+static char* subst_command(const SUBST* s)
+{
+	int len = s->len - strlen(SLSH_SUBST_OPEN) - 1;
+	char* command = (char*) malloc(sizeof(char)*(len+1));
+
+	error(command == NULL, NULL);
+	memcpy(command, s->start + strlen(SLSH_SUBST_OPEN), len);
+	command[len] = '\0';
+	return command;
+}
+
+/* Starts s's command writing to a pipe. */
+
+static int start_subst(SUBST* v, int i, int (*run)(const char* command))
+{
+	char* command;
+	int fds[2], j, status;
+
+	command = subst_command(&v[i]);
+	if (command == NULL)
+		return -1;
+	if (pipe(fds) < 0)
+	{
+		free(command);
+		error(1, -1);
+	}
+
+	fflush(stdout);
+	v[i].pid = fork();
+	if (v[i].pid == 0)
+	{
+		for (j = 0; j < i; j++)			/* The other substitutions' pipes. */
+			if (v[j].fd >= 0)
+				close(v[j].fd);
+		close(fds[0]);
+		if (fds[1] != STDOUT_FILENO)
+		{
+			dup2(fds[1], STDOUT_FILENO);
+			close(fds[1]);
+		}
+		status = run(command);
+		fflush(stdout);
+		_exit(status);
+	}
+	free(command);
+	close(fds[1]);
+	if (v[i].pid < 0)
+	{
+		close(fds[0]);
+		error(1, -1);
+	}
+	v[i].fd = fds[0];
+	return 0;
+}
+
+/* Reads every open pipe until all of them end. */
+
+static int read_substs(SUBST* v, int n)
+{
+	struct pollfd* fds;
+	char* newout;
+	int i, k, open, got;
+
+	fds = (struct pollfd*) malloc(sizeof(struct pollfd)*n);
+	error(fds == NULL, -1);
+
+	for (;;)
+	{
+		for (i = open = 0; i < n; i++)
+		{
+			fds[i].fd = v[i].fd;			/* Negative ones are ignored by poll. */
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			open += v[i].fd >= 0;
+		}
+		if (open == 0)
+			break;
+		if (poll(fds, n, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			free(fds);
+			error(1, -1);
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (fds[i].revents == 0)
+				continue;
+			if (v[i].outcap - v[i].outlen < INITIAL_OUTPUT_CAP)
+			{
+				k = v[i].outcap > 0 ? 2*v[i].outcap : INITIAL_OUTPUT_CAP;
+				newout = (char*) realloc(v[i].out, k);
+				error(newout == NULL, (free(fds), -1));
+				v[i].out = newout;
+				v[i].outcap = k;
+			}
+			got = read(v[i].fd, v[i].out + v[i].outlen, v[i].outcap - v[i].outlen);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+			{
+				close(v[i].fd);
+				v[i].fd = -1;
+			}
+			else
+				v[i].outlen += got;
+		}
+	}
+	free(fds);
+	return 0;
+}
+
+static int append(char** ret, int* len, int* cap, const char* str, int n)
+{
+	char* newret;
+
+	while (*len + n + 1 > *cap)
+	{
+		newret = (char*) realloc(*ret, 2*(*cap));
+		error(newret == NULL, -1);
+		*ret = newret;
+		*cap *= 2;
+	}
+	memcpy(*ret + *len, str, n);
+	*len += n;
+	(*ret)[*len] = '\0';
+	return 0;
+}
+
+/* Appends str[0..n), with its variables expanded if vars is set. */
+
+static int append_expanded(char** ret, int* len, int* cap, const char* str, int n, int vars)
+{
+	char* text, *expanded;
+	int err;
+
+	if (!vars)
+		return append(ret, len, cap, str, n);
+
+	text = (char*) malloc(sizeof(char)*(n+1));
+	error(text == NULL, -1);
+	memcpy(text, str, n);
+	text[n] = '\0';
+	expanded = expand_vars(text);
+	free(text);
+	if (expanded == NULL)
+		return -1;
+	err = append(ret, len, cap, expanded, strlen(expanded));
+	free(expanded);
+	return err;
+}
+
+static void destroy_substs(SUBST* v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (v[i].fd >= 0)
+			close(v[i].fd);
+		while (v[i].pid > 0 && waitpid(v[i].pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		free(v[i].out);
+	}
+	free(v);
+}
+
+static char* copy_text(const char* str, int n)
+{
+	char* ret = (char*) malloc(sizeof(char)*(n+1));
+
+	error(ret == NULL, NULL);
+	memcpy(ret, str, n);
+	ret[n] = '\0';
+	return ret;
+}
+
+/* Moves v[i]'s output and text into hide, and appends the mark that stands for them. */
+
+static int hide_subst(char** ret, int* len, int* cap, SUBST* v, int i, SUBSTS* hide)
+{
+	char mark[32];
+
+	hide->text[i] = copy_text(v[i].start, v[i].len);
+	hide->out[i] = copy_text(v[i].out != NULL ? v[i].out : "", v[i].outlen);
+	error(hide->text[i] == NULL || hide->out[i] == NULL, -1);
+	sprintf(mark, "%c%d%c", SLSH_SUBST_MARK, i, SLSH_SUBST_MARK);
+	return append(ret, len, cap, mark, strlen(mark));
+}
+
+/* With hide set, the outputs are kept there and marks put in their place. */
+
+static char* substitute(const char* str, int (*run)(const char* command), char* (*builtin)(const char* command),
+						SUBSTS* hide)
+{
+	SUBST* v;
+	char* ret, *command;
+	const char* p = str;
+	int n, i, k, len = 0, cap = INITIAL_OUTPUT_CAP, err = 0;
+
+	n = find_substs(str, &v);
+	if (n < 0)
+		return NULL;
+	if (n == 0)
+		return hide != NULL ? copy_text(str, strlen(str)) : expand_vars(str);
+	if (hide != NULL)
+	{
+		hide->text = (char**) calloc(n, sizeof(char*));
+		hide->out = (char**) calloc(n, sizeof(char*));
+		hide->n = n;
+		error(hide->text == NULL || hide->out == NULL, (destroy_substs(v, n), NULL));
+	}
+
+	for (i = 0; i < n && !err; i++)
+	{
+		command = builtin != NULL ? subst_command(&v[i]) : NULL;
+		v[i].out = command != NULL ? builtin(command) : NULL;
+		free(command);
+		if (v[i].out != NULL)
+			v[i].outlen = v[i].outcap = strlen(v[i].out);
+		else
+			err = start_subst(v, i, run) < 0;
+	}
+	if (!err)
+		err = read_substs(v, n) < 0;
+
+	ret = (char*) malloc(sizeof(char)*cap);
+	if (ret == NULL || err)
+	{
+		free(ret);
+		destroy_substs(v, n);
+		error(!err, NULL);
+		return NULL;
+	}
+	ret[0] = '\0';
+
+	for (i = 0; i < n && !err; i++)
+	{
+		while (v[i].outlen > 0 && v[i].out[v[i].outlen-1] == '\n')
+			v[i].outlen--;
+		for (k = 0; k < v[i].outlen; k++)
+			if (v[i].out[k] == '\n')
+				v[i].out[k] = ' ';		/* A newline would end the command. */
+		err = append_expanded(&ret, &len, &cap, p, v[i].start - p, hide == NULL) < 0;
+		if (!err && hide != NULL)
+			err = hide_subst(&ret, &len, &cap, v, i, hide) < 0;
+		else if (!err)
+			err = append(&ret, &len, &cap, v[i].out != NULL ? v[i].out : "", v[i].outlen) < 0;
+		p = v[i].start + v[i].len;
+	}
+	if (!err)
+		err = append_expanded(&ret, &len, &cap, p, strlen(p), hide == NULL) < 0;
+
+	destroy_substs(v, n);
+	if (err)
+		return (free(ret), NULL);
+	return ret;
+}
+
+char* expand_subst(const char* str, int (*run)(const char* command), char* (*builtin)(const char* command))
+{
+	return substitute(str, run, builtin, NULL);
+}
+
+char* hide_substs(const char* str, SUBSTS* s, int (*run)(const char* command), char* (*builtin)(const char* command))
+{
+	char* ret;
+
+	memset(s, 0, sizeof(SUBSTS));
+	ret = substitute(str, run, builtin, s);
+	if (ret == NULL)
+		free_substs(s);
+	return ret;
+}
+
+/* Puts with[i] in place of each mark of i. Anything that only looks like a mark stays. */
+
+static char* replace_marks(const char* str, char** with, int n)
+{
+	const char* p = str, *q;
+	char* ret, *end;
+	int len = 0, cap = INITIAL_OUTPUT_CAP;
+	long i;
+
+	ret = (char*) malloc(sizeof(char)*cap);
+	error(ret == NULL, NULL);
+	ret[0] = '\0';
+	while ((q = strchr(p, SLSH_SUBST_MARK)) != NULL)
+	{
+		i = strtol(q+1, &end, 10);
+		if (append(&ret, &len, &cap, p, q - p) < 0)
+			return (free(ret), NULL);
+		if (end > q+1 && *end == SLSH_SUBST_MARK && i >= 0 && i < n)
+		{
+			if (append(&ret, &len, &cap, with[i], strlen(with[i])) < 0)
+				return (free(ret), NULL);
+			p = end + 1;
+		}
+		else
+		{
+			if (append(&ret, &len, &cap, q, 1) < 0)
+				return (free(ret), NULL);
+			p = q + 1;
+		}
+	}
+	if (append(&ret, &len, &cap, p, strlen(p)) < 0)
+		return (free(ret), NULL);
+	return ret;
+}
+
+char* expand_word(const char* word, const SUBSTS* s)
+{
+	char* vars, *ret;
+
+	vars = strchr(word, SLSH_VAR_SIGN) != NULL ? expand_vars(word) : copy_text(word, strlen(word));
+	if (vars == NULL || s->n == 0 || strchr(vars, SLSH_SUBST_MARK) == NULL)
+		return vars;
+	ret = replace_marks(vars, s->out, s->n);
+	free(vars);
+	return ret;
+}
+
+char* show_substs(const char* str, const SUBSTS* s)
+{
+	if (s->n == 0 || strchr(str, SLSH_SUBST_MARK) == NULL)
+		return copy_text(str, strlen(str));
+	return replace_marks(str, s->text, s->n);
+}
+
+void free_substs(SUBSTS* s)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++)
+	{
+		if (s->text != NULL)
+			free(s->text[i]);
+		if (s->out != NULL)
+			free(s->out[i]);
+	}
+	free(s->text);
+	free(s->out);
+	memset(s, 0, sizeof(SUBSTS));
+}
@@ -0,0 +1,54 @@
+/*   solosh_subst.h - command substitution header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_SUBST_H
+#define SOLOSH_SUBST_H
+
+/* Replaces each '$(command)' in str with what the command writes to stdout, less its trailing */
+/* newlines and with the others made blanks, and expands the variables around them. The output */
+/* is read through a pipe into a buffer that grows as needed.                                 */
+/*                                                                                            */
+/* builtin is asked first: if it returns the output of a command (malloc'd), no process is    */
+/* started for it. Every other command runs in a forked shell that calls run and exits with   */
+/* its status. Those are all started before any of them is read, so the substitutions of one  */
+/* line run concurrently. A '$(...)' nested in a command is that command's shell's business.  */
+/*                                                                                            */
+/* Returns NULL on error, like a missing ')'. The result must be freed.                       */
+
+char* expand_subst(const char* str, int (*run)(const char* command), char* (*builtin)(const char* command));
+
+/* A command is parsed before its words are expanded, so what a '$(...)' writes is never read */
+/* as syntax. hide_substs runs them as expand_subst does but leaves a mark in place of each, */
+/* and its variables alone; expand_word then expands one word of the parsed command.         */
+
+#define SLSH_SUBST_MARK '\001'		/* MARK index MARK */
+
+typedef struct substs
+{
+	char** text;			/* Each '$(command)' as written. */
+	char** out;				/* What it wrote, ready to be split at blanks. */
+	int n;
+}SUBSTS;
+
+char* hide_substs(const char* str, SUBSTS* s, int (*run)(const char* command), char* (*builtin)(const char* command));
+char* expand_word(const char* word, const SUBSTS* s);		/* Variables first, then the marks. */
+char* show_substs(const char* str, const SUBSTS* s);		/* Puts back what the marks stand for. */
+void free_substs(SUBSTS* s);
+
+#endif
@@ -0,0 +1,490 @@
+/*   solosh_vars.c - shell variables and environment
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <solosh_errors.h>
+#include <solosh_vars.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 64
+#define INITIAL_ENV_CAP 64
+#define INITIAL_EXPANSION_CAP 64
+
+extern char** environ;
+
+typedef struct var
+{
+	char* name;
+	char* value;
+	char* entry;			/* "NAME=VALUE", kept only while the variable is exported. */
+	int envidx;				/* Position of entry in env, or -1 if the variable is not exported. */
+	unsigned long hash;
+	struct var* next;
+}VAR;
+
+static VAR** table = NULL;
+static int nbuckets = 0, nvars = 0;
+
+static char** env = NULL;	/* NULL-terminated; environ points here once vars_init has run. */
+static int envlen = 0, envcap = 0;
+
+/* ------- HASH TABLE ------- */
+
+static int is_name_start(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int is_name_char(char c)
+{
+	return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+static unsigned long hash_name(const char* name, int len)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		h ^= (unsigned char) name[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static VAR* find_var(const char* name, int len, unsigned long hash)
+{
+	VAR* v;
+
+	if (table == NULL)
+		return NULL;
+
+	for (v = table[hash % nbuckets]; v != NULL; v = v->next)
+	{
+		if (v->hash == hash && !strncmp(v->name, name, len) && v->name[len] == '\0')
+			return v;
+	}
+	return NULL;
+}
+
+static int grow_table()
+{
+	VAR** newtable, *v, *next;
+	int newsize = nbuckets*2, i;
+
+	newtable = (VAR**) calloc(newsize, sizeof(VAR*));
+	error(newtable == NULL, -1);
+
+	for (i = 0; i < nbuckets; i++)
+	{
+		for (v = table[i]; v != NULL; v = next)
+		{
+			next = v->next;
+			v->next = newtable[v->hash % newsize];
+			newtable[v->hash % newsize] = v;
+		}
+	}
+	free(table);
+	table = newtable;
+	nbuckets = newsize;
+	return 0;
+}
+
+/* Returns the variable called name, creating it (with an empty value) if needed. */
+
+static VAR* intern_var(const char* name, int len)
+{
+	unsigned long hash = hash_name(name, len);
+	VAR* v = find_var(name, len, hash);
+
+	if (v != NULL)
+		return v;
+
+	if (table == NULL)
+	{
+		table = (VAR**) calloc(INITIAL_BUCKETS, sizeof(VAR*));
+		error(table == NULL, NULL);
+		nbuckets = INITIAL_BUCKETS;
+	}
+	if (4*(nvars+1) > 3*nbuckets)
+		error(grow_table() < 0, NULL);
+
+	v = (VAR*) calloc(1, sizeof(VAR));
+	error(v == NULL, NULL);
+	v->name = (char*) malloc(sizeof(char)*(len+1));
+	v->value = (char*) calloc(1, sizeof(char));
+	if (v->name == NULL || v->value == NULL)
+	{
+		free(v->name);
+		free(v->value);
+		free(v);
+		error(1, NULL);
+	}
+	memcpy(v->name, name, len);
+	v->name[len] = '\0';
+	v->envidx = -1;
+	v->hash = hash;
+
+	v->next = table[hash % nbuckets];
+	table[hash % nbuckets] = v;
+	nvars++;
+	return v;
+}
+
+/* ------- ENVIRONMENT ------- */
+
+/* Rebuilds v's "NAME=VALUE" string and puts it in its slot, appending a slot if v was not exported. */
+
+static int env_update(VAR* v)
+{
+	int nlen = strlen(v->name), vlen = strlen(v->value);
+	char* entry = (char*) malloc(sizeof(char)*(nlen+vlen+2));
+
+	error(entry == NULL, -1);
+	memcpy(entry, v->name, nlen);
+	entry[nlen] = SLSH_ASSIGN;
+	memcpy(entry+nlen+1, v->value, vlen+1);
+
+	if (v->envidx < 0)
+	{
+		if (envlen+1 >= envcap)
+		{
+			int newcap = envcap > 0 ? 2*envcap : INITIAL_ENV_CAP;
+			char** newenv = (char**) realloc(env, sizeof(char*)*newcap);
+			error(newenv == NULL, (free(entry), -1));
+			env = newenv;
+			envcap = newcap;
+			environ = env;
+		}
+		v->envidx = envlen++;
+		env[envlen] = NULL;
+	}
+	free(v->entry);
+	v->entry = entry;
+	env[v->envidx] = entry;
+	return 0;
+}
+
+/* Takes v's entry out of env, moving the last entry into its slot. */
+
+static void env_remove(VAR* v)
+{
+	char* last;
+	VAR* moved;
+
+	if (v->envidx < 0)
+		return;
+
+	last = env[--envlen];
+	if (last != v->entry)
+	{
+		moved = find_var(last, strchr(last, SLSH_ASSIGN) - last, hash_name(last, strchr(last, SLSH_ASSIGN) - last));
+		env[v->envidx] = last;
+		if (moved != NULL)
+			moved->envidx = v->envidx;
+	}
+	env[envlen] = NULL;
+	free(v->entry);
+	v->entry = NULL;
+	v->envidx = -1;
+}
+
+/* ------- INTERFACE ------- */
+
+int vars_init()
+{
+	char** iter, *eq;
+	VAR* v;
+
+	env = (char**) malloc(sizeof(char*)*INITIAL_ENV_CAP);
+	error(env == NULL, -1);
+	envcap = INITIAL_ENV_CAP;
+	envlen = 0;
+	env[0] = NULL;
+
+	for (iter = environ; iter != NULL && *iter != NULL; iter++)
+	{
+		eq = strchr(*iter, SLSH_ASSIGN);
+		if (eq == NULL || eq == *iter)
+			continue;
+		v = intern_var(*iter, eq - *iter);
+		error(v == NULL, -1);
+		error(var_set(v->name, eq+1) < 0, -1);
+		error(var_export(v->name) < 0, -1);
+	}
+	environ = env;
+	return 0;
+}
+
+void vars_destroy()
+{
+	VAR* v, *next;
+	int i;
+
+	for (i = 0; i < nbuckets; i++)
+	{
+		for (v = table[i]; v != NULL; v = next)
+		{
+			next = v->next;
+			free(v->name);
+			free(v->value);
+			free(v->entry);
+			free(v);
+		}
+	}
+	free(table);
+	table = NULL;
+	nbuckets = nvars = 0;
+
+	if (environ == env)
+		environ = NULL;
+	free(env);
+	env = NULL;
+	envlen = envcap = 0;
+}
+
+const char* var_get(const char* name)
+{
+	VAR* v;
+	int len = strlen(name);
+
+	v = find_var(name, len, hash_name(name, len));
+	return v != NULL ? v->value : NULL;
+}
+
+int var_set(const char* name, const char* value)
+{
+	VAR* v = intern_var(name, strlen(name));
+	char* newvalue;
+
+	if (v == NULL)
+		return -1;
+
+	newvalue = (char*) malloc(sizeof(char)*(strlen(value)+1));
+	error(newvalue == NULL, -1);
+	strcpy(newvalue, value);
+	free(v->value);
+	v->value = newvalue;
+
+	if (v->envidx >= 0)
+		return env_update(v);
+	return 0;
+}
+
+int var_export(const char* name)
+{
+	VAR* v = intern_var(name, strlen(name));
+
+	if (v == NULL)
+		return -1;
+	if (v->envidx >= 0)
+		return 0;
+	return env_update(v);
+}
+
+int var_unset(const char* name)
+{
+	VAR** iter;
+	VAR* v;
+	int len = strlen(name);
+	unsigned long hash = hash_name(name, len);
+
+	if (table == NULL)
+		return 0;
+
+	for (iter = &table[hash % nbuckets]; *iter != NULL; iter = &(*iter)->next)
+	{
+		v = *iter;
+		if (v->hash == hash && !strcmp(v->name, name))
+		{
+			env_remove(v);
+			*iter = v->next;
+			free(v->name);
+			free(v->value);
+			free(v);
+			nvars--;
+			return 0;
+		}
+	}
+	return 0;
+}
+
+int is_assignment(const char* word)
+{
+	const char* p = word;
+
+	if (word == NULL || !is_name_start(*p))
+		return 0;
+	while (is_name_char(*p))
+		p++;
+	return *p == SLSH_ASSIGN;
+}
+
+int var_assign(const char* word, int export)
+{
+	const char* eq;
+	char* name;
+	int ret;
+
+	if (!is_assignment(word))
+		return -1;
+
+	eq = strchr(word, SLSH_ASSIGN);
+	name = (char*) malloc(sizeof(char)*(eq-word+1));
+	error(name == NULL, -1);
+	memcpy(name, word, eq-word);
+	name[eq-word] = '\0';
+	ret = var_set(name, eq+1);
+	if (ret == 0 && export)
+		ret = var_export(name);
+	free(name);
+	return ret;
+}
+
+/* ------- EXPANSION ------- */
+
+static int append(char** buf, int* len, int* cap, const char* s, int n)
+{
+	if (*len + n + 1 > *cap)
+	{
+		int newcap = *cap;
+		char* newbuf;
+
+		while (*len + n + 1 > newcap)
+			newcap *= 2;
+		newbuf = (char*) realloc(*buf, sizeof(char)*newcap);
+		error(newbuf == NULL, -1);
+		*buf = newbuf;
+		*cap = newcap;
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+/* p is at a '$'. Finds the name after it and returns how long the whole reference is, braces */
+/* included, or 0 if it isn't one. */
+
+static int var_ref(const char* p, const char** name, int* namelen)
+{
+	int skip = 0;
+
+	*name = p+1;
+	if (**name == '{')
+	{
+		(*name)++;
+		skip = 1;
+	}
+	*namelen = 0;
+	if (is_name_start((*name)[0]))
+		while (is_name_char((*name)[*namelen]))
+			(*namelen)++;
+	else if (((*name)[0] >= '0' && (*name)[0] <= '9') || (*name)[0] == '#')
+		*namelen = 1;			/* Positional parameters and the argument count. */
+
+	if (*namelen == 0 || (skip && (*name)[*namelen] != '}'))
+		return 0;
+	return 1 + skip + *namelen + skip;
+}
+
+char* expand_vars(const char* str)
+{
+	int len = 0, cap = INITIAL_EXPANSION_CAP, namelen, reflen;
+	const char* p = str, *name, *run;
+	char* ret;
+	VAR* v;
+
+	if (str == NULL)
+		return NULL;
+
+	ret = (char*) malloc(sizeof(char)*cap);
+	error(ret == NULL, NULL);
+	ret[0] = '\0';
+
+	while (*p != '\0')
+	{
+		run = p;
+		while (*p != '\0' && *p != SLSH_VAR_SIGN)
+			p++;
+		if (append(&ret, &len, &cap, run, p - run) < 0)
+			return (free(ret), NULL);
+		if (*p == '\0')
+			break;
+
+		reflen = var_ref(p, &name, &namelen);
+		if (reflen == 0)
+		{
+			if (append(&ret, &len, &cap, p, 1) < 0)		/* Not a variable: keep the '$'. */
+				return (free(ret), NULL);
+			p++;
+			continue;
+		}
+
+		v = find_var(name, namelen, hash_name(name, namelen));
+		if (v != NULL && append(&ret, &len, &cap, v->value, strlen(v->value)) < 0)
+			return (free(ret), NULL);
+		p += reflen;
+	}
+	return ret;
+}
+
+/* Whether the reference at p names a descriptor: '$FD>file' or '$FD<file' at the start of a */
+/* word, or '>&$FD' and '<&$FD'. */
+
+static int is_fd_ref(const char* str, const char* p, int reflen)
+{
+	if ((p[reflen] == '<' || p[reflen] == '>') && (p == str || p[-1] == ' ' || p[-1] == '\t'))
+		return 1;
+	return p - str >= 2 && p[-1] == '&' && (p[-2] == '<' || p[-2] == '>');
+}
+
+char* expand_fd_vars(const char* str)
+{
+	int len = 0, cap = INITIAL_EXPANSION_CAP, namelen, reflen;
+	const char* p = str, *run = str, *name;
+	char* ret;
+	VAR* v;
+
+	ret = (char*) malloc(sizeof(char)*cap);
+	error(ret == NULL, NULL);
+	ret[0] = '\0';
+
+	while ((p = strchr(p, SLSH_VAR_SIGN)) != NULL)
+	{
+		reflen = var_ref(p, &name, &namelen);
+		if (reflen == 0 || !is_fd_ref(str, p, reflen))
+		{
+			p++;
+			continue;
+		}
+		v = find_var(name, namelen, hash_name(name, namelen));
+		if (v != NULL && v->value[0] != '\0' && v->value[strspn(v->value, "0123456789")] == '\0')
+		{
+			if (append(&ret, &len, &cap, run, p - run) < 0 || append(&ret, &len, &cap, v->value, strlen(v->value)) < 0)
+				return (free(ret), NULL);
+			run = p + reflen;
+		}
+		p += reflen;
+	}
+	if (append(&ret, &len, &cap, run, strlen(run)) < 0)
+		return (free(ret), NULL);
+	return ret;
+}
@@ -0,0 +1,42 @@
+/*   solosh_vars.h - shell variables header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_VARS_H
+#define SOLOSH_VARS_H
+
+#define SLSH_VAR_SIGN '$'
+#define SLSH_ASSIGN '='
+
+/* Variables live in a hash table, one entry per name. Exported variables also keep a "NAME=VALUE" */
+/* string in the environment array, which is patched in place whenever one of them changes and is  */
+/* what 'environ' points to. Children therefore inherit it without any per-spawn copying.          */
+
+int vars_init();							/* Imports the initial environment. */
+void vars_destroy();
+const char* var_get(const char* name);
+int var_set(const char* name, const char* value);
+int var_export(const char* name);
+int var_unset(const char* name);
+int is_assignment(const char* word);		/* NAME=VALUE */
+int var_assign(const char* word, int export);	/* Applies a NAME=VALUE word. */
+char* expand_vars(const char* str);		/* Replaces $NAME, ${NAME}, $1...$9 and $#. The result must be freed. */
+char* expand_fd_vars(const char* str);		/* Only the variables that name the descriptor of a redirection, */
+											/* and only when they hold a number. The rest stay for the words. */
+
+#endif
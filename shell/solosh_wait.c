@@ -0,0 +1,84 @@
+/*   solosh_wait.c - waiting for processes
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE				/* ppoll() and syscall() */
+#include <poll.h>
+#include <solosh_errors.h>
+#include <solosh_wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434		/* The same on every architecture. */
+#endif
+
+#define WAIT_FALLBACK_NSEC 10000000
+
+/* Without pidfds (Linux before 5.3) there is nothing to poll, so this just naps with mask */
+/* and lets the caller look again. */
+
+static int nap(const sigset_t* mask)
+{
+	struct timespec t;
+
+	t.tv_sec = 0;
+	t.tv_nsec = WAIT_FALLBACK_NSEC;
+	if (ppoll(NULL, 0, &t, mask) < 0 && errno != EINTR)
+		return -1;
+	return 0;
+}
+
+int wait_pids(const pid_t* pids, int n, const sigset_t* mask)
+{
+	struct pollfd* fds;
+	int i, k = 0, ret = 0;
+
+	fds = (struct pollfd*) malloc(sizeof(struct pollfd)*(n > 0 ? n : 1));
+	error(fds == NULL, -1);
+
+	for (i = 0; i < n; i++)
+	{
+		if (pids[i] <= 0)
+			continue;
+		fds[k].fd = syscall(SYS_pidfd_open, pids[i], 0);
+		fds[k].events = POLLIN;
+		if (fds[k].fd >= 0)
+		{
+			k++;
+			continue;
+		}
+		if (errno == ENOSYS)
+			ret = nap(mask);
+		else if (errno != ESRCH)		/* ESRCH: it's gone already. */
+			ret = -1;
+		break;
+	}
+
+	if (i == n && k > 0 && ppoll(fds, k, NULL, mask) < 0 && errno != EINTR)
+		ret = -1;
+	else if (i == n && k == 0)
+		ret = nap(mask);
+
+	while (k > 0)
+		close(fds[--k].fd);
+	free(fds);
+	return ret;
+}
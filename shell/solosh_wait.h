@@ -0,0 +1,33 @@
+/*   solosh_wait.h - waiting for processes header
+     Copyright (C) 2016 Rodrigo Weigert <rodrigo.weigert@usp.br>
+
+     This file is part of SoloSH.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOLOSH_WAIT_H
+#define SOLOSH_WAIT_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+/* Sleeps until one of the n processes in pids ends or a signal arrives, with mask as the     */
+/* signal mask meanwhile, like pselect. Each process gets a pidfd, opened before the mask is  */
+/* swapped, so called with SIGCHLD blocked it can't miss an end or watch a reused pid. Pids   */
+/* that are not positive are ignored. Returns 0 when something may have ended, -1 on error.  */
+
+int wait_pids(const pid_t* pids, int n, const sigset_t* mask);
+
+#endif